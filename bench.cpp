@@ -0,0 +1,669 @@
+/*
+ * Copyright (c) 2015 Srijan R Shetty
+ * Author: Srijan R Shetty <srijan.shetty+code@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+// Configuration file
+#include "config.h"
+
+// Runtime parameters
+#include "options.h"
+
+// The structures to measure
+#include "vafile.h"
+#include "linear.h"
+
+// Query results
+#include "results.h"
+
+// Objects of the update check
+#include "loader.h"
+
+// Parallel scans
+#include "threadpool.h"
+
+// Page cache control
+#include <fcntl.h>
+#include <unistd.h>
+
+// Stream processing
+#include <iostream>
+#include <fstream>
+#include <sstream>
+
+// STL
+#include <vector>
+#include <string>
+#include <random>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cmath>
+#include <atomic>
+#include <new>
+
+// Time
+#include <chrono>
+
+using namespace std;
+
+// Heap allocations made by the process, counted to check the query path
+atomic<long long> allocationCount(0);
+
+void *operator new(size_t size) {
+    ++allocationCount;
+    void *memory = malloc(size == 0 ? 1 : size);
+    if (memory == NULL) {
+        throw bad_alloc();
+    }
+    return memory;
+}
+
+void operator delete(void *memory) noexcept {
+    free(memory);
+}
+
+/**
+ * Parameters of the benchmark, the index parameters are in Options
+ */
+struct BenchOptions {
+    // Runs
+    int warmup;
+    int repetitions;
+    bool warm;
+    bool cold;
+    bool va;
+    bool linear;
+    bool json;
+    bool checkAllocations;
+    bool checkUpdates;
+    bool recall;
+
+    // Synthetic data, generated when distribution is set
+    string distribution;
+    long long rows;
+    long long queryCount;
+    double radius;
+    long long maxK;
+    unsigned seed;
+};
+
+/**
+ * A query of the query file
+ */
+struct BenchQuery {
+    int type;
+    vector<double> point;
+    double radius;
+    long long k;
+};
+
+/**
+ * Measurements of one structure, mode and query type
+ */
+struct Result {
+    string structure;
+    string mode;
+    int type;
+    vector<double> latencies;
+    double candidates;
+    double allocations;
+    double seconds;
+
+    // Mean share of the true neighbours a kNN query found, -1 if not scored
+    double recall;
+};
+
+void printBenchUsage(const char *program) {
+    cerr << "Usage: " << program << " [bench options] [index options]" << endl
+        << "  --warmup N                  untimed runs over the queries, default 1" << endl
+        << "  --repetitions N             timed runs over the queries, default 3" << endl
+        << "  --mode warm|cold|both       page cache state, cold drops the VAFile pages before every query" << endl
+        << "  --structures va|linear|both structures to measure, default both" << endl
+        << "  --format csv|json           output format, default csv" << endl
+        << "  --generate uniform|exp|clustered" << endl
+        << "                              write a synthetic data file and query file first" << endl
+        << "  --rows N                    objects to generate, default 10000" << endl
+        << "  --query-count N             queries to generate, default 300" << endl
+        << "  --max-radius R              largest range query radius, default 0.001" << endl
+        << "  --max-k N                   largest kNN k, default 50" << endl
+        << "  --seed N                    seed of the generator, default 1" << endl
+        << "  --check-allocations         fail if a warm timed query allocates" << endl
+        << "  --check-updates             fail if point queries differ after an insert, delete and compaction" << endl
+        << "  --recall                    score the VAFile kNN results against the linear array" << endl
+        << "The index options are those of tree.out, --data and --queries name the files." << endl;
+    printUsage(program);
+}
+
+/**
+ * Split the arguments into the benchmark options and the index options
+ * @return false if a benchmark argument is not understood
+ */
+bool parseBenchOptions(int argc, char **argv, BenchOptions& bench, vector<char *>& rest) {
+    bench.warmup = 1;
+    bench.repetitions = 3;
+    bench.warm = true;
+    bench.cold = false;
+    bench.va = true;
+    bench.linear = true;
+    bench.json = false;
+    bench.checkAllocations = false;
+    bench.checkUpdates = false;
+    bench.recall = false;
+    bench.rows = 10000;
+    bench.queryCount = 300;
+    bench.radius = 0.001;
+    bench.maxK = 50;
+    bench.seed = 1;
+
+    rest.push_back(argv[0]);
+    for (int i = 1; i < argc; ++i) {
+        string argument = argv[i];
+        if (argument == "--check-allocations") {
+            bench.checkAllocations = true;
+            continue;
+        }
+        if (argument == "--check-updates") {
+            bench.checkUpdates = true;
+            continue;
+        }
+        if (argument == "--recall") {
+            bench.recall = true;
+            continue;
+        }
+        bool valued = argument == "--warmup" || argument == "--repetitions" || argument == "--mode"
+            || argument == "--structures" || argument == "--format" || argument == "--generate"
+            || argument == "--rows" || argument == "--query-count" || argument == "--max-radius"
+            || argument == "--max-k" || argument == "--seed";
+        if (!valued) {
+            rest.push_back(argv[i]);
+            continue;
+        }
+        if (i + 1 >= argc) {
+            return false;
+        }
+
+        string value = argv[++i];
+        if (argument == "--warmup") {
+            bench.warmup = atoi(value.c_str());
+        } else if (argument == "--repetitions") {
+            bench.repetitions = atoi(value.c_str());
+        } else if (argument == "--mode") {
+            bench.warm = value == "warm" || value == "both";
+            bench.cold = value == "cold" || value == "both";
+        } else if (argument == "--structures") {
+            bench.va = value == "va" || value == "both";
+            bench.linear = value == "linear" || value == "both";
+        } else if (argument == "--format") {
+            bench.json = value == "json";
+            if (value != "json" && value != "csv") {
+                return false;
+            }
+        } else if (argument == "--generate") {
+            bench.distribution = value;
+            if (value != "uniform" && value != "exp" && value != "clustered") {
+                return false;
+            }
+        } else if (argument == "--rows") {
+            bench.rows = atoll(value.c_str());
+        } else if (argument == "--query-count") {
+            bench.queryCount = atoll(value.c_str());
+        } else if (argument == "--max-radius") {
+            bench.radius = atof(value.c_str());
+        } else if (argument == "--max-k") {
+            bench.maxK = atoll(value.c_str());
+        } else if (argument == "--seed") {
+            bench.seed = atoi(value.c_str());
+        }
+    }
+
+    return bench.warmup >= 0 && bench.repetitions > 0 && (bench.warm || bench.cold) && (bench.va || bench.linear)
+        && bench.rows > 0 && bench.queryCount >= 0 && bench.maxK > 0;
+}
+
+/**
+ * Write a synthetic data file and a query file. Coordinates are in [0, 1]:
+ * uniform, exponential with mean 0.11 like the exp sample, or gaussian
+ * clusters around 16 uniform centres. Queries cycle through the three types,
+ * point queries hit a random object.
+ * @return false if either file cannot be written
+ */
+bool generate(const BenchOptions& bench, const Options& options) {
+    mt19937_64 random(bench.seed);
+    uniform_real_distribution<double> uniform(0, 1);
+    exponential_distribution<double> exponential(9);
+    normal_distribution<double> normal(0, 0.05);
+
+    int dimensions = options.dimensions;
+    vector<double> centres(16 * dimensions);
+    for (auto& coordinate : centres) {
+        coordinate = uniform(random);
+    }
+
+    // Coordinates are written with 4 decimals, as in the sample files
+    vector<double> points(bench.rows * dimensions);
+    for (long long index = 0; index < bench.rows; ++index) {
+        long long centre = random() % 16;
+        for (int i = 0; i < dimensions; ++i) {
+            double coordinate;
+            if (bench.distribution == "uniform") {
+                coordinate = uniform(random);
+            } else if (bench.distribution == "exp") {
+                coordinate = exponential(random);
+            } else {
+                coordinate = centres[centre * dimensions + i] + normal(random);
+            }
+            points[index * dimensions + i] = round(min(1.0, max(0.0, coordinate)) * 1e4) / 1e4;
+        }
+    }
+
+    FILE *data = fopen(options.dataFile.c_str(), "w");
+    if (data == NULL) {
+        return false;
+    }
+    for (long long index = 0; index < bench.rows; ++index) {
+        for (int i = 0; i < dimensions; ++i) {
+            fprintf(data, "%.4f\t", points[index * dimensions + i]);
+        }
+
+        // A short random data string
+        int length = 1 + random() % 4;
+        for (int c = 0; c < length; ++c) {
+            fputc('a' + random() % 26, data);
+        }
+        fputc('\n', data);
+    }
+    bool written = !ferror(data);
+    if (fclose(data) != 0 || !written) {
+        return false;
+    }
+
+    FILE *queries = fopen(options.queryFile.c_str(), "w");
+    if (queries == NULL) {
+        return false;
+    }
+    for (long long query = 0; query < bench.queryCount; ++query) {
+        int type = 1 + query % 3;
+        fprintf(queries, "%d", type);
+        long long object = random() % bench.rows;
+        for (int i = 0; i < dimensions; ++i) {
+            double coordinate = type == 1 ? points[object * dimensions + i] : uniform(random);
+            fprintf(queries, "\t%.4f", coordinate);
+        }
+        if (type == 2) {
+            fprintf(queries, "\t%f", uniform(random) * bench.radius);
+        } else if (type == 3) {
+            fprintf(queries, "\t%lld", 1 + (long long) (random() % bench.maxK));
+        }
+        fputc('\n', queries);
+    }
+    written = !ferror(queries);
+    return fclose(queries) == 0 && written;
+}
+
+vector<BenchQuery> readQueries(const string& filename, int dimensions) {
+    vector<BenchQuery> queries;
+    ifstream ifile(filename);
+    for (BenchQuery query; ifile >> query.type; ) {
+        query.point.resize(dimensions);
+        for (int i = 0; i < dimensions; ++i) {
+            ifile >> query.point[i];
+        }
+        query.radius = 0;
+        query.k = 0;
+        if (query.type == VAFile::RANGE) {
+            ifile >> query.radius;
+        } else if (query.type == VAFile::KNN) {
+            ifile >> query.k;
+        }
+        queries.push_back(query);
+    }
+    return queries;
+}
+
+// Drop the cached pages of a file, they are read from disk again
+void evict(const string& filename) {
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd >= 0) {
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+        close(fd);
+    }
+}
+
+// The results of every query, reused
+Results::Buffer buffer;
+
+// Run one query, the candidates refined or objects compared are returned,
+// -1 if the VAFile could not be read
+long long runQuery(bool va, const BenchQuery& query) {
+    buffer.clear();
+
+    if (va) {
+        VAFile::QueryStats stats;
+        if (query.type == VAFile::POINT) {
+            stats = VAFile::pointQuery(query.point, buffer);
+        } else if (query.type == VAFile::RANGE) {
+            stats = VAFile::rangeQuery(query.point, query.radius, buffer);
+        } else {
+            stats = VAFile::kNNQuery(query.point, query.k, buffer);
+        }
+        if (stats.failedReads > 0) {
+            return -1;
+        }
+        return query.type == VAFile::KNN ? stats.refined : stats.candidates;
+    }
+
+    // The linear array compares every object, or those with the hash of
+    // the point
+    if (query.type == VAFile::POINT) {
+        LinearArray::pointQuery(query.point, buffer);
+    } else if (query.type == VAFile::RANGE) {
+        LinearArray::rangeQuery(query.point, query.radius, buffer);
+    } else {
+        LinearArray::kNNQuery(query.point, query.k, buffer);
+    }
+    return LinearArray::getComparedCount();
+}
+
+/**
+ * Find the exact neighbours of every kNN query with the linear array
+ * @return The indices of the neighbours of every query, none for the others
+ */
+vector< vector<long long> > getNeighbours(const vector<BenchQuery>& queries) {
+    vector< vector<long long> > neighbours(queries.size());
+    for (size_t query = 0; query < queries.size(); ++query) {
+        if (queries[query].type == VAFile::KNN) {
+            runQuery(false, queries[query]);
+            for (auto& result : buffer.results) {
+                neighbours[query].push_back(result.index);
+            }
+        }
+    }
+    return neighbours;
+}
+
+// Share of the true neighbours among the results of the last query
+double getRecall(const vector<long long>& neighbours) {
+    if (neighbours.empty()) {
+        return 1;
+    }
+    long long found = 0;
+    for (auto& result : buffer.results) {
+        found += find(neighbours.begin(), neighbours.end(), result.index) != neighbours.end();
+    }
+    return (double) found / neighbours.size();
+}
+
+/**
+ * Time every query type on one structure
+ * @param cold Reopen the VAFile with its pages dropped before every query
+ * @param neighbours The exact neighbours of the kNN queries to score the
+ * results against, or NULL
+ * @param results Output, a result is appended for every query type
+ * @return false if a query could not read the VAFile
+ */
+bool measure(const BenchOptions& bench, const Options& options, bool va, bool cold, const vector<BenchQuery>& queries,
+        const vector< vector<long long> > *neighbours, vector<Result>& results) {
+    for (int type = VAFile::POINT; type <= VAFile::KNN; ++type) {
+        Result result;
+        result.structure = va ? "va" : "linear";
+        result.mode = cold ? "cold" : "warm";
+        result.type = type;
+        result.candidates = 0;
+        result.allocations = 0;
+        result.seconds = 0;
+        result.recall = -1;
+        bool scored = neighbours != NULL && type == VAFile::KNN;
+        double recall = 0;
+
+        for (int run = 0; run < bench.warmup + bench.repetitions; ++run) {
+            bool timed = run >= bench.warmup;
+            for (size_t position = 0; position < queries.size(); ++position) {
+                const BenchQuery& query = queries[position];
+                if (query.type != type) {
+                    continue;
+                }
+                if (cold) {
+                    VAFile::closeVAFile();
+                    evict(options.vaFile);
+                    evict(options.objectFile);
+                    VAFile::openVAFile(options);
+                }
+
+                long long allocations = allocationCount;
+                auto start = chrono::steady_clock::now();
+                long long candidates = runQuery(va, query);
+                double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+                if (candidates < 0) {
+                    return false;
+                }
+                allocations = allocationCount - allocations;
+                if (timed) {
+                    result.latencies.push_back(seconds * 1e6);
+                    result.candidates += candidates;
+                    result.allocations += allocations;
+                    result.seconds += seconds;
+                    if (scored) {
+                        recall += getRecall((*neighbours)[position]);
+                    }
+                }
+            }
+        }
+
+        if (!result.latencies.empty()) {
+            result.candidates /= result.latencies.size();
+            result.allocations /= result.latencies.size();
+            if (scored) {
+                result.recall = recall / result.latencies.size();
+            }
+            results.push_back(result);
+        }
+    }
+    return true;
+}
+
+// The point query results of every object, through the point index or a scan
+vector< vector<long long> > findObjects(const Loader::Objects& objects) {
+    vector< vector<long long> > found;
+    for (long long object = 0; object < objects.getCount(); ++object) {
+        const double *point = objects.coordinates.data() + object * objects.dimensions;
+        found.push_back(VAFile::pointSearch(vector<double>(point, point + objects.dimensions)));
+    }
+    return found;
+}
+
+/**
+ * Delete the first third of the objects from a copy of the VAFile, which
+ * compacts it, and insert them again, with the point index turned off so
+ * that it is left behind; then point queries for every object must find the
+ * same objects through the point index as through a scan
+ * @return false if they differ
+ */
+bool checkUpdates(const Options& options) {
+    Options check = options;
+    check.vaFile = options.vaFile + ".check";
+    check.objectFile = options.objectFile + ".check";
+    check.pointIndex = true;
+
+    Loader::Objects objects, removed;
+    if (!Loader::load(options.dataFile, options.dimensions, objects) || objects.getCount() < 3) {
+        cerr << "Could not load " << options.dataFile << endl;
+        return false;
+    }
+    long long count = objects.getCount() / 3;
+    removed.dimensions = objects.dimensions;
+    removed.coordinates.assign(objects.coordinates.begin(), objects.coordinates.begin() + count * objects.dimensions);
+    removed.payloadIndex.assign(objects.payloadIndex.begin(), objects.payloadIndex.begin() + count + 1);
+    removed.payloads = objects.payloads.substr(0, removed.payloadIndex.back());
+
+    // Build the VAFile with its point index, then update it without
+    bool updated = VAFile::buildVAFile(check) && VAFile::openVAFile(check);
+    VAFile::closeVAFile();
+    check.pointIndex = false;
+    updated = updated && VAFile::openVAFile(check) && VAFile::deleteObjects(removed) == count && VAFile::insertObjects(removed);
+    vector< vector<long long> > scanned = findObjects(objects);
+    VAFile::closeVAFile();
+
+    check.pointIndex = true;
+    updated = updated && VAFile::openVAFile(check);
+    vector< vector<long long> > hashed = findObjects(objects);
+    VAFile::closeVAFile();
+
+    for (auto suffix : { "", ".tombstones", ".points" }) {
+        remove((check.vaFile + suffix).c_str());
+    }
+    remove(check.objectFile.c_str());
+
+    if (!updated) {
+        cerr << "Could not update " << check.vaFile << endl;
+        return false;
+    }
+    for (long long object = 0; object < objects.getCount(); ++object) {
+        if (scanned[object] != hashed[object]) {
+            cerr << "Point query " << object << " finds " << hashed[object].size() << " objects through the point index and "
+                << scanned[object].size() << " with a scan after updates" << endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+// Nearest rank percentile of sorted latencies
+double percentile(const vector<double>& sorted, double percent) {
+    long long rank = (long long) ceil(percent / 100 * sorted.size());
+    return sorted[max(0LL, rank - 1)];
+}
+
+void printResults(const BenchOptions& bench, vector<Result>& results) {
+    if (bench.json) {
+        cout << "[" << endl;
+    } else {
+        cout << "structure,mode,type,queries,mean_us,p50_us,p90_us,p99_us,max_us,qps,candidates,allocations"
+            << (bench.recall ? ",recall" : "") << endl;
+    }
+
+    for (size_t i = 0; i < results.size(); ++i) {
+        Result& result = results[i];
+        vector<double>& latencies = result.latencies;
+        sort(latencies.begin(), latencies.end());
+        double mean = result.seconds * 1e6 / latencies.size();
+        double qps = result.seconds > 0 ? latencies.size() / result.seconds : 0;
+
+        // The recall of the scored rows, empty in the others
+        char recall[64] = "";
+        if (result.recall >= 0) {
+            snprintf(recall, sizeof(recall), bench.json ? ", \"recall\": %.4f" : "%.4f", result.recall);
+        }
+
+        char line[512];
+        if (bench.json) {
+            snprintf(line, sizeof(line), "  {\"structure\": \"%s\", \"mode\": \"%s\", \"type\": %d, \"queries\": %zu, "
+                    "\"mean_us\": %.1f, \"p50_us\": %.1f, \"p90_us\": %.1f, \"p99_us\": %.1f, \"max_us\": %.1f, "
+                    "\"qps\": %.1f, \"candidates\": %.1f, \"allocations\": %.1f%s}%s",
+                    result.structure.c_str(), result.mode.c_str(), result.type, latencies.size(), mean,
+                    percentile(latencies, 50), percentile(latencies, 90), percentile(latencies, 99), latencies.back(),
+                    qps, result.candidates, result.allocations, recall, i + 1 < results.size() ? "," : "");
+        } else {
+            snprintf(line, sizeof(line), "%s,%s,%d,%zu,%.1f,%.1f,%.1f,%.1f,%.1f,%.1f,%.1f,%.1f%s%s",
+                    result.structure.c_str(), result.mode.c_str(), result.type, latencies.size(), mean,
+                    percentile(latencies, 50), percentile(latencies, 90), percentile(latencies, 99), latencies.back(),
+                    qps, result.candidates, result.allocations, bench.recall ? "," : "", recall);
+        }
+        cout << line << endl;
+    }
+
+    if (bench.json) {
+        cout << "]" << endl;
+    }
+}
+
+int main(int argc, char **argv) {
+    BenchOptions bench;
+    vector<char *> rest;
+    Options options = getDefaultOptions();
+    if (!parseBenchOptions(argc, argv, bench, rest) || !parseOptions(rest.size(), rest.data(), options)) {
+        printBenchUsage(argv[0]);
+        return 1;
+    }
+    ThreadPool::setThreadCount(options.threads);
+
+    if (!bench.distribution.empty() && !generate(bench, options)) {
+        cerr << "Could not generate " << options.dataFile << " and " << options.queryFile << endl;
+        return 1;
+    }
+
+    // The exact neighbours come from the linear array, built before the
+    // VAFile is queried
+    vector< vector<long long> > neighbours;
+    if (bench.recall) {
+        LinearArray::buildLinearArray(options);
+        neighbours = getNeighbours(readQueries(options.queryFile, options.dimensions));
+    }
+
+    vector<Result> results;
+    if (bench.va) {
+        if (!VAFile::openVAFile(options) || !VAFile::matchesOptions(options)) {
+            if (!VAFile::buildVAFile(options) || !VAFile::openVAFile(options)) {
+                cerr << "Could not build " << options.vaFile << " from " << options.dataFile << endl;
+                return 1;
+            }
+        }
+
+        vector<BenchQuery> queries = readQueries(options.queryFile, VAFile::getDimensions());
+        for (int cold = 0; cold < 2; ++cold) {
+            if (!(cold ? bench.cold : bench.warm)) {
+                continue;
+            }
+            if (!measure(bench, options, true, cold, queries, bench.recall ? &neighbours : NULL, results)) {
+                cerr << "Could not read " << options.vaFile << endl;
+                return 1;
+            }
+        }
+        VAFile::closeVAFile();
+    }
+
+    // The linear array lives in memory, there is no cold mode for it
+    if (bench.linear && bench.warm) {
+        if (!bench.recall) {
+            LinearArray::buildLinearArray(options);
+        }
+        vector<BenchQuery> queries = readQueries(options.queryFile, options.dimensions);
+        measure(bench, options, false, false, queries, NULL, results);
+    }
+
+    printResults(bench, results);
+
+    if (bench.checkUpdates && !checkUpdates(options)) {
+        return 1;
+    }
+
+    // Once the warmup has grown the scratch, warm queries must not allocate
+    if (bench.checkAllocations) {
+        for (auto& result : results) {
+            if (result.mode == "warm" && result.allocations > 0) {
+                cerr << result.structure << " queries of type " << result.type << " allocate "
+                    << result.allocations << " times per query" << endl;
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
@@ -2,6 +2,12 @@
 #define OUTPUT
 // #define TIME
 
+// -- Count the work of VAFile queries, comment out to compile it away --
+#define STATS
+
+// -- Evaluate BATCH queries per scan, VAFile only --
+// #define BATCH 64
+
 // -- Structure we are testing --
 #define LINEAR
 // #define VA
@@ -10,7 +16,77 @@
 #define DATAFILE "assgn6_data_unif.txt"
 #define QUERYFILE "assgn6_querysample_unif.txt"
 #define VAFILE ".vafile"
-#define OBJECTBASE "objects/object_"
+#define OBJECTFILE ".objects"
+#define THREADS 1
+#define WORKERS 4
+
+// Quantizer: QUANTIZER_UNIFORM, QUANTIZER_QUANTILE or QUANTIZER_LLOYD
+#define QUANTIZER_UNIFORM 0
+#define QUANTIZER_QUANTILE 1
+#define QUANTIZER_LLOYD 2
+#define QUANTIZER QUANTIZER_QUANTILE
+#define LLOYD_ITERATIONS 8
+
+// Bit allocation: ALLOCATION_UNIFORM gives every dimension BITS bits,
+// ALLOCATION_VARIANCE splits BIT_BUDGET bits by the variance of the dimensions
+#define ALLOCATION_UNIFORM 0
+#define ALLOCATION_VARIANCE 1
+#define ALLOCATION ALLOCATION_VARIANCE
+#define BIT_BUDGET ( BITS * DIMENSIONS )
+
+// Layout: LAYOUT_ROWS packs every approximation in a row, LAYOUT_BLOCKED also
+// stores the cells dimension by dimension in blocks of LAYOUT_BLOCK objects
+#define LAYOUT_ROWS 0
+#define LAYOUT_BLOCKED 1
+#define LAYOUT LAYOUT_ROWS
+#define LAYOUT_BLOCK 256
+
+// Every SUMMARY_BLOCK objects the VAFile records the smallest and largest cell
+// of every dimension, scans skip blocks no object of which can qualify.
+// OBJECT_ORDER_ZORDER sorts the objects by the Z-order of their cells when the
+// index is built, so that the blocks are compact
+#define SUMMARY_BLOCK 4096
+#define OBJECT_ORDER_NONE 0
+#define OBJECT_ORDER_ZORDER 1
+#define OBJECT_ORDER OBJECT_ORDER_NONE
+
+// Precision of the coordinates the scans read: PRECISION_DOUBLE, or
+// PRECISION_FLOAT to read them rounded to floats, objects near the radius or
+// the k-th distance are read again in double
+#define PRECISION_DOUBLE 0
+#define PRECISION_FLOAT 1
+#define PRECISION PRECISION_DOUBLE
+
+// Refinement reads: REFINE_MMAP reads the candidates through the memory map,
+// REFINE_ASYNC queues them on io_uring in runs of objects at most READ_GAP
+// bytes apart while the filter goes on, READ_DEPTH reads in flight per thread
+#define REFINE_MMAP 0
+#define REFINE_ASYNC 1
+#define REFINE REFINE_MMAP
+#define READ_DEPTH 64
+#define READ_GAP 4096
+
+// Point queries look the objects up by the hash of their coordinates, the
+// VAFile keeps the table in a file next to it
+#define POINT_INDEX
+
+// Approximate kNN queries: at most KNN_CANDIDATES candidates of a query are
+// refined, by lower bound within every slice, and refinement stops KNN_TIME
+// microseconds into a query, 0 for no limit; k candidates are always refined.
+// KNN_APPROXIMATE ranks the candidates by their approximations alone
+#define KNN_CANDIDATES 0
+#define KNN_TIME 0
+// #define KNN_APPROXIMATE
+
+// Scans stream the approximations from the VAFile when it is larger than
+// MEMORYSIZE bytes, in chunks of STREAM_PAGES pages of PAGESIZE bytes read
+// one ahead; DIRECT_READS reads them past the page cache with O_DIRECT
+#define STREAM_PAGES 256
+// #define DIRECT_READS
+
+// Exact distances visit the dimensions where the query is farthest from the
+// mean of the data first, so that they can be abandoned sooner
+// #define DIMENSION_ORDER
 
 // -- Auto Generated --
 #define BITS 2
@@ -0,0 +1,175 @@
+/*
+ * Copyright (c) 2015 Srijan R Shetty
+ * Author: Srijan R Shetty <srijan.shetty+code@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+#ifndef CONTEXT_H
+#define CONTEXT_H
+
+// Query results
+#include "results.h"
+
+// STL
+#include <vector>
+#include <utility>
+
+namespace Context {
+    // Pairs of (squared distance or bound, index)
+    typedef std::pair<double, long long> Entry;
+
+    /**
+     * Candidates whose objects are being read through the read queue
+     */
+    struct ReadBatch {
+        // (bound, index) of every candidate, in index order
+        std::vector<Entry> candidates;
+
+        // Where the coordinates of every candidate are in buffer
+        std::vector<long long> positions;
+
+        // Candidates read together: the first candidate of every run, and
+        // one past the last candidate at the end
+        std::vector<long long> runs;
+
+        // The runs read back to back, and the runs not read yet
+        std::vector<unsigned char> buffer;
+        long long pending;
+
+        void clear() {
+            candidates.clear();
+            positions.clear();
+            runs.clear();
+            pending = 0;
+        }
+    };
+
+    /**
+     * Approximations a streaming scan reads ahead
+     */
+    struct Chunk {
+        // Read into the first aligned byte of buffer
+        std::vector<unsigned char> buffer;
+
+        // The objects of the chunk, the first at rows, whether the read is
+        // still in flight and whether it failed
+        long long begin;
+        long long end;
+        const unsigned char *rows;
+        bool pending;
+        bool failed;
+
+        void clear() {
+            begin = end = 0;
+            rows = NULL;
+            pending = false;
+            failed = false;
+        }
+    };
+
+    /**
+     * Scratch of one slice of a parallel scan
+     */
+    struct Slice {
+        // Matches of a point or range query, in index order
+        std::vector<Results::Result> results;
+
+        // kNN candidates, and heaps of the k smallest upper bounds and
+        // distances, the largest on top
+        std::vector<Entry> candidates;
+        std::vector<Entry> upperBounds;
+        std::vector<Entry> neighbours;
+
+        // Coordinates of an object parsed again from the data file
+        std::vector<double> point;
+
+        // Two batches of candidates read while the other is scored
+        ReadBatch reads[2];
+
+        // The chunk being scanned and the one read ahead
+        Chunk chunks[2];
+    };
+
+    /**
+     * Scratch memory of a query, reused from one query to the next. Buffers
+     * are cleared but keep their capacity, so once they have grown to the
+     * largest query seen a query makes no heap allocations. A context serves
+     * one query at a time; visitors must not query with the context that
+     * called them.
+     */
+    class QueryContext {
+    public:
+        // Packed grid of a point query and bound tables of the VAFile
+        std::vector<unsigned char> grid;
+        std::vector<double> lowerTable;
+        std::vector<double> upperTable;
+
+        // Cell of the query in every dimension, for the block summaries
+        std::vector<int> cells;
+
+        // Dimension order of the exact distances and the query in that order
+        std::vector<int> order;
+        std::vector<double> orderedPoint;
+
+        // The neighbours of all slices, merged, and the kNN candidates they
+        // left unrefined
+        std::vector<Entry> neighbours;
+        std::vector<Entry> candidates;
+
+        // The results of all slices, merged
+        std::vector<Results::Result> results;
+
+        /**
+         * Get cleared scratch for the slices of a scan
+         * @param count Number of slices
+         * @return At least count slices
+         */
+        std::vector<Slice>& getSlices(int count) {
+            if ((int) slices.size() < count) {
+                slices.resize(count);
+            }
+            for (auto& slice : slices) {
+                slice.results.clear();
+                slice.candidates.clear();
+                slice.upperBounds.clear();
+                slice.neighbours.clear();
+                slice.reads[0].clear();
+                slice.reads[1].clear();
+                slice.chunks[0].clear();
+                slice.chunks[1].clear();
+            }
+            return slices;
+        }
+
+    private:
+        std::vector<Slice> slices;
+    };
+
+    /**
+     * Get the context of the calling thread, used when a query is not given one
+     * @return The context
+     */
+    inline QueryContext& getThreadContext() {
+        static thread_local QueryContext context;
+        return context;
+    }
+}
+
+#endif
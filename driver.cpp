@@ -23,12 +23,30 @@
 // Configuration file
 #include "config.h"
 
+// Runtime parameters
+#include "options.h"
+
 // Include the VPTree library
 #include "vafile.h"
 
 // Inclue the linear library
 #include "linear.h"
 
+// Data strings of the batch results
+#include "objectstore.h"
+
+// Parallel scans
+#include "threadpool.h"
+
+// Ingest throughput
+#include "loader.h"
+
+// Server mode
+#include "server.h"
+
+// Query results
+#include "results.h"
+
 // Stream processing
 #include <iostream>
 #include <fstream>
@@ -36,122 +54,319 @@
 // STL
 #include <vector>
 #include <iterator>
+#include <algorithm>
 
 // Time
 #include <chrono>
 
 using namespace std;
 
-#ifdef VA
-using namespace VAFile;
-#endif
+// Print the time and, for a VAFile, the candidates of a query
+void reportTime(const Options& options, long query, std::chrono::high_resolution_clock::duration elapsed) {
+    long long microseconds = std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count();
+    cout << query << " " << microseconds;
+    if (options.va) {
+        cout << " " << VAFile::getCandidateCount();
+    }
+    cout << endl;
+}
+
+// Print the work of a VAFile query, zero unless STATS is defined
+void reportStats(const Options& options, long query, const VAFile::QueryStats& stats) {
+    if (!options.stats || !options.va) {
+        return;
+    }
+    cout << "stats " << query << " " << stats.bytesScanned << " " << stats.approximations
+        << " " << stats.candidates << " " << stats.refined << " " << stats.objectBytes
+        << " " << (long long) (stats.filterSeconds * 1e6) << " " << (long long) (stats.refineSeconds * 1e6) << endl;
+}
+
+// Print the data strings of the results of a query
+void printResults(const Results::Buffer& buffer, bool farthestFirst) {
+    for (long long i = 0; i < buffer.size(); ++i) {
+        const Results::Result& result = buffer.results[farthestFirst ? buffer.size() - 1 - i : i];
+        cout.write(result.payload, result.payloadLength) << endl;
+    }
+}
 
-#ifdef LINEAR
-using namespace LinearArray;
-#endif
+// Print the ingest throughput of the last load of the data file
+void reportLoad() {
+    double seconds = Loader::getLoadTime();
+    cerr << "Loaded " << Loader::getRowCount() << " rows in " << seconds << " s";
+    if (seconds > 0) {
+        cerr << " (" << (long long) (Loader::getRowCount() / seconds) << " rows/sec)";
+    }
+    cerr << endl;
+}
 
-void processQuery() {
+// Answer the queries of the query file, false once a query cannot read the
+// index
+bool processQuery(const Options& options, int dimensions) {
     // Open the query file
-    ifstream ifile(QUERYFILE);
+    ifstream ifile(options.queryFile);
 
     long query;
 
+    // The results of every query, reused
+    Results::Buffer buffer;
+
     // Loop over the entire file
     while (ifile >> query) {
         // Get the point from the file
         vector <double> point;
         double coordinate;
-        for (long i = 0; i < DIMENSIONS; ++i) {
+        for (long i = 0; i < dimensions; ++i) {
             ifile >> coordinate;
             point.push_back(coordinate);
         }
 
-#ifdef OUTPUT
+        if (options.output) {
             cout << endl << query << " ";
             copy(point.begin(), point.end(), ostream_iterator<double>(cout, " "));
-#endif
+        }
 
         if (query == 1) {
-#ifdef OUTPUT
-            cout << endl;
-#endif
+            if (options.output) {
+                cout << endl;
+            }
 
-#ifdef TIME
-            cout << query << " ";
+            buffer.clear();
             auto start = std::chrono::high_resolution_clock::now();
-#endif
-
-            pointQuery(point);
-
-#ifdef TIME
+            VAFile::QueryStats stats;
+            if (options.va) {
+                stats = VAFile::pointQuery(point, buffer);
+            } else {
+                LinearArray::pointQuery(point, buffer);
+            }
             auto elapsed = std::chrono::high_resolution_clock::now() - start;
-            long long microseconds = std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count();
-            cout << microseconds << endl;
-#endif
-
+            if (options.output) {
+                printResults(buffer, false);
+            }
+            if (options.time) {
+                reportTime(options, query, elapsed);
+            }
+            reportStats(options, query, stats);
+            if (stats.failedReads > 0) {
+                cerr << "Could not read " << options.vaFile << " for a query of type " << query << endl;
+                return false;
+            }
         } else if (query == 2) {
             // Get the range
             double range;
             ifile >> range;
 
-#ifdef OUTPUT
-            cout << " " << range << endl;
-#endif
+            if (options.output) {
+                cout << " " << range << endl;
+            }
 
-#ifdef TIME
-            cout << query << " ";
+            buffer.clear();
             auto start = std::chrono::high_resolution_clock::now();
-#endif
-
-            rangeQuery(point, range * 1.0);
-
-#ifdef TIME
+            VAFile::QueryStats stats;
+            if (options.va) {
+                stats = VAFile::rangeQuery(point, range * 1.0, buffer);
+            } else {
+                LinearArray::rangeQuery(point, range * 1.0, buffer);
+            }
             auto elapsed = std::chrono::high_resolution_clock::now() - start;
-            long long microseconds = std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count();
-            cout << microseconds << endl;
-#endif
+            if (options.output) {
+                printResults(buffer, false);
+            }
+            if (options.time) {
+                reportTime(options, query, elapsed);
+            }
+            reportStats(options, query, stats);
+            if (stats.failedReads > 0) {
+                cerr << "Could not read " << options.vaFile << " for a query of type " << query << endl;
+                return false;
+            }
         } else if (query == 3) {
             // Get the number of points
             long long k;
             ifile >> k;
 
-#ifdef OUTPUT
-            cout << " " << k << endl;
-#endif
+            if (options.output) {
+                cout << " " << k << endl;
+            }
 
-#ifdef TIME
-            cout << query << " ";
+            buffer.clear();
             auto start = std::chrono::high_resolution_clock::now();
-#endif
+            VAFile::QueryStats stats;
+            if (options.va) {
+                stats = VAFile::kNNQuery(point, k, buffer);
+            } else {
+                LinearArray::kNNQuery(point, k, buffer);
+            }
+            auto elapsed = std::chrono::high_resolution_clock::now() - start;
+            if (options.output) {
+                // The neighbours are printed farthest first
+                printResults(buffer, true);
+            }
+            if (options.time) {
+                reportTime(options, query, elapsed);
+            }
+            reportStats(options, query, stats);
+            if (stats.failedReads > 0) {
+                cerr << "Could not read " << options.vaFile << " for a query of type " << query << endl;
+                return false;
+            }
+        }
+    }
 
-            kNNQuery(point, k);
+    // Close the file
+    ifile.close();
+    return true;
+}
 
-#ifdef TIME
-            auto elapsed = std::chrono::high_resolution_clock::now() - start;
-            long long microseconds = std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count();
-            cout << microseconds << endl;
-#endif
+// Answer a batch of queries, false if it cannot read the index
+bool processBatch(const Options& options, const vector<VAFile::Query>& queries) {
+    auto start = std::chrono::high_resolution_clock::now();
+
+    auto results = VAFile::batchSearch(queries);
+    if (results.size() != queries.size()) {
+        cerr << "Could not read " << options.vaFile << " for a batch" << endl;
+        return false;
+    }
+
+    // A batch is reported as query type 0
+    if (options.time) {
+        reportTime(options, 0, std::chrono::high_resolution_clock::now() - start);
+    }
+
+    if (options.output) {
+        for (size_t i = 0; i < queries.size(); ++i) {
+            const VAFile::Query& query = queries[i];
+            cout << endl << query.type << " ";
+            copy(query.point.begin(), query.point.end(), ostream_iterator<double>(cout, " "));
+            if (query.type == VAFile::RANGE) {
+                cout << " " << query.radius;
+            } else if (query.type == VAFile::KNN) {
+                cout << " " << query.k;
+            }
+            cout << endl;
+
+            // kNN neighbours are printed farthest first
+            if (query.type == VAFile::KNN) {
+                reverse(results[i].begin(), results[i].end());
+            }
+            for (auto id : results[i]) {
+                cout << ObjectStore::getDataString(ObjectStore::getIndex(id)) << endl;
+            }
+        }
+    }
+    return true;
+}
+
+// Answer the query file in batches, false once a batch cannot read the index
+bool processQueryBatches(const Options& options, int dimensions) {
+    // Open the query file
+    ifstream ifile(options.queryFile);
+
+    // Read options.batch queries at a time and evaluate them together
+    vector<VAFile::Query> queries;
+    for (VAFile::Query query; ifile >> query.type; ) {
+        query.point.resize(dimensions);
+        for (long i = 0; i < dimensions; ++i) {
+            ifile >> query.point[i];
+        }
+
+        query.radius = 0;
+        query.k = 0;
+        if (query.type == VAFile::RANGE) {
+            ifile >> query.radius;
+        } else if (query.type == VAFile::KNN) {
+            ifile >> query.k;
         }
+
+        queries.push_back(query);
+        if ((int) queries.size() == options.batch) {
+            if (!processBatch(options, queries)) {
+                return false;
+            }
+            queries.clear();
+        }
+    }
+
+    if (!queries.empty() && !processBatch(options, queries)) {
+        return false;
     }
 
     // Close the file
     ifile.close();
+    return true;
 }
 
-int main() {
-#ifdef VA
-    // build a new VAFILE only if the old one does not exist
-    if (VAFile::getFileSize(VAFILE) == 0)  {
-        VAFile::buildVAFile();
+int main(int argc, char **argv) {
+    Options options = getDefaultOptions();
+    if (!parseOptions(argc, argv, options)) {
+        printUsage(argv[0]);
+        return 1;
     }
-#endif
+    ThreadPool::setThreadCount(options.threads);
 
-#ifdef LINEAR
-    LinearArray::buildLinearArray();
-#endif
+    if (options.va) {
+        // build a new VAFILE only if the old one does not exist, is stale or
+        // was built with other parameters
+        if (!VAFile::openVAFile(options) || !VAFile::matchesOptions(options))  {
+            bool built = VAFile::buildVAFile(options);
+            if (options.time) {
+                reportLoad();
+            }
+            if (!built || !VAFile::openVAFile(options)) {
+                cerr << "Could not build " << options.vaFile << " from " << options.dataFile << endl;
+                return 1;
+            }
+        }
 
-    // Process the query file
-    processQuery();
+        // Apply the updates before the queries
+        if (!options.insertFile.empty()) {
+            Loader::Objects objects;
+            if (!Loader::load(options.insertFile, VAFile::getDimensions(), objects) || !VAFile::insertObjects(objects)) {
+                cerr << "Could not insert " << options.insertFile << " into " << options.vaFile << endl;
+                return 1;
+            }
+        }
+        if (!options.deleteFile.empty()) {
+            Loader::Objects objects;
+            if (!Loader::load(options.deleteFile, VAFile::getDimensions(), objects)) {
+                cerr << "Could not read " << options.deleteFile << endl;
+                return 1;
+            }
+            if (VAFile::deleteObjects(objects) < 0) {
+                cerr << "Could not compact " << options.vaFile << endl;
+                return 1;
+            }
+        }
+        if (options.compact && !VAFile::compactVAFile()) {
+            cerr << "Could not compact " << options.vaFile << endl;
+            return 1;
+        }
+        if (!options.exportFile.empty() && !VAFile::exportVAFile(options.exportFile)) {
+            cerr << "Could not export " << options.vaFile << " to " << options.exportFile << endl;
+            return 1;
+        }
+
+        // Process the query file, the dimensions come from the index
+        if (options.serve) {
+            return Server::run(options, VAFile::getDimensions()) ? 0 : 1;
+        } else if (options.batch > 0) {
+            if (!processQueryBatches(options, VAFile::getDimensions())) {
+                return 1;
+            }
+        } else if (!processQuery(options, VAFile::getDimensions())) {
+            return 1;
+        }
+    } else {
+        LinearArray::buildLinearArray(options);
+        if (options.time) {
+            reportLoad();
+        }
+        if (options.serve) {
+            return Server::run(options, options.dimensions) ? 0 : 1;
+        }
+        if (!processQuery(options, options.dimensions)) {
+            return 1;
+        }
+    }
 
     return 0;
 }
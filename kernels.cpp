@@ -0,0 +1,585 @@
+/*
+ * Copyright (c) 2015 Srijan R Shetty
+ * Author: Srijan R Shetty <srijan.shetty+code@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+// The header file
+#include "kernels.h"
+
+// Intrinsics
+#include <immintrin.h>
+
+// To read the environment
+#include <cstdlib>
+#include <string>
+
+// Cell widths, the initial minimum and the dimension order
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <algorithm>
+#include <cmath>
+
+namespace Kernels {
+    // Extract a cell from a packed approximation, reads 4 bytes
+    inline unsigned int getCell(const unsigned char *row, int bitOffset, unsigned int mask) {
+        const unsigned char *bytes = row + (bitOffset >> 3);
+        unsigned int word = bytes[0] | (bytes[1] << 8) | (bytes[2] << 16) | ((unsigned int) bytes[3] << 24);
+        return (word >> (bitOffset & 7)) & mask;
+    }
+
+    // -- Scalar kernels --
+
+    double squaredDistanceScalar(const double *point1, const double *point2, int dimensions) {
+        double distance = 0;
+        for (int i = 0; i < dimensions; ++i) {
+            double component = point1[i] - point2[i];
+            distance += component * component;
+        }
+        return distance;
+    }
+
+    // The partial sum is checked every eight dimensions. ORDERED reads the
+    // object through order, a template argument so the natural order keeps
+    // plain loads.
+    template <bool ORDERED>
+    double squaredDistanceBoundedScalar(const double *point, const double *object, int dimensions, const int *order, double bound) {
+        double distance = 0;
+        for (int i = 0; i < dimensions; i += 8) {
+            int end = std::min(i + 8, dimensions);
+            for (int j = i; j < end; ++j) {
+                double component = point[j] - object[ORDERED ? order[j] : j];
+                distance += component * component;
+            }
+            if (distance > bound) {
+                return distance;
+            }
+        }
+        return distance;
+    }
+
+    double squaredDistanceFloatScalar(const double *point, const float *object, int dimensions) {
+        double distance = 0;
+        for (int i = 0; i < dimensions; ++i) {
+            double component = point[i] - object[i];
+            distance += component * component;
+        }
+        return distance;
+    }
+
+    void squaredDistancesScalar(const double *point, const double *rows, long long count, int dimensions, double *distances) {
+        for (long long row = 0; row < count; ++row) {
+            distances[row] = squaredDistanceScalar(point, rows + row * dimensions, dimensions);
+        }
+    }
+
+    void sumBoundsScalar(const unsigned char *rows, long long count, int stride, int dimensions,
+            const int *bitOffsets, const int *bits, const int *tableOffsets, const double *table, double *bounds) {
+        for (long long row = 0; row < count; ++row) {
+            const unsigned char *approximation = rows + row * stride;
+            double bound = 0;
+            for (int i = 0; i < dimensions; ++i) {
+                bound += table[tableOffsets[i] + getCell(approximation, bitOffsets[i], (1U << bits[i]) - 1)];
+            }
+            bounds[row] = bound;
+        }
+    }
+
+    // Cells of equal width at compile time offsets, the loop over the
+    // dimensions is fully unrolled
+    template <int DIMENSIONS, int BITS>
+    void sumBoundsFixedScalar(const unsigned char *rows, long long count, int stride, const double *table, double *bounds) {
+        for (long long row = 0; row < count; ++row) {
+            const unsigned char *approximation = rows + row * stride;
+            double bound = 0;
+#pragma GCC unroll 32
+            for (int i = 0; i < DIMENSIONS; ++i) {
+                bound += table[(i << BITS) + getCell(approximation, i * BITS, (1U << BITS) - 1)];
+            }
+            bounds[row] = bound;
+        }
+    }
+
+    // One dimension of a block of the dimension blocked layout
+    template <typename Cell>
+    double addCellBoundsScalar(const Cell *cells, long long count, const double *table, double *bounds) {
+        double minimum = std::numeric_limits<double>::infinity();
+        for (long long row = 0; row < count; ++row) {
+            bounds[row] += table[cells[row]];
+            minimum = std::min(minimum, bounds[row]);
+        }
+        return minimum;
+    }
+
+    // -- AVX2 kernels --
+
+    // GCC flags the undefined source operands that the intrinsics of the
+    // gathers, extracts and reductions start from
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wuninitialized"
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+
+    __attribute__((target("avx2,fma")))
+    double squaredDistanceAVX2(const double *point1, const double *point2, int dimensions) {
+        __m256d sum = _mm256_setzero_pd();
+        int i = 0;
+        for (; i + 4 <= dimensions; i += 4) {
+            __m256d component = _mm256_sub_pd(_mm256_loadu_pd(point1 + i), _mm256_loadu_pd(point2 + i));
+            sum = _mm256_fmadd_pd(component, component, sum);
+        }
+
+        // Horizontal sum of the lanes, then the tail
+        __m128d half = _mm_add_pd(_mm256_castpd256_pd128(sum), _mm256_extractf128_pd(sum, 1));
+        double distance = _mm_cvtsd_f64(_mm_add_sd(half, _mm_unpackhi_pd(half, half)));
+        for (; i < dimensions; ++i) {
+            double component = point1[i] - point2[i];
+            distance += component * component;
+        }
+        return distance;
+    }
+
+    // Same lanes and reduction as squaredDistanceAVX2, the partial sum is
+    // reduced every eight dimensions
+    template <bool ORDERED>
+    __attribute__((target("avx2,fma")))
+    double squaredDistanceBoundedAVX2(const double *point, const double *object, int dimensions, const int *order, double bound) {
+        __m256d sum = _mm256_setzero_pd();
+        int i = 0;
+        for (; i + 4 <= dimensions; i += 4) {
+            __m256d coordinates = !ORDERED ? _mm256_loadu_pd(object + i)
+                : _mm256_i32gather_pd(object, _mm_loadu_si128((const __m128i *) (order + i)), 8);
+            __m256d component = _mm256_sub_pd(_mm256_loadu_pd(point + i), coordinates);
+            sum = _mm256_fmadd_pd(component, component, sum);
+            if (i & 4) {
+                __m128d half = _mm_add_pd(_mm256_castpd256_pd128(sum), _mm256_extractf128_pd(sum, 1));
+                double partial = _mm_cvtsd_f64(_mm_add_sd(half, _mm_unpackhi_pd(half, half)));
+                if (partial > bound) {
+                    return partial;
+                }
+            }
+        }
+
+        __m128d half = _mm_add_pd(_mm256_castpd256_pd128(sum), _mm256_extractf128_pd(sum, 1));
+        double distance = _mm_cvtsd_f64(_mm_add_sd(half, _mm_unpackhi_pd(half, half)));
+        for (; i < dimensions; ++i) {
+            double component = point[i] - object[ORDERED ? order[i] : i];
+            distance += component * component;
+        }
+        return distance;
+    }
+
+    // Four floats widened to doubles at a time
+    __attribute__((target("avx2,fma")))
+    double squaredDistanceFloatAVX2(const double *point, const float *object, int dimensions) {
+        __m256d sum = _mm256_setzero_pd();
+        int i = 0;
+        for (; i + 4 <= dimensions; i += 4) {
+            __m256d component = _mm256_sub_pd(_mm256_loadu_pd(point + i), _mm256_cvtps_pd(_mm_loadu_ps(object + i)));
+            sum = _mm256_fmadd_pd(component, component, sum);
+        }
+
+        __m128d half = _mm_add_pd(_mm256_castpd256_pd128(sum), _mm256_extractf128_pd(sum, 1));
+        double distance = _mm_cvtsd_f64(_mm_add_sd(half, _mm_unpackhi_pd(half, half)));
+        for (; i < dimensions; ++i) {
+            double component = point[i] - object[i];
+            distance += component * component;
+        }
+        return distance;
+    }
+
+    __attribute__((target("avx2,fma")))
+    void squaredDistancesAVX2(const double *point, const double *rows, long long count, int dimensions, double *distances) {
+        for (long long row = 0; row < count; ++row) {
+            distances[row] = squaredDistanceAVX2(point, rows + row * dimensions, dimensions);
+        }
+    }
+
+    // Eight rows at a time: gather the words holding a cell from eight
+    // approximations, shift and mask them into table indices, then gather the
+    // table entries. Each row still sums its dimensions in order.
+    __attribute__((target("avx2")))
+    void sumBoundsAVX2(const unsigned char *rows, long long count, int stride, int dimensions,
+            const int *bitOffsets, const int *bits, const int *tableOffsets, const double *table, double *bounds) {
+        const __m256i rowOffsets = _mm256_mullo_epi32(_mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7), _mm256_set1_epi32(stride));
+
+        long long row = 0;
+        for (; row + 8 <= count; row += 8) {
+            const unsigned char *block = rows + row * stride;
+            __m256d low = _mm256_setzero_pd();
+            __m256d high = _mm256_setzero_pd();
+            for (int i = 0; i < dimensions; ++i) {
+                int bitOffset = bitOffsets[i];
+                __m256i words = _mm256_i32gather_epi32((const int *) (block + (bitOffset >> 3)), rowOffsets, 1);
+                __m256i cells = _mm256_and_si256(_mm256_srli_epi32(words, bitOffset & 7), _mm256_set1_epi32((1 << bits[i]) - 1));
+                __m256i indices = _mm256_add_epi32(cells, _mm256_set1_epi32(tableOffsets[i]));
+                low = _mm256_add_pd(low, _mm256_i32gather_pd(table, _mm256_castsi256_si128(indices), 8));
+                high = _mm256_add_pd(high, _mm256_i32gather_pd(table, _mm256_extracti128_si256(indices, 1), 8));
+            }
+            _mm256_storeu_pd(bounds + row, low);
+            _mm256_storeu_pd(bounds + row + 4, high);
+        }
+
+        sumBoundsScalar(rows + row * stride, count - row, stride, dimensions, bitOffsets, bits, tableOffsets, table, bounds + row);
+    }
+
+    template <int DIMENSIONS, int BITS>
+    __attribute__((target("avx2")))
+    void sumBoundsFixedAVX2(const unsigned char *rows, long long count, int stride, const double *table, double *bounds) {
+        const __m256i rowOffsets = _mm256_mullo_epi32(_mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7), _mm256_set1_epi32(stride));
+        const __m256i mask = _mm256_set1_epi32((1 << BITS) - 1);
+
+        long long row = 0;
+        for (; row + 8 <= count; row += 8) {
+            const unsigned char *block = rows + row * stride;
+            __m256d low = _mm256_setzero_pd();
+            __m256d high = _mm256_setzero_pd();
+#pragma GCC unroll 32
+            for (int i = 0; i < DIMENSIONS; ++i) {
+                __m256i words = _mm256_i32gather_epi32((const int *) (block + ((i * BITS) >> 3)), rowOffsets, 1);
+                __m256i cells = _mm256_and_si256(_mm256_srli_epi32(words, (i * BITS) & 7), mask);
+                __m256i indices = _mm256_add_epi32(cells, _mm256_set1_epi32(i << BITS));
+                low = _mm256_add_pd(low, _mm256_i32gather_pd(table, _mm256_castsi256_si128(indices), 8));
+                high = _mm256_add_pd(high, _mm256_i32gather_pd(table, _mm256_extracti128_si256(indices, 1), 8));
+            }
+            _mm256_storeu_pd(bounds + row, low);
+            _mm256_storeu_pd(bounds + row + 4, high);
+        }
+
+        sumBoundsFixedScalar<DIMENSIONS, BITS>(rows + row * stride, count - row, stride, table, bounds + row);
+    }
+
+    // Widen four cells to table indices
+    __attribute__((target("avx2")))
+    inline __m256i loadCellsAVX2(const uint8_t *cells) {
+        int32_t word;
+        std::memcpy(&word, cells, sizeof(word));
+        return _mm256_cvtepu8_epi64(_mm_cvtsi32_si128(word));
+    }
+
+    __attribute__((target("avx2")))
+    inline __m256i loadCellsAVX2(const uint16_t *cells) {
+        return _mm256_cvtepu16_epi64(_mm_loadl_epi64((const __m128i *) cells));
+    }
+
+    // Four rows at a time, one gather of the table entries per step
+    template <typename Cell>
+    __attribute__((target("avx2")))
+    double addCellBoundsAVX2(const Cell *cells, long long count, const double *table, double *bounds) {
+        __m256d minimum = _mm256_set1_pd(std::numeric_limits<double>::infinity());
+        long long row = 0;
+        for (; row + 4 <= count; row += 4) {
+            __m256d sum = _mm256_add_pd(_mm256_loadu_pd(bounds + row), _mm256_i64gather_pd(table, loadCellsAVX2(cells + row), 8));
+            _mm256_storeu_pd(bounds + row, sum);
+            minimum = _mm256_min_pd(minimum, sum);
+        }
+
+        __m128d half = _mm_min_pd(_mm256_castpd256_pd128(minimum), _mm256_extractf128_pd(minimum, 1));
+        double lanes = _mm_cvtsd_f64(_mm_min_sd(half, _mm_unpackhi_pd(half, half)));
+        return std::min(lanes, addCellBoundsScalar(cells + row, count - row, table, bounds + row));
+    }
+
+    // -- AVX-512 kernels --
+
+    __attribute__((target("avx512f")))
+    double squaredDistanceAVX512(const double *point1, const double *point2, int dimensions) {
+        __m512d sum = _mm512_setzero_pd();
+        int i = 0;
+        for (; i + 8 <= dimensions; i += 8) {
+            __m512d component = _mm512_sub_pd(_mm512_loadu_pd(point1 + i), _mm512_loadu_pd(point2 + i));
+            sum = _mm512_fmadd_pd(component, component, sum);
+        }
+
+        // The tail is handled with a masked load
+        if (i < dimensions) {
+            __mmask8 tail = (__mmask8) ((1 << (dimensions - i)) - 1);
+            __m512d component = _mm512_sub_pd(_mm512_maskz_loadu_pd(tail, point1 + i), _mm512_maskz_loadu_pd(tail, point2 + i));
+            sum = _mm512_fmadd_pd(component, component, sum);
+        }
+        return _mm512_reduce_add_pd(sum);
+    }
+
+    // Same lanes and reduction as squaredDistanceAVX512 in the natural order,
+    // an ordered tail is summed scalar
+    template <bool ORDERED>
+    __attribute__((target("avx512f")))
+    double squaredDistanceBoundedAVX512(const double *point, const double *object, int dimensions, const int *order, double bound) {
+        __m512d sum = _mm512_setzero_pd();
+        int i = 0;
+        for (; i + 8 <= dimensions; i += 8) {
+            __m512d coordinates = !ORDERED ? _mm512_loadu_pd(object + i)
+                : _mm512_i32gather_pd(_mm256_loadu_si256((const __m256i *) (order + i)), object, 8);
+            __m512d component = _mm512_sub_pd(_mm512_loadu_pd(point + i), coordinates);
+            sum = _mm512_fmadd_pd(component, component, sum);
+            double partial = _mm512_reduce_add_pd(sum);
+            if (partial > bound) {
+                return partial;
+            }
+        }
+
+        if (ORDERED) {
+            double distance = _mm512_reduce_add_pd(sum);
+            for (; i < dimensions; ++i) {
+                double component = point[i] - object[order[i]];
+                distance += component * component;
+            }
+            return distance;
+        }
+        if (i < dimensions) {
+            __mmask8 tail = (__mmask8) ((1 << (dimensions - i)) - 1);
+            __m512d component = _mm512_sub_pd(_mm512_maskz_loadu_pd(tail, point + i), _mm512_maskz_loadu_pd(tail, object + i));
+            sum = _mm512_fmadd_pd(component, component, sum);
+        }
+        return _mm512_reduce_add_pd(sum);
+    }
+
+    // Eight floats widened to doubles at a time, the tail masked
+    __attribute__((target("avx512f")))
+    double squaredDistanceFloatAVX512(const double *point, const float *object, int dimensions) {
+        __m512d sum = _mm512_setzero_pd();
+        int i = 0;
+        for (; i + 8 <= dimensions; i += 8) {
+            __m512d component = _mm512_sub_pd(_mm512_loadu_pd(point + i), _mm512_cvtps_pd(_mm256_loadu_ps(object + i)));
+            sum = _mm512_fmadd_pd(component, component, sum);
+        }
+        if (i < dimensions) {
+            __mmask8 tail = (__mmask8) ((1 << (dimensions - i)) - 1);
+            __m512d coordinates = _mm512_cvtps_pd(_mm512_castps512_ps256(_mm512_maskz_loadu_ps((__mmask16) tail, object + i)));
+            __m512d component = _mm512_sub_pd(_mm512_maskz_loadu_pd(tail, point + i), coordinates);
+            sum = _mm512_fmadd_pd(component, component, sum);
+        }
+        return _mm512_reduce_add_pd(sum);
+    }
+
+    __attribute__((target("avx512f")))
+    void squaredDistancesAVX512(const double *point, const double *rows, long long count, int dimensions, double *distances) {
+        for (long long row = 0; row < count; ++row) {
+            distances[row] = squaredDistanceAVX512(point, rows + row * dimensions, dimensions);
+        }
+    }
+
+    // Sixteen rows at a time, the same scheme as the AVX2 kernel
+    __attribute__((target("avx512f")))
+    void sumBoundsAVX512(const unsigned char *rows, long long count, int stride, int dimensions,
+            const int *bitOffsets, const int *bits, const int *tableOffsets, const double *table, double *bounds) {
+        const __m512i rowOffsets = _mm512_mullo_epi32(
+                _mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15), _mm512_set1_epi32(stride));
+
+        long long row = 0;
+        for (; row + 16 <= count; row += 16) {
+            const unsigned char *block = rows + row * stride;
+            __m512d low = _mm512_setzero_pd();
+            __m512d high = _mm512_setzero_pd();
+            for (int i = 0; i < dimensions; ++i) {
+                int bitOffset = bitOffsets[i];
+                __m512i words = _mm512_i32gather_epi32(rowOffsets, (const int *) (block + (bitOffset >> 3)), 1);
+                __m512i cells = _mm512_and_si512(_mm512_srli_epi32(words, bitOffset & 7), _mm512_set1_epi32((1 << bits[i]) - 1));
+                __m512i indices = _mm512_add_epi32(cells, _mm512_set1_epi32(tableOffsets[i]));
+                low = _mm512_add_pd(low, _mm512_i32gather_pd(_mm512_castsi512_si256(indices), table, 8));
+                high = _mm512_add_pd(high, _mm512_i32gather_pd(_mm512_extracti64x4_epi64(indices, 1), table, 8));
+            }
+            _mm512_storeu_pd(bounds + row, low);
+            _mm512_storeu_pd(bounds + row + 8, high);
+        }
+
+        sumBoundsScalar(rows + row * stride, count - row, stride, dimensions, bitOffsets, bits, tableOffsets, table, bounds + row);
+    }
+
+    template <int DIMENSIONS, int BITS>
+    __attribute__((target("avx512f")))
+    void sumBoundsFixedAVX512(const unsigned char *rows, long long count, int stride, const double *table, double *bounds) {
+        const __m512i rowOffsets = _mm512_mullo_epi32(
+                _mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15), _mm512_set1_epi32(stride));
+        const __m512i mask = _mm512_set1_epi32((1 << BITS) - 1);
+
+        long long row = 0;
+        for (; row + 16 <= count; row += 16) {
+            const unsigned char *block = rows + row * stride;
+            __m512d low = _mm512_setzero_pd();
+            __m512d high = _mm512_setzero_pd();
+#pragma GCC unroll 32
+            for (int i = 0; i < DIMENSIONS; ++i) {
+                __m512i words = _mm512_i32gather_epi32(rowOffsets, (const int *) (block + ((i * BITS) >> 3)), 1);
+                __m512i cells = _mm512_and_si512(_mm512_srli_epi32(words, (i * BITS) & 7), mask);
+                __m512i indices = _mm512_add_epi32(cells, _mm512_set1_epi32(i << BITS));
+                low = _mm512_add_pd(low, _mm512_i32gather_pd(_mm512_castsi512_si256(indices), table, 8));
+                high = _mm512_add_pd(high, _mm512_i32gather_pd(_mm512_extracti64x4_epi64(indices, 1), table, 8));
+            }
+            _mm512_storeu_pd(bounds + row, low);
+            _mm512_storeu_pd(bounds + row + 8, high);
+        }
+
+        sumBoundsFixedScalar<DIMENSIONS, BITS>(rows + row * stride, count - row, stride, table, bounds + row);
+    }
+
+    // Widen eight cells to table indices
+    __attribute__((target("avx512f")))
+    inline __m512i loadCellsAVX512(const uint8_t *cells) {
+        return _mm512_cvtepu8_epi64(_mm_loadl_epi64((const __m128i *) cells));
+    }
+
+    __attribute__((target("avx512f")))
+    inline __m512i loadCellsAVX512(const uint16_t *cells) {
+        return _mm512_cvtepu16_epi64(_mm_loadu_si128((const __m128i *) cells));
+    }
+
+    // Eight rows at a time, the same scheme as the AVX2 kernel
+    template <typename Cell>
+    __attribute__((target("avx512f")))
+    double addCellBoundsAVX512(const Cell *cells, long long count, const double *table, double *bounds) {
+        __m512d minimum = _mm512_set1_pd(std::numeric_limits<double>::infinity());
+        long long row = 0;
+        for (; row + 8 <= count; row += 8) {
+            __m512d sum = _mm512_add_pd(_mm512_loadu_pd(bounds + row), _mm512_i64gather_pd(loadCellsAVX512(cells + row), table, 8));
+            _mm512_storeu_pd(bounds + row, sum);
+            minimum = _mm512_min_pd(minimum, sum);
+        }
+        return std::min(_mm512_reduce_min_pd(minimum), addCellBoundsScalar(cells + row, count - row, table, bounds + row));
+    }
+
+#pragma GCC diagnostic pop
+
+    // -- Dispatch --
+
+    struct Dispatch {
+        double (*squaredDistance)(const double *, const double *, int);
+        double (*squaredDistanceBounded)(const double *, const double *, int, const int *, double);
+        double (*squaredDistanceOrdered)(const double *, const double *, int, const int *, double);
+        double (*squaredDistanceFloat)(const double *, const float *, int);
+        void (*squaredDistances)(const double *, const double *, long long, int, double *);
+        void (*sumBounds)(const unsigned char *, long long, int, int, const int *, const int *, const int *, const double *, double *);
+        double (*addCellBounds8)(const uint8_t *, long long, const double *, double *);
+        double (*addCellBounds16)(const uint16_t *, long long, const double *, double *);
+        const char *name;
+    };
+
+    // Pick the widest instruction set the processor supports, VAFILE_ISA
+    // can force a narrower one for comparisons
+    Dispatch select() {
+        const char *forced = getenv("VAFILE_ISA");
+        std::string isa = forced == NULL ? "" : forced;
+
+        __builtin_cpu_init();
+        if (isa != "avx2" && isa != "scalar" && __builtin_cpu_supports("avx512f")) {
+            Dispatch dispatch = { squaredDistanceAVX512, squaredDistanceBoundedAVX512<false>, squaredDistanceBoundedAVX512<true>, squaredDistanceFloatAVX512, squaredDistancesAVX512, sumBoundsAVX512,
+                addCellBoundsAVX512<uint8_t>, addCellBoundsAVX512<uint16_t>, "avx512" };
+            return dispatch;
+        }
+        if (isa != "scalar" && __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+            Dispatch dispatch = { squaredDistanceAVX2, squaredDistanceBoundedAVX2<false>, squaredDistanceBoundedAVX2<true>, squaredDistanceFloatAVX2, squaredDistancesAVX2, sumBoundsAVX2,
+                addCellBoundsAVX2<uint8_t>, addCellBoundsAVX2<uint16_t>, "avx2" };
+            return dispatch;
+        }
+        Dispatch dispatch = { squaredDistanceScalar, squaredDistanceBoundedScalar<false>, squaredDistanceBoundedScalar<true>, squaredDistanceFloatScalar, squaredDistancesScalar, sumBoundsScalar,
+            addCellBoundsScalar<uint8_t>, addCellBoundsScalar<uint16_t>, "scalar" };
+        return dispatch;
+    }
+
+    const Dispatch dispatch = select();
+
+    double squaredDistance(const double *point1, const double *point2, int dimensions) {
+        return dispatch.squaredDistance(point1, point2, dimensions);
+    }
+
+    double squaredDistanceBounded(const double *point, const double *object, int dimensions, const int *order, double bound) {
+        if (order != NULL) {
+            return dispatch.squaredDistanceOrdered(point, object, dimensions, order, bound);
+        }
+        return dispatch.squaredDistanceBounded(point, object, dimensions, order, bound);
+    }
+
+    double squaredDistanceFloat(const double *point, const float *object, int dimensions) {
+        return dispatch.squaredDistanceFloat(point, object, dimensions);
+    }
+
+    double roundToFloat(const double *points, long long count, int dimensions, float *rounded) {
+        double error = 0;
+        for (long long index = 0; index < count; ++index) {
+            double distance = 0;
+            for (int i = 0; i < dimensions; ++i) {
+                long long position = index * dimensions + i;
+                rounded[position] = (float) points[position];
+                double component = points[position] - rounded[position];
+                distance += component * component;
+            }
+            error = std::max(error, distance);
+        }
+        return std::sqrt(error);
+    }
+
+    void orderDimensions(const double *point, const double *means, int dimensions, int *order, double *orderedPoint) {
+        for (int i = 0; i < dimensions; ++i) {
+            order[i] = i;
+        }
+        std::sort(order, order + dimensions, [&](int a, int b) {
+            double deviationA = std::abs(point[a] - means[a]);
+            double deviationB = std::abs(point[b] - means[b]);
+            return deviationA > deviationB || (deviationA == deviationB && a < b);
+        });
+        for (int i = 0; i < dimensions; ++i) {
+            orderedPoint[i] = point[order[i]];
+        }
+    }
+
+    void squaredDistances(const double *point, const double *rows, long long count, int dimensions, double *distances) {
+        dispatch.squaredDistances(point, rows, count, dimensions, distances);
+    }
+
+    void sumBounds(const unsigned char *rows, long long count, int stride, int dimensions,
+            const int *bitOffsets, const int *bits, const int *tableOffsets, const double *table, double *bounds) {
+        dispatch.sumBounds(rows, count, stride, dimensions, bitOffsets, bits, tableOffsets, table, bounds);
+    }
+
+    double addCellBounds(const unsigned char *cells, int cellBytes, long long count, const double *table, double *bounds) {
+        if (cellBytes == 1) {
+            return dispatch.addCellBounds8(cells, count, table, bounds);
+        }
+        return dispatch.addCellBounds16((const uint16_t *) cells, count, table, bounds);
+    }
+
+    // The specialized layouts, one kernel per instruction set
+    struct FixedKernels {
+        int dimensions;
+        int bits;
+        FixedBoundKernel avx512;
+        FixedBoundKernel avx2;
+        FixedBoundKernel scalar;
+    };
+
+    const FixedKernels fixedKernels[] = {
+        { 25, 2, sumBoundsFixedAVX512<25, 2>, sumBoundsFixedAVX2<25, 2>, sumBoundsFixedScalar<25, 2> },
+        { 25, 4, sumBoundsFixedAVX512<25, 4>, sumBoundsFixedAVX2<25, 4>, sumBoundsFixedScalar<25, 4> },
+        { 25, 8, sumBoundsFixedAVX512<25, 8>, sumBoundsFixedAVX2<25, 8>, sumBoundsFixedScalar<25, 8> },
+    };
+
+    FixedBoundKernel getFixedBoundKernel(int dimensions, int bits) {
+        for (const FixedKernels& kernels : fixedKernels) {
+            if (kernels.dimensions == dimensions && kernels.bits == bits) {
+                std::string name = dispatch.name;
+                return name == "avx512" ? kernels.avx512 : name == "avx2" ? kernels.avx2 : kernels.scalar;
+            }
+        }
+        return NULL;
+    }
+
+    const char *getInstructionSet() {
+        return dispatch.name;
+    }
+}
@@ -0,0 +1,146 @@
+/*
+ * Copyright (c) 2015 Srijan R Shetty
+ * Author: Srijan R Shetty <srijan.shetty+code@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+#ifndef KERNELS_H
+#define KERNELS_H
+
+namespace Kernels {
+    /**
+     * Get the squared euclidean distance between two points
+     * @param point1 The first point
+     * @param point2 The second point
+     * @param dimensions Number of coordinates
+     * @return Squared distance
+     */
+    double squaredDistance(const double *point1, const double *point2, int dimensions);
+
+    /**
+     * Get the squared euclidean distance between a query and an object,
+     * giving up once a partial sum exceeds a bound. In the natural order the
+     * sum is the one squaredDistance returns.
+     * @param point The query point, permuted by order
+     * @param object The object
+     * @param dimensions Number of coordinates
+     * @param order The object dimension of every coordinate of point, NULL
+     * for the natural order
+     * @param bound Largest distance of interest
+     * @return Squared distance, or a partial sum above bound
+     */
+    double squaredDistanceBounded(const double *point, const double *object, int dimensions, const int *order, double bound);
+
+    /**
+     * Get the squared euclidean distance between a query and an object
+     * stored as floats, computed in double
+     * @param point The query point
+     * @param object The object rounded to floats
+     * @param dimensions Number of coordinates
+     * @return Squared distance to the rounded object
+     */
+    double squaredDistanceFloat(const double *point, const float *object, int dimensions);
+
+    /**
+     * Round points to floats
+     * @param points count points of dimensions doubles, back to back
+     * @param count Number of points
+     * @param dimensions Number of coordinates
+     * @param rounded Output, count * dimensions floats
+     * @return The largest euclidean distance between a point and its rounding
+     */
+    double roundToFloat(const double *points, long long count, int dimensions, float *rounded);
+
+    /**
+     * Order the dimensions of a query for squaredDistanceBounded, those where
+     * the point lies farthest from the mean of the data first, so that the
+     * partial sums grow fast
+     * @param point The query point
+     * @param means Mean of every dimension of the data
+     * @param dimensions Number of coordinates
+     * @param order Output, the dimensions in visiting order
+     * @param orderedPoint Output, the coordinates of point in that order
+     */
+    void orderDimensions(const double *point, const double *means, int dimensions, int *order, double *orderedPoint);
+
+    /**
+     * Score a block of contiguous rows against one point
+     * @param point The query point
+     * @param rows count rows of dimensions doubles each, back to back
+     * @param count Number of rows
+     * @param dimensions Number of coordinates
+     * @param distances Output, squared distance of every row
+     */
+    void squaredDistances(const double *point, const double *rows, long long count, int dimensions, double *distances);
+
+    /**
+     * Evaluate a bound on a block of packed approximations by table lookups.
+     * Cell i of a row is the bits[i] wide field at bit offset bitOffsets[i]
+     * and contributes table[tableOffsets[i] + cell]. The rows must be
+     * followed by at least 4 readable bytes.
+     * @param rows count packed approximations of stride bytes each
+     * @param count Number of rows
+     * @param stride Bytes per approximation
+     * @param dimensions Number of cells per approximation
+     * @param bitOffsets Bit offset of every cell
+     * @param bits Bits of every cell, at most 24
+     * @param tableOffsets Offset of the entries of every cell in the table
+     * @param table The lookup table
+     * @param bounds Output, the bound of every row
+     */
+    void sumBounds(const unsigned char *rows, long long count, int stride, int dimensions,
+            const int *bitOffsets, const int *bits, const int *tableOffsets, const double *table, double *bounds);
+
+    /**
+     * Add one dimension of a block of the dimension blocked layout to the
+     * bounds of its rows
+     * @param cells count cells of cellBytes bytes each, the table indices
+     * @param cellBytes 1 or 2
+     * @param count Number of rows
+     * @param table The lookup table of the dimension
+     * @param bounds The bound of every row, incremented
+     * @return The smallest bound after the addition
+     */
+    double addCellBounds(const unsigned char *cells, int cellBytes, long long count, const double *table, double *bounds);
+
+    /**
+     * A bound kernel specialized for approximations of a fixed number of
+     * cells of equal width, cell i at bit offset i * bits and table offset
+     * i << bits. Same contract as sumBounds otherwise.
+     */
+    typedef void (*FixedBoundKernel)(const unsigned char *rows, long long count, int stride, const double *table, double *bounds);
+
+    /**
+     * Get the fully unrolled bound kernel for a layout, there are
+     * specializations for 25 dimensions of 2, 4 or 8 bits
+     * @param dimensions Number of cells per approximation
+     * @param bits Bits of every cell
+     * @return The kernel, or NULL if the layout has no specialization
+     */
+    FixedBoundKernel getFixedBoundKernel(int dimensions, int bits);
+
+    /**
+     * Name of the instruction set the kernels dispatch to on this machine
+     * @return "avx512", "avx2" or "scalar"
+     */
+    const char *getInstructionSet();
+}
+
+#endif
@@ -26,99 +26,451 @@
 // The header file
 #include "linear.h"
 
-// We will use some utilities from vafile
-#include "vafile.h"
+// Runtime parameters
+#include "options.h"
 
-// Stream Processing
-#include <fstream>
-#include <iostream>
+// Bulk parsing of the data file
+#include "loader.h"
+
+// Vectorized distance kernels
+#include "kernels.h"
+
+// Parallel scans
+#include "threadpool.h"
+
+// Query results
+#include "results.h"
+
+// Reusable query scratch
+#include "context.h"
+
+// Hash lookups of point queries
+#include "pointindex.h"
+
+// Memory mapping of the data file
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 // STL
 #include <string>
 #include <vector>
-#include <queue>
+#include <algorithm>
+#include <atomic>
+
+// Math
+#include <cmath>
+#include <limits>
 
 namespace LinearArray {
     // Store the file as a linear array
-    std::vector< std::pair<std::vector<double>, std::string> > linearArray;
+    Loader::Objects linearArray;
+
+    // Coordinates of every object
+    int dimensions = 0;
+
+    // Mean of every dimension, orders the exact distances
+    std::vector<double> means;
+    bool dimensionOrder = false;
 
-    void buildLinearArray() {
-        std::ifstream ifile(DATAFILE);
-        std::ofstream ofile(VAFILE);
+    // Slack of the radius test, squaring the radius rounds
+    const double SLACK = 1 + 1e-9;
+
+    // Rows a kNN scan scores at once
+    const long long SCAN_BLOCK = 1024;
+
+    // Get the coordinates of an object
+    inline const double *getPoint(long long index) {
+        return linearArray.coordinates.data() + index * dimensions;
+    }
 
-        // Read the file line by line
-        for (std::string line; std::getline(ifile, line); ) {
-            // Parse the input line into coordinates and string
-            auto input = VAFile::parseNormalLine(line);
+    // With float precision only the coordinates rounded to floats are kept,
+    // with the farthest any object is from its rounding. The objects that
+    // may be near a query are parsed again from the mapped data file.
+    std::vector<float> floatCoordinates;
+    double floatError = 0;
+    const char *dataText = NULL;
+    long long dataSize = 0;
 
-            // Write the VALine to the file
-            linearArray.push_back(input);
+    // Table of the objects by the hash of their coordinates, empty without one
+    std::vector<PointIndex::Slot> pointSlots;
+
+    // Objects compared by the last query, every one unless the hash finds them
+    std::atomic<long long> comparedCount(0);
+
+    inline const float *getFloatPoint(long long index) {
+        return floatCoordinates.data() + index * dimensions;
+    }
+
+    // Get the coordinates of an object, with floats only if its rounding
+    // may be within a squared distance of the point, parsed into the scratch
+    // of the slice; NULL if it surely is not
+    const double *getExact(const std::vector<double>& point, long long index, double squaredDistance, Context::Slice& slice) {
+        if (floatCoordinates.empty()) {
+            return getPoint(index);
+        }
+        double lower = std::sqrt(Kernels::squaredDistanceFloat(point.data(), getFloatPoint(index), dimensions)) - floatError;
+        if (lower > 0 && lower * lower > squaredDistance * SLACK) {
+            return NULL;
         }
+        slice.point.resize(dimensions);
+        Loader::parsePoint(dataText + linearArray.lineOffsets[index], dataText + dataSize, dimensions, slice.point.data());
+        return slice.point.data();
+    }
 
-        // Close open files
-        ifile.close();
-        ofile.close();
+    // Map the data file for the objects parsed again
+    void mapDataFile(const std::string& filename) {
+        if (dataText != NULL) {
+            munmap((void *) dataText, dataSize);
+            dataText = NULL;
+        }
+        struct stat st;
+        int fd = open(filename.c_str(), O_RDONLY);
+        if (fd < 0 || fstat(fd, &st) != 0 || st.st_size == 0) {
+            if (fd >= 0) {
+                close(fd);
+            }
+            return;
+        }
+        void *address = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (address != MAP_FAILED) {
+            madvise(address, st.st_size, MADV_RANDOM);
+            dataText = (const char *) address;
+            dataSize = st.st_size;
+        }
     }
 
-    void pointQuery(std::vector<double> point) {
-        // Call rangeQuery with a zero radius
-        rangeQuery(point, 0);
+    long long getObjectCount() {
+        return linearArray.getCount();
+    }
+
+    long long getComparedCount() {
+        return comparedCount;
+    }
+
+    std::string getDataString(long long index) {
+        long long length;
+        const char *payload = getPayload(index, length);
+        return std::string(payload, length);
+    }
+
+    const char *getPayload(long long index, long long& length) {
+        length = linearArray.payloadIndex[index + 1] - linearArray.payloadIndex[index];
+        return linearArray.payloads.data() + linearArray.payloadIndex[index];
+    }
+
+    // Hand a result to the visitor with a view of its data string
+    inline void visitResult(Results::Visitor& visitor, Results::Result result) {
+        result.payload = getPayload(result.index, result.payloadLength);
+        visitor.visit(result);
+    }
+
+    // Collect the indices of the results of a query
+    std::vector<long long> getIndices(const Results::Buffer& buffer) {
+        std::vector<long long> indices;
+        for (auto& result : buffer.results) {
+            indices.push_back(result.index);
+        }
+        return indices;
+    }
+
+    // Set up the exact distances of a query: the point to pass to
+    // squaredDistanceBounded and the order of its dimensions, NULL unless
+    // dimensionOrder is set
+    const int *getQueryOrder(const std::vector<double>& point, Context::QueryContext& context, const double *&query) {
+        query = point.data();
+        if (!dimensionOrder) {
+            return NULL;
+        }
+        context.order.resize(dimensions);
+        context.orderedPoint.resize(dimensions);
+        Kernels::orderDimensions(point.data(), means.data(), dimensions, context.order.data(), context.orderedPoint.data());
+        query = context.orderedPoint.data();
+        return context.order.data();
+    }
+
+    void buildLinearArray(const Options& options) {
+        dimensions = options.dimensions;
+        dimensionOrder = options.dimensionOrder;
+        Loader::load(options.dataFile, dimensions, linearArray);
+
+        means.assign(dimensions, 0);
+        long long count = linearArray.getCount();
+        for (long long index = 0; index < count; ++index) {
+            for (int i = 0; i < dimensions; ++i) {
+                means[i] += getPoint(index)[i];
+            }
+        }
+        for (int i = 0; i < dimensions && count > 0; ++i) {
+            means[i] /= count;
+        }
+
+        pointSlots.clear();
+        if (options.pointIndex) {
+            PointIndex::build(linearArray.coordinates.data(), count, dimensions, pointSlots);
+        }
+
+        // The doubles are dropped once the floats, means and point index
+        // are built from them
+        floatCoordinates.clear();
+        floatError = 0;
+        if (options.precision == PRECISION_FLOAT && count > 0) {
+            floatCoordinates.resize(linearArray.coordinates.size());
+            floatError = Kernels::roundToFloat(linearArray.coordinates.data(), count, dimensions, floatCoordinates.data());
+            std::vector<double>().swap(linearArray.coordinates);
+            mapDataFile(options.dataFile);
+        } else {
+            std::vector<uint64_t>().swap(linearArray.lineOffsets);
+        }
     }
 
-    void rangeQuery(std::vector<double> point, double radius) {
+    void pointQuery(const std::vector<double>& point, Results::Visitor& visitor, Context::QueryContext& context) {
+        if (pointSlots.empty()) {
+            // Call rangeQuery with a zero radius
+            rangeQuery(point, 0, visitor, context);
+            return;
+        }
 
-        // Loop over the entire array and print point on match
-        for(auto arrayEntry : linearArray) {
-            if (VAFile::getDistance(point, arrayEntry.first) <= radius) {
-#ifdef OUTPUT
-                std::cout << arrayEntry.second << std::endl;
-#endif
+        // Compare the objects with the hash of the point, the table hands
+        // them out in no order
+        Context::Slice& slice = context.getSlices(1)[0];
+        std::vector<Results::Result>& results = slice.results;
+        long long compared = 0;
+        PointIndex::find(pointSlots.data(), pointSlots.size(), point.data(), dimensions, [&](long long index) {
+            ++compared;
+            const double *object = getExact(point, index, 0, slice);
+            if (object != NULL && std::equal(object, object + dimensions, point.begin())) {
+                results.push_back(Results::Result{ index, 0, NULL, 0 });
             }
+        });
+        comparedCount = compared;
+        std::sort(results.begin(), results.end(), [](const Results::Result& first, const Results::Result& second) {
+            return first.index < second.index;
+        });
+        for (auto& result : results) {
+            visitResult(visitor, result);
         }
     }
 
-    void kNNQuery(std::vector<double> point, long long k) {
-        // Comparator for the priority queue
-        class comparator {
-            public:
-                bool operator() (std::pair< std::string, double> &p1, std::pair<std::string, double> &p2) {
-                    return p1.second < p2.second;
+    void rangeQuery(const std::vector<double>& point, double radius, Results::Visitor& visitor, Context::QueryContext& context) {
+        // Exact distances stop once they are clearly outside the radius
+        const double *query;
+        const int *order = getQueryOrder(point, context, query);
+        double bound = radius * radius * SLACK;
+        bool floats = !floatCoordinates.empty();
+        double floatBound = (radius + floatError) * (radius + floatError) * SLACK;
+        comparedCount = linearArray.getCount();
+
+        // Every slice collects the matches in its part of the array
+        std::vector<Context::Slice>& slices = context.getSlices(ThreadPool::getThreadCount());
+        ThreadPool::parallelFor(linearArray.getCount(), [&](int slice, long long begin, long long end) {
+            for (long long index = begin; index < end; ++index) {
+                // Objects whose rounding is beyond the radius and the
+                // rounding error are skipped, those whose rounding is within
+                // it by the error are taken with the distance to their
+                // rounding; only the ones in between are parsed again
+                if (floats) {
+                    double floatDistance = Kernels::squaredDistanceFloat(point.data(), getFloatPoint(index), dimensions);
+                    if (floatDistance > floatBound) {
+                        continue;
+                    }
+                    if (std::sqrt(floatDistance) + floatError <= radius) {
+                        slices[slice].results.push_back(Results::Result{ index, std::sqrt(floatDistance), NULL, 0 });
+                        continue;
+                    }
                 }
-        };
+                const double *object = getExact(point, index, radius * radius, slices[slice]);
+                if (object == NULL) {
+                    continue;
+                }
+                double distance = std::sqrt(Kernels::squaredDistanceBounded(query, object, dimensions, order, bound));
+                if (distance <= radius) {
+                    slices[slice].results.push_back(Results::Result{ index, distance, NULL, 0 });
+                }
+            }
+        });
 
-        // Maintain a priority queue for the k nearest neighbours
-        std::priority_queue< std::pair< std::string, double>,
-            std::vector< std::pair< std::string, double> >, comparator > nearestNeighbours;
+        // The slices are in order
+        for (int slice = 0; slice < ThreadPool::getThreadCount(); ++slice) {
+            for (auto& result : slices[slice].results) {
+                visitResult(visitor, result);
+            }
+        }
+    }
+
+    // The k nearest objects of a slice with float precision: every rounded
+    // object within twice the rounding error of the k-th smallest distance
+    // to a rounded object is a candidate, and the candidates are refined in
+    // double in increasing order of their lower bound
+    void kNNFloats(const std::vector<double>& point, long long k, const double *query, const int *order, long long begin, long long end,
+            std::atomic<double>& sharedThreshold, std::atomic<double>& sharedDistance, Context::Slice& slice) {
+        typedef Context::Entry Entry;
+
+        // Phase one: a heap of the k smallest distances to rounded objects
+        std::vector<Entry>& floatDistances = slice.upperBounds;
+        std::vector<Entry>& candidates = slice.candidates;
+        double threshold = std::numeric_limits<double>::infinity();
+        double pruneDistance = threshold;
+        for (long long index = begin; index < end; ++index) {
+            double floatDistance = Kernels::squaredDistanceFloat(point.data(), getFloatPoint(index), dimensions);
+            if (floatDistance > pruneDistance) {
+                continue;
+            }
+            candidates.push_back(std::make_pair(floatDistance, index));
 
-        // Loop over the entire array and push to queue on match
-        for(auto arrayEntry : linearArray) {
-            double minDistance = VAFile::getDistance(point, arrayEntry.first);
+            if ((long long) floatDistances.size() < k) {
+                floatDistances.push_back(std::make_pair(floatDistance, index));
+                std::push_heap(floatDistances.begin(), floatDistances.end());
+            } else if (floatDistance < floatDistances.front().first) {
+                std::pop_heap(floatDistances.begin(), floatDistances.end());
+                floatDistances.back() = std::make_pair(floatDistance, index);
+                std::push_heap(floatDistances.begin(), floatDistances.end());
+            }
+            if ((long long) floatDistances.size() == k) {
+                ThreadPool::atomicMin(sharedThreshold, floatDistances.front().first);
+            }
+
+            // The k-th neighbour is within the rounding error of the k-th
+            // rounded object, a neighbour's rounding within twice of it
+            double shared = sharedThreshold.load(std::memory_order_relaxed);
+            if (shared < threshold) {
+                threshold = shared;
+                double reach = std::sqrt(threshold) + 2 * floatError;
+                pruneDistance = reach * reach * SLACK;
+            }
+        }
+
+        // Phase two: refine in increasing order of the lower bound
+        for (auto& candidate : candidates) {
+            double lower = std::max(0.0, std::sqrt(candidate.first) - floatError);
+            candidate.first = lower * lower;
+        }
+        std::sort(candidates.begin(), candidates.end());
+
+        std::vector<Entry>& nearestNeighbours = slice.neighbours;
+        for (auto& candidate : candidates) {
+            double kthDistance = sharedDistance.load(std::memory_order_relaxed);
+            if (candidate.first > kthDistance * SLACK) {
+                break;
+            }
+            const double *object = getExact(point, candidate.second, kthDistance, slice);
+            if (object == NULL) {
+                continue;
+            }
+            Entry neighbour(Kernels::squaredDistanceBounded(query, object, dimensions, order, kthDistance), candidate.second);
+            if (neighbour.first > kthDistance) {
+                continue;
+            }
 
-            // If the queue is empty, we push elements into it
             if ((long long) nearestNeighbours.size() < k) {
-                nearestNeighbours.push(std::make_pair(arrayEntry.second, minDistance));
-            } else {
-                // The pruning distance is the maximum distance of any point in the queue
-                // Any element which is closer than the elements in the queue is pushed
-                // onto the queue
-
-                // Otherwise check the pruning distance criterion
-                if (minDistance < nearestNeighbours.top().second) {
-                    // We don't need the top now
-                    nearestNeighbours.pop();
-
-                    // Push the new element
-                    nearestNeighbours.push(std::make_pair(arrayEntry.second, minDistance));
+                nearestNeighbours.push_back(neighbour);
+                std::push_heap(nearestNeighbours.begin(), nearestNeighbours.end());
+            } else if (neighbour < nearestNeighbours.front()) {
+                std::pop_heap(nearestNeighbours.begin(), nearestNeighbours.end());
+                nearestNeighbours.back() = neighbour;
+                std::push_heap(nearestNeighbours.begin(), nearestNeighbours.end());
+            }
+            if ((long long) nearestNeighbours.size() == k) {
+                ThreadPool::atomicMin(sharedDistance, nearestNeighbours.front().first);
+            }
+        }
+    }
+
+    void kNNQuery(const std::vector<double>& point, long long k, Results::Visitor& visitor, Context::QueryContext& context) {
+        if (k <= 0) {
+            return;
+        }
+
+        // Pairs of (squared distance, index), ties are broken by index which
+        // keeps the result identical to a sequential scan
+        typedef Context::Entry Entry;
+
+        // The k-th distance of any slice bounds the k-th neighbour
+        std::atomic<double> sharedDistance(std::numeric_limits<double>::infinity());
+        const double *query;
+        const int *order = getQueryOrder(point, context, query);
+
+        // With floats, the k-th smallest distance to a rounded object of any slice
+        std::atomic<double> sharedThreshold(std::numeric_limits<double>::infinity());
+        comparedCount = linearArray.getCount();
+
+        std::vector<Context::Slice>& slices = context.getSlices(ThreadPool::getThreadCount());
+        ThreadPool::parallelFor(linearArray.getCount(), [&](int slice, long long begin, long long end) {
+            // Maintain a heap of the k nearest neighbours, the farthest on top
+            std::vector<Entry>& nearestNeighbours = slices[slice].neighbours;
+
+            if (!floatCoordinates.empty()) {
+                kNNFloats(point, k, query, order, begin, end, sharedThreshold, sharedDistance, slices[slice]);
+                return;
+            }
+
+            // Loop over the slice a block at a time and push to the heap on
+            // match. In the natural order the k-th distance is crossed late
+            // and at random, checking costs more than the dimensions it
+            // saves, so the rows of a block are scored in full by the batch
+            // kernel; objects are only given up early with an order
+            double distances[SCAN_BLOCK];
+            for (long long start = begin; start < end; start += SCAN_BLOCK) {
+                long long count = std::min(SCAN_BLOCK, end - start);
+                if (order == NULL) {
+                    Kernels::squaredDistances(query, getPoint(start), count, dimensions, distances);
+                }
+                for (long long index = start; index < start + count; ++index) {
+                    double kthDistance = sharedDistance.load(std::memory_order_relaxed);
+                    Entry neighbour(order == NULL ? distances[index - start]
+                            : Kernels::squaredDistanceBounded(query, getPoint(index), dimensions, order, kthDistance), index);
+                    if (neighbour.first > kthDistance) {
+                        continue;
+                    }
+
+                    // If the heap is not full, we push elements into it
+                    if ((long long) nearestNeighbours.size() < k) {
+                        if (neighbour.first <= sharedDistance.load(std::memory_order_relaxed)) {
+                            nearestNeighbours.push_back(neighbour);
+                            std::push_heap(nearestNeighbours.begin(), nearestNeighbours.end());
+                        }
+                    } else if (neighbour < nearestNeighbours.front()) {
+                        // Any element which is closer than the farthest one in
+                        // the heap replaces it
+                        std::pop_heap(nearestNeighbours.begin(), nearestNeighbours.end());
+                        nearestNeighbours.back() = neighbour;
+                        std::push_heap(nearestNeighbours.begin(), nearestNeighbours.end());
+                    }
+
+                    if ((long long) nearestNeighbours.size() == k) {
+                        ThreadPool::atomicMin(sharedDistance, nearestNeighbours.front().first);
+                    }
                 }
             }
+        });
+
+        // k-way merge of the slices, keeping the k nearest
+        std::vector<Entry>& nearestNeighbours = context.neighbours;
+        nearestNeighbours.clear();
+        for (int slice = 0; slice < ThreadPool::getThreadCount(); ++slice) {
+            nearestNeighbours.insert(nearestNeighbours.end(), slices[slice].neighbours.begin(), slices[slice].neighbours.end());
+        }
+        std::sort(nearestNeighbours.begin(), nearestNeighbours.end());
+        if ((long long) nearestNeighbours.size() > k) {
+            nearestNeighbours.resize(k);
         }
 
-        // Now we loop over the neighbours and print them
-        while (!nearestNeighbours.empty()) {
-#ifdef OUTPUT
-            std::cout << nearestNeighbours.top().first << std::endl;
-#endif
-            nearestNeighbours.pop();
+        for (auto& neighbour : nearestNeighbours) {
+            visitResult(visitor, Results::Result{ neighbour.second, std::sqrt(neighbour.first), NULL, 0 });
         }
     }
+
+    std::vector<long long> rangeSearch(const std::vector<double>& point, double radius) {
+        Results::Buffer buffer;
+        rangeQuery(point, radius, buffer);
+        return getIndices(buffer);
+    }
+
+    std::vector<long long> kNNSearch(const std::vector<double>& point, long long k) {
+        Results::Buffer buffer;
+        kNNQuery(point, k, buffer);
+        return getIndices(buffer);
+    }
 }
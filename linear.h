@@ -23,6 +23,15 @@
 // config
 #include "config.h"
 
+// Runtime parameters
+#include "options.h"
+
+// Query results
+#include "results.h"
+
+// Reusable query scratch
+#include "context.h"
+
 // STL
 #include <vector>
 #include <string>
@@ -30,26 +39,80 @@
 namespace LinearArray {
     /**
      * Build a Linear Array from a normal file
+     * @param options The data file and its dimensions
+     */
+    void buildLinearArray(const Options& options);
+
+    /**
+     * Find the objects within a radius of a point, see rangeQuery
+     * @param point The query point
+     * @param radius Query radius
+     * @return The object indices, in index order
+     */
+    std::vector<long long> rangeSearch(const std::vector<double>& point, double radius);
+
+    /**
+     * Find the k nearest objects to a point, see kNNQuery
+     * @param point The query point
+     * @param k no of nearest neighbours
+     * @return The object indices, nearest first
+     */
+    std::vector<long long> kNNSearch(const std::vector<double>& point, long long k);
+
+    /**
+     * Get the number of objects in the Linear Array
+     * @return the object count
+     */
+    long long getObjectCount();
+
+    /**
+     * Get the number of objects compared by the last query
+     * @return the compared count
+     */
+    long long getComparedCount();
+
+    /**
+     * Get the data string of an object
+     * @param index The index of the object
+     * @return The data string
+     */
+    std::string getDataString(long long index);
+
+    /**
+     * Get a view of the data string of an object
+     * @param index The index of the object
+     * @param length Output, the length of the data string
+     * @return Pointer to the data string inside the array
      */
-    void buildLinearArray();
+    const char *getPayload(long long index, long long& length);
 
     /**
-     * Perform pointQuery on the Linear Array
-     * @param point A vector representation of the query point
+     * Find the objects equal to a point, may run concurrently with
+     * separate contexts
+     * @param point The query point
+     * @param visitor Gets the results in index order, at distance 0
+     * @param context Scratch memory, that of the calling thread by default
      */
-    void pointQuery(std::vector<double> point);
+    void pointQuery(const std::vector<double>& point, Results::Visitor& visitor,
+            Context::QueryContext& context = Context::getThreadContext());
 
     /**
-     * Perform rangeQuery on the Linear Array
-     * @param point A vector representation of the query point
+     * Find the objects within a radius of a point
+     * @param point The query point
      * @param radius Query radius
+     * @param visitor Gets the results in index order
+     * @param context Scratch memory, that of the calling thread by default
      */
-    void rangeQuery(std::vector<double> point, double radius);
+    void rangeQuery(const std::vector<double>& point, double radius, Results::Visitor& visitor,
+            Context::QueryContext& context = Context::getThreadContext());
 
     /**
-     * Perform kNNQuery on the Linear Array
-     * @param point A vector representation of the query point
+     * Find the k nearest objects to a point, ties broken by index
+     * @param point The query point
      * @param k no of nearest neighbours
+     * @param visitor Gets the results nearest first
+     * @param context Scratch memory, that of the calling thread by default
      */
-    void kNNQuery(std::vector<double> point, long long k);
+    void kNNQuery(const std::vector<double>& point, long long k, Results::Visitor& visitor,
+            Context::QueryContext& context = Context::getThreadContext());
 }
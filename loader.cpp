@@ -0,0 +1,271 @@
+/*
+ * Copyright (c) 2015 Srijan R Shetty
+ * Author: Srijan R Shetty <srijan.shetty+code@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+// The header file
+#include "loader.h"
+
+// Parallel parsing
+#include "threadpool.h"
+
+// Memory mapping
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+// STL
+#include <string>
+#include <vector>
+#include <cstdlib>
+#include <cstring>
+
+// Time
+#include <chrono>
+
+namespace Loader {
+    // Statistics of the last load
+    long long rowCount = 0;
+    double loadTime = 0;
+
+    // Powers of ten that are exact in a double
+    const double POWERS[] = {
+        1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+        1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+    };
+
+    // Largest integer below which every integer is exact in a double
+    const uint64_t EXACT_MANTISSA = 1ULL << 53;
+
+    inline bool isSpace(char c) {
+        return c == ' ' || c == '\t' || c == '\r' || c == '\n' || c == '\v' || c == '\f';
+    }
+
+    inline bool isDigit(char c) {
+        return c >= '0' && c <= '9';
+    }
+
+    const char *parseDouble(const char *begin, const char *end, double& value) {
+        const char *p = begin;
+        bool negative = false;
+        if (p < end && (*p == '-' || *p == '+')) {
+            negative = *p == '-';
+            ++p;
+        }
+
+        // Up to 19 significant digits fit the mantissa, later ones only
+        // shift the exponent and force the slow path
+        uint64_t mantissa = 0;
+        int significant = 0;
+        int exponent = 0;
+        bool digits = false;
+        bool truncated = false;
+        for (; p < end && isDigit(*p); ++p) {
+            digits = true;
+            if (significant < 19) {
+                mantissa = mantissa * 10 + (*p - '0');
+                significant += mantissa != 0;
+            } else {
+                truncated = truncated || *p != '0';
+                ++exponent;
+            }
+        }
+        if (p < end && *p == '.') {
+            for (++p; p < end && isDigit(*p); ++p) {
+                digits = true;
+                if (significant < 19) {
+                    mantissa = mantissa * 10 + (*p - '0');
+                    significant += mantissa != 0;
+                    --exponent;
+                } else {
+                    truncated = truncated || *p != '0';
+                }
+            }
+        }
+        if (!digits) {
+            return begin;
+        }
+
+        // An exponent is only part of the number if it has digits
+        if (p < end && (*p == 'e' || *p == 'E')) {
+            const char *q = p + 1;
+            bool negativeExponent = false;
+            if (q < end && (*q == '-' || *q == '+')) {
+                negativeExponent = *q == '-';
+                ++q;
+            }
+            if (q < end && isDigit(*q)) {
+                int written = 0;
+                for (; q < end && isDigit(*q); ++q) {
+                    written = written < 100000 ? written * 10 + (*q - '0') : written;
+                }
+                exponent += negativeExponent ? -written : written;
+                p = q;
+            }
+        }
+
+        // Clinger's fast path: both the mantissa and the power of ten are
+        // exact, so one correctly rounded operation gives the exact result
+        if (!truncated && mantissa <= EXACT_MANTISSA && exponent >= -22 && exponent <= 22) {
+            double result = (double) mantissa;
+            result = exponent < 0 ? result / POWERS[-exponent] : result * POWERS[exponent];
+            value = negative ? -result : result;
+            return p;
+        }
+
+        // Everything else is left to strtod, which needs a terminated copy
+        char buffer[64];
+        std::string longNumber;
+        const char *text = buffer;
+        if (p - begin < (long) sizeof(buffer)) {
+            std::memcpy(buffer, begin, p - begin);
+            buffer[p - begin] = 0;
+        } else {
+            longNumber.assign(begin, p);
+            text = longNumber.c_str();
+        }
+        value = std::strtod(text, NULL);
+        return p;
+    }
+
+    const char *parsePoint(const char *begin, const char *end, int dimensions, double *point) {
+        const char *q = begin;
+        for (int i = 0; i < dimensions; ++i) {
+            while (q < end && isSpace(*q)) {
+                ++q;
+            }
+            point[i] = 0;
+            q = parseDouble(q, end, point[i]);
+        }
+        return q;
+    }
+
+    // Start of the first line that starts at or after position
+    long long getLineStart(const char *text, long long size, long long position) {
+        if (position == 0) {
+            return 0;
+        }
+        const char *newline = (const char *) std::memchr(text + position - 1, '\n', size - position + 1);
+        return newline == NULL ? size : newline - text + 1;
+    }
+
+    bool load(const std::string& filename, int dimensions, Objects& objects) {
+        auto start = std::chrono::high_resolution_clock::now();
+
+        objects.dimensions = dimensions;
+        objects.coordinates.clear();
+        objects.payloadIndex.assign(1, 0);
+        objects.payloads.clear();
+        objects.lineOffsets.clear();
+
+        struct stat st;
+        if (stat(filename.c_str(), &st) != 0) {
+            return false;
+        }
+        long long size = st.st_size;
+
+        const char *text = NULL;
+        if (size > 0) {
+            int fd = open(filename.c_str(), O_RDONLY);
+            if (fd < 0) {
+                return false;
+            }
+            void *address = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+            close(fd);
+            if (address == MAP_FAILED) {
+                return false;
+            }
+            madvise(address, size, MADV_SEQUENTIAL);
+            text = (const char *) address;
+        }
+
+        // Every slice parses the lines that start in its part of the file
+        int slices = ThreadPool::getThreadCount();
+        std::vector<Objects> sliceObjects(slices);
+        ThreadPool::parallelFor(size, [&](int slice, long long begin, long long end) {
+            Objects& parsed = sliceObjects[slice];
+            parsed.payloadIndex.assign(1, 0);
+
+            const char *p = text + getLineStart(text, size, begin);
+            const char *last = text + getLineStart(text, size, end);
+            while (p < last) {
+                const char *lineEnd = (const char *) std::memchr(p, '\n', last - p);
+                if (lineEnd == NULL) {
+                    lineEnd = last;
+                }
+
+                // Skip blank lines
+                const char *q = p;
+                while (q < lineEnd && isSpace(*q)) {
+                    ++q;
+                }
+                if (q < lineEnd) {
+                    parsed.lineOffsets.push_back(p - text);
+                    parsed.coordinates.resize(parsed.coordinates.size() + dimensions);
+                    q = parsePoint(q, lineEnd, dimensions, parsed.coordinates.data() + parsed.coordinates.size() - dimensions);
+
+                    // The data string is the next word
+                    while (q < lineEnd && isSpace(*q)) {
+                        ++q;
+                    }
+                    const char *word = q;
+                    while (q < lineEnd && !isSpace(*q)) {
+                        ++q;
+                    }
+                    parsed.payloads.append(word, q);
+                    parsed.payloadIndex.push_back(parsed.payloads.size());
+                }
+
+                p = lineEnd + 1;
+            }
+        });
+
+        if (text != NULL) {
+            munmap((void *) text, size);
+        }
+
+        // Concatenate the slices in order
+        for (auto& parsed : sliceObjects) {
+            uint64_t base = objects.payloads.size();
+            objects.coordinates.insert(objects.coordinates.end(), parsed.coordinates.begin(), parsed.coordinates.end());
+            for (size_t i = 1; i < parsed.payloadIndex.size(); ++i) {
+                objects.payloadIndex.push_back(base + parsed.payloadIndex[i]);
+            }
+            objects.payloads += parsed.payloads;
+            objects.lineOffsets.insert(objects.lineOffsets.end(), parsed.lineOffsets.begin(), parsed.lineOffsets.end());
+            parsed = Objects();
+        }
+
+        auto elapsed = std::chrono::high_resolution_clock::now() - start;
+        rowCount = objects.getCount();
+        loadTime = std::chrono::duration<double>(elapsed).count();
+        return true;
+    }
+
+    long long getRowCount() {
+        return rowCount;
+    }
+
+    double getLoadTime() {
+        return loadTime;
+    }
+}
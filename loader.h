@@ -0,0 +1,97 @@
+/*
+ * Copyright (c) 2015 Srijan R Shetty
+ * Author: Srijan R Shetty <srijan.shetty+code@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+#ifndef LOADER_H
+#define LOADER_H
+
+// STL
+#include <vector>
+#include <string>
+#include <cstdint>
+
+namespace Loader {
+    /**
+     * Objects parsed from a data file: the coordinates of all objects back to
+     * back, and their data strings concatenated with payloadIndex[i] and
+     * payloadIndex[i + 1] delimiting the data string of object i. lineOffsets[i]
+     * is where the line of object i starts in the file.
+     */
+    struct Objects {
+        int dimensions;
+        std::vector<double> coordinates;
+        std::vector<uint64_t> payloadIndex;
+        std::string payloads;
+        std::vector<uint64_t> lineOffsets;
+
+        long long getCount() const {
+            return (long long) payloadIndex.size() - 1;
+        }
+    };
+
+    /**
+     * Parse a data file of one object per line, dimensions coordinates
+     * followed by a data string. The file is memory mapped and split into
+     * getThreadCount() chunks at line boundaries that are parsed in parallel.
+     * @param filename The data file
+     * @param dimensions Number of coordinates on a line
+     * @param objects Output, the objects in file order
+     * @return false if the file cannot be read
+     */
+    bool load(const std::string& filename, int dimensions, Objects& objects);
+
+    /**
+     * Parse a decimal floating point number without allocating. Numbers of
+     * at most 19 significant digits and small exponents are converted
+     * exactly with a single multiplication or division, everything else
+     * falls back to strtod.
+     * @param begin Start of the text
+     * @param end End of the text
+     * @param value Output, the number
+     * @return The end of the number, begin if there is none
+     */
+    const char *parseDouble(const char *begin, const char *end, double& value);
+
+    /**
+     * Parse the coordinates at the start of a line of a data file
+     * @param begin Start of the line
+     * @param end End of the text
+     * @param dimensions Number of coordinates
+     * @param point Output, dimensions coordinates, 0 where the line has none
+     * @return The end of the last coordinate
+     */
+    const char *parsePoint(const char *begin, const char *end, int dimensions, double *point);
+
+    /**
+     * Get the number of objects read by the last load
+     * @return the row count
+     */
+    long long getRowCount();
+
+    /**
+     * Get the time taken by the last load
+     * @return the time in seconds
+     */
+    double getLoadTime();
+}
+
+#endif
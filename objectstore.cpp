@@ -0,0 +1,414 @@
+/*
+ * Copyright (c) 2015 Srijan R Shetty
+ * Author: Srijan R Shetty <srijan.shetty+code@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+// The configuration file
+#include "config.h"
+
+// The header file
+#include "objectstore.h"
+
+// Rounding to floats
+#include "kernels.h"
+
+// To get the fileSize
+#include <sys/stat.h>
+
+// Memory mapping
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+// Stream Processing
+#include <fstream>
+
+// STL
+#include <string>
+#include <vector>
+#include <cstring>
+#include <cstdio>
+#include <algorithm>
+
+namespace ObjectStore {
+    // Magic bytes identifying an object store
+    const char MAGIC[8] = { 'V', 'A', 'O', 'B', 'J', 'S', 0, 0 };
+
+    // State of the store being written
+    std::ofstream ofile;
+    int writeDimensions = 0;
+    std::vector<uint64_t> payloadIndex;
+    std::string payloads;
+    bool writeFloats = false;
+    std::vector<float> floats;
+    double floatError = 0;
+    std::vector<uint64_t> ids;
+
+    // The memory mapped store
+    const unsigned char *mappedFile = NULL;
+    long long mappedSize = 0;
+    const Header *header = NULL;
+    int descriptor = -1;
+
+    // The index of every id of the mapped store, -1 for ids of no object,
+    // only with an id map
+    std::vector<long long> indices;
+
+    // Bytes of zero padding that align an offset to 8 bytes
+    inline uint64_t getAlignment(uint64_t offset) {
+        return (8 - offset % 8) % 8;
+    }
+
+    // Keep the float copy of a block of points being written
+    void appendFloats(const double *points, long long count) {
+        if (writeFloats) {
+            floats.resize(floats.size() + count * writeDimensions);
+            double error = Kernels::roundToFloat(points, count, writeDimensions, floats.data() + floats.size() - count * writeDimensions);
+            floatError = std::max(floatError, error);
+        }
+    }
+
+    bool create(const std::string& filename, int dimensions, int precision) {
+        close();
+
+        // A store left unfinished by a failed write is dropped
+        if (ofile.is_open()) {
+            ofile.close();
+        }
+        ofile.clear();
+        ofile.open(filename, std::ios::binary | std::ios::trunc);
+        writeDimensions = dimensions;
+        payloadIndex.assign(1, 0);
+        payloads.clear();
+        writeFloats = precision == PRECISION_FLOAT;
+        floats.clear();
+        floatError = 0;
+        ids.clear();
+
+        // Reserve space for the header, the coordinates follow it directly
+        Header header;
+        std::memset(&header, 0, sizeof(header));
+        ofile.write((const char *) &header, sizeof(header));
+        return ofile.good();
+    }
+
+    void append(const std::vector<double>& point, const std::string& dataString) {
+        // Coordinates are streamed out, the payloads are small and kept till the end
+        ofile.write((const char *) point.data(), writeDimensions * sizeof(double));
+        appendFloats(point.data(), 1);
+        payloads += dataString;
+        payloadIndex.push_back(payloads.size());
+    }
+
+    void append(const double *points, long long count, const uint64_t *payloadIndex, const char *payloads) {
+        ofile.write((const char *) points, count * writeDimensions * sizeof(double));
+        appendFloats(points, count);
+
+        // Rebase the offsets of the block onto the payloads of the store
+        uint64_t base = ObjectStore::payloads.size() - payloadIndex[0];
+        ObjectStore::payloads.append(payloads + payloadIndex[0], payloads + payloadIndex[count]);
+        for (long long index = 1; index <= count; ++index) {
+            ObjectStore::payloadIndex.push_back(base + payloadIndex[index]);
+        }
+    }
+
+    void appendIds(const uint64_t *ids, long long count) {
+        ObjectStore::ids.insert(ObjectStore::ids.end(), ids, ids + count);
+    }
+
+    bool finish() {
+        Header header;
+        std::memset(&header, 0, sizeof(header));
+        std::memcpy(header.magic, MAGIC, sizeof(MAGIC));
+        header.version = VERSION;
+        header.dimensions = writeDimensions;
+        header.objectCount = payloadIndex.size() - 1;
+        header.coordinateOffset = sizeof(Header);
+        header.indexOffset = header.coordinateOffset + header.objectCount * writeDimensions * sizeof(double);
+        header.payloadOffset = header.indexOffset + payloadIndex.size() * sizeof(uint64_t);
+        uint64_t end = header.payloadOffset + payloads.size();
+        if (writeFloats) {
+            header.floatOffset = end + getAlignment(end);
+            header.floatError = floatError;
+            end = header.floatOffset + floats.size() * sizeof(float);
+        }
+        if (!ids.empty()) {
+            header.idOffset = end + getAlignment(end);
+        }
+
+        // The payload index and the payloads go after the coordinates, then
+        // the float copy and the ids
+        const char padding[8] = { 0 };
+        ofile.write((const char *) payloadIndex.data(), payloadIndex.size() * sizeof(uint64_t));
+        ofile.write(payloads.data(), payloads.size());
+        if (writeFloats) {
+            ofile.write(padding, header.floatOffset - (header.payloadOffset + payloads.size()));
+            ofile.write((const char *) floats.data(), floats.size() * sizeof(float));
+        }
+        if (!ids.empty()) {
+            ofile.write(padding, getAlignment(end));
+            ofile.write((const char *) ids.data(), ids.size() * sizeof(uint64_t));
+        }
+
+        ofile.seekp(0);
+        ofile.write((const char *) &header, sizeof(header));
+        ofile.close();
+        bool written = !ofile.fail();
+
+        // Release the build buffers
+        std::vector<uint64_t>().swap(payloadIndex);
+        std::string().swap(payloads);
+        std::vector<float>().swap(floats);
+        std::vector<uint64_t>().swap(ids);
+        return written;
+    }
+
+    bool insert(const std::string& filename, const double *points, long long count, const uint64_t *payloadIndex, const char *payloads) {
+        std::ifstream file(filename, std::ios::binary);
+        Header header;
+        if (!file.read((char *) &header, sizeof(header))
+                || std::memcmp(header.magic, MAGIC, sizeof(MAGIC)) != 0
+                || header.version != VERSION) {
+            return false;
+        }
+
+        // Read the tail that the new coordinates displace
+        std::vector<uint64_t> index(header.objectCount + 1);
+        file.seekg(header.indexOffset);
+        file.read((char *) index.data(), index.size() * sizeof(uint64_t));
+        std::string tail(index.back(), 0);
+        file.seekg(header.payloadOffset);
+        file.read(&tail[0], tail.size());
+        std::vector<float> rounded;
+        if (header.floatOffset != 0) {
+            rounded.resize((header.objectCount + count) * header.dimensions);
+            file.seekg(header.floatOffset);
+            file.read((char *) rounded.data(), header.objectCount * header.dimensions * sizeof(float));
+            double error = Kernels::roundToFloat(points, count, header.dimensions, rounded.data() + header.objectCount * header.dimensions);
+            header.floatError = std::max(header.floatError, error);
+        }
+        std::vector<uint64_t> objectIds;
+        if (header.idOffset != 0) {
+            objectIds.resize(header.objectCount);
+            file.seekg(header.idOffset);
+            file.read((char *) objectIds.data(), objectIds.size() * sizeof(uint64_t));
+            uint64_t next = objectIds.empty() ? 0 : *std::max_element(objectIds.begin(), objectIds.end()) + 1;
+            for (long long i = 0; i < count; ++i) {
+                objectIds.push_back(next + i);
+            }
+        }
+        if (!file) {
+            return false;
+        }
+
+        // Rebase the offsets of the block onto the payloads of the store
+        uint64_t base = index.back() - payloadIndex[0];
+        for (long long i = 1; i <= count; ++i) {
+            index.push_back(base + payloadIndex[i]);
+        }
+        tail.append(payloads + payloadIndex[0], payloads + payloadIndex[count]);
+
+        uint64_t oldIndexOffset = header.indexOffset;
+        header.objectCount += count;
+        header.indexOffset = header.coordinateOffset + header.objectCount * header.dimensions * sizeof(double);
+        header.payloadOffset = header.indexOffset + index.size() * sizeof(uint64_t);
+        uint64_t end = header.payloadOffset + tail.size();
+        uint64_t payloadEnd = end;
+        if (header.floatOffset != 0) {
+            header.floatOffset = end + getAlignment(end);
+            end = header.floatOffset + rounded.size() * sizeof(float);
+        }
+        if (header.idOffset != 0) {
+            header.idOffset = end + getAlignment(end);
+        }
+
+        // The store is written again next to the old one and swapped in,
+        // so that a crash leaves either of them whole. The coordinates are
+        // copied as they are and those of the block follow them
+        std::string newFile = filename + ".insert";
+        std::ofstream output(newFile, std::ios::binary | std::ios::trunc);
+        output.write((const char *) &header, sizeof(header));
+        std::vector<char> buffer(1 << 20);
+        file.seekg(sizeof(header));
+        for (uint64_t position = sizeof(header); position < oldIndexOffset && file; ) {
+            uint64_t length = std::min((uint64_t) buffer.size(), oldIndexOffset - position);
+            file.read(buffer.data(), length);
+            output.write(buffer.data(), length);
+            position += length;
+        }
+        output.write((const char *) points, count * header.dimensions * sizeof(double));
+        output.write((const char *) index.data(), index.size() * sizeof(uint64_t));
+        output.write(tail.data(), tail.size());
+        const char padding[8] = { 0 };
+        if (header.floatOffset != 0) {
+            output.write(padding, header.floatOffset - payloadEnd);
+            output.write((const char *) rounded.data(), rounded.size() * sizeof(float));
+        }
+        if (header.idOffset != 0) {
+            output.write(padding, getAlignment(end));
+            output.write((const char *) objectIds.data(), objectIds.size() * sizeof(uint64_t));
+        }
+        output.close();
+        if (!file || output.fail()) {
+            std::remove(newFile.c_str());
+            return false;
+        }
+        file.close();
+        return std::rename(newFile.c_str(), filename.c_str()) == 0;
+    }
+
+    bool open(const std::string& filename) {
+        if (mappedFile != NULL) {
+            return true;
+        }
+
+        struct stat st;
+        if (stat(filename.c_str(), &st) != 0 || st.st_size < (long long) sizeof(Header)) {
+            return false;
+        }
+
+        int fd = ::open(filename.c_str(), O_RDONLY);
+        if (fd < 0) {
+            return false;
+        }
+
+        // The descriptor stays open for reads that bypass the mapping
+        void *address = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (address == MAP_FAILED) {
+            ::close(fd);
+            return false;
+        }
+
+        // Reject anything that is not an object store
+        const Header *mappedHeader = (const Header *) address;
+        if (std::memcmp(mappedHeader->magic, MAGIC, sizeof(MAGIC)) != 0
+                || mappedHeader->version != VERSION
+                || (long long) mappedHeader->payloadOffset > st.st_size
+                || (mappedHeader->floatOffset != 0 && (long long) (mappedHeader->floatOffset
+                        + mappedHeader->objectCount * mappedHeader->dimensions * sizeof(float)) > st.st_size)
+                || (mappedHeader->idOffset != 0 && (long long) (mappedHeader->idOffset
+                        + mappedHeader->objectCount * sizeof(uint64_t)) > st.st_size)) {
+            munmap(address, st.st_size);
+            ::close(fd);
+            return false;
+        }
+
+        // Refinement jumps around the store
+        madvise(address, st.st_size, MADV_RANDOM);
+
+        mappedFile = (const unsigned char *) address;
+        mappedSize = st.st_size;
+        header = mappedHeader;
+        descriptor = fd;
+
+        // Invert the id map
+        indices.clear();
+        if (header->idOffset != 0) {
+            const uint64_t *objectIds = (const uint64_t *) (mappedFile + header->idOffset);
+            const uint64_t *last = objectIds + header->objectCount;
+            indices.assign(objectIds == last ? 0 : *std::max_element(objectIds, last) + 1, -1);
+            for (long long index = 0; index < (long long) header->objectCount; ++index) {
+                indices[objectIds[index]] = index;
+            }
+        }
+        return true;
+    }
+
+    void close() {
+        if (mappedFile != NULL) {
+            munmap((void *) mappedFile, mappedSize);
+            mappedFile = NULL;
+            mappedSize = 0;
+            header = NULL;
+            ::close(descriptor);
+            descriptor = -1;
+            std::vector<long long>().swap(indices);
+        }
+    }
+
+    long long getObjectCount() {
+        return header == NULL ? 0 : header->objectCount;
+    }
+
+    int getDimensions() {
+        return header == NULL ? 0 : header->dimensions;
+    }
+
+    const double *getPoint(long long index) {
+        return (const double *) (mappedFile + header->coordinateOffset) + index * header->dimensions;
+    }
+
+    uint64_t getPointOffset(long long index) {
+        return header->coordinateOffset + index * header->dimensions * sizeof(double);
+    }
+
+    int getDescriptor() {
+        return descriptor;
+    }
+
+    const float *getFloatPoint(long long index) {
+        if (header->floatOffset == 0) {
+            return NULL;
+        }
+        return (const float *) (mappedFile + header->floatOffset) + index * header->dimensions;
+    }
+
+    uint64_t getFloatPointOffset(long long index) {
+        return header->floatOffset + index * header->dimensions * sizeof(float);
+    }
+
+    int getPrecision() {
+        return header != NULL && header->floatOffset != 0 ? PRECISION_FLOAT : PRECISION_DOUBLE;
+    }
+
+    double getFloatError() {
+        return header == NULL ? 0 : header->floatError;
+    }
+
+    bool hasIds() {
+        return header != NULL && header->idOffset != 0;
+    }
+
+    long long getId(long long index) {
+        if (!hasIds()) {
+            return index;
+        }
+        return ((const uint64_t *) (mappedFile + header->idOffset))[index];
+    }
+
+    long long getIndex(long long id) {
+        if (!hasIds()) {
+            return id;
+        }
+        return id >= 0 && id < (long long) indices.size() ? indices[id] : -1;
+    }
+
+    std::string getDataString(long long index) {
+        long long length;
+        const char *payload = getPayload(index, length);
+        return std::string(payload, length);
+    }
+
+    const char *getPayload(long long index, long long& length) {
+        const uint64_t *payloadIndex = (const uint64_t *) (mappedFile + header->indexOffset);
+        length = payloadIndex[index + 1] - payloadIndex[index];
+        return (const char *) (mappedFile + header->payloadOffset) + payloadIndex[index];
+    }
+}
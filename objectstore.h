@@ -0,0 +1,226 @@
+/*
+ * Copyright (c) 2015 Srijan R Shetty
+ * Author: Srijan R Shetty <srijan.shetty+code@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef OBJECTSTORE_H
+#define OBJECTSTORE_H
+
+// STL
+#include <vector>
+#include <string>
+#include <cstdint>
+
+namespace ObjectStore {
+    // Binary object store format version, bump on any layout change
+    const uint32_t VERSION = 3;
+
+    /**
+     * On-disk header of the object store. All objects live in one file:
+     * objectCount * dimensions doubles at coordinateOffset, objectCount + 1
+     * uint64_t offsets into the payload section at indexOffset, and the
+     * concatenated data strings at payloadOffset. A store with float
+     * precision also holds the coordinates rounded to floats at the 8 byte
+     * aligned floatOffset, 0 otherwise; no object is farther than floatError
+     * from its rounded point. A store whose indices are not the lines of the
+     * data file, Z-ordered or compacted, holds the original id of every
+     * object as objectCount uint64_t at the 8 byte aligned idOffset, 0 when
+     * every object is its own id.
+     */
+    struct Header {
+        char magic[8];
+        uint32_t version;
+        uint32_t dimensions;
+        uint64_t objectCount;
+        uint64_t coordinateOffset;
+        uint64_t indexOffset;
+        uint64_t payloadOffset;
+        uint64_t floatOffset;
+        double floatError;
+        uint64_t idOffset;
+    };
+
+    /**
+     * Start writing a new object store, truncating the old one
+     * @param filename The file to write
+     * @param dimensions Number of coordinates of every object
+     * @param precision PRECISION_DOUBLE, or PRECISION_FLOAT to also store
+     * the coordinates as floats
+     * @return false if the file cannot be opened for writing
+     */
+    bool create(const std::string& filename, int dimensions, int precision);
+
+    /**
+     * Append an object to the store being written
+     * @param point The point as vector<double>
+     * @param dataString the data string
+     */
+    void append(const std::vector<double>& point, const std::string& dataString);
+
+    /**
+     * Append a block of objects to the store being written
+     * @param points count points back to back
+     * @param count Number of objects
+     * @param payloadIndex count + 1 offsets delimiting the data strings in payloads
+     * @param payloads The data strings, concatenated
+     */
+    void append(const double *points, long long count, const uint64_t *payloadIndex, const char *payloads);
+
+    /**
+     * Record the original ids of the objects appended to the store being
+     * written, in the order they were appended
+     * @param ids count ids
+     * @param count Number of objects
+     */
+    void appendIds(const uint64_t *ids, long long count);
+
+    /**
+     * Write out the payload section and the header of the store being written
+     * @return false if any write of the store failed
+     */
+    bool finish();
+
+    /**
+     * Append a block of objects to a finished store on disk. The store is
+     * written again to filename.insert with the coordinates of the block
+     * after the others, and renamed over the old one; the store must not be
+     * mapped. With an id map the objects of the block get the ids after the
+     * largest one.
+     * @param filename The store to extend
+     * @param points count points back to back
+     * @param count Number of objects
+     * @param payloadIndex count + 1 offsets delimiting the data strings in payloads
+     * @param payloads The data strings, concatenated
+     * @return false if the file is not an object store
+     */
+    bool insert(const std::string& filename, const double *points, long long count, const uint64_t *payloadIndex, const char *payloads);
+
+    /**
+     * Memory map an object store, a no-op if it is already mapped
+     * @param filename The file to map
+     * @return false if the file is missing or not an object store
+     */
+    bool open(const std::string& filename);
+
+    /**
+     * Unmap the object store
+     */
+    void close();
+
+    /**
+     * Get the number of objects in the mapped store
+     * @return the number of objects
+     */
+    long long getObjectCount();
+
+    /**
+     * Get the number of coordinates of every object in the mapped store
+     * @return the number of dimensions
+     */
+    int getDimensions();
+
+    /**
+     * Get the coordinates of an object
+     * @param index The index of the object
+     * @return Pointer to getDimensions() doubles inside the mapping
+     */
+    const double *getPoint(long long index);
+
+    /**
+     * Get where the coordinates of an object are in the file, to read them
+     * without the mapping
+     * @param index The index of the object
+     * @return Offset of getDimensions() doubles
+     */
+    uint64_t getPointOffset(long long index);
+
+    /**
+     * Get a descriptor of the mapped store, open while it is mapped
+     * @return The descriptor
+     */
+    int getDescriptor();
+
+    /**
+     * Get the coordinates of an object rounded to floats
+     * @param index The index of the object
+     * @return Pointer to getDimensions() floats inside the mapping, NULL if
+     * the store does not have float precision
+     */
+    const float *getFloatPoint(long long index);
+
+    /**
+     * Get where the float coordinates of an object are in the file, only for
+     * a store with float precision
+     * @param index The index of the object
+     * @return Offset of getDimensions() floats
+     */
+    uint64_t getFloatPointOffset(long long index);
+
+    /**
+     * Get the precision of the mapped store
+     * @return PRECISION_DOUBLE or PRECISION_FLOAT
+     */
+    int getPrecision();
+
+    /**
+     * Get how far the float coordinates may be from the objects
+     * @return The largest euclidean distance between an object and its
+     * rounded point
+     */
+    double getFloatError();
+
+    /**
+     * Get whether the indices of the objects are not their ids
+     * @return true if the mapped store has an id map
+     */
+    bool hasIds();
+
+    /**
+     * Get the original id of an object, its line in the data file or the
+     * order it was inserted in
+     * @param index The index of the object in the store
+     * @return The id, index itself without an id map
+     */
+    long long getId(long long index);
+
+    /**
+     * Get where an object is in the store
+     * @param id The original id of the object
+     * @return The index of the object, -1 if no object has the id
+     */
+    long long getIndex(long long id);
+
+    /**
+     * Get the data string of an object
+     * @param index The index of the object
+     * @return The data string
+     */
+    std::string getDataString(long long index);
+
+    /**
+     * Get a view of the data string of an object
+     * @param index The index of the object
+     * @param length Output, the length of the data string
+     * @return Pointer to the data string inside the mapping
+     */
+    const char *getPayload(long long index, long long& length);
+}
+
+#endif
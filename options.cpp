@@ -0,0 +1,294 @@
+/*
+ * Copyright (c) 2015 Srijan R Shetty
+ * Author: Srijan R Shetty <srijan.shetty+code@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+// The configuration file
+#include "config.h"
+
+// The header file
+#include "options.h"
+
+// The limits of the index
+#include "vafile.h"
+
+// Stream Processing
+#include <iostream>
+
+// STL
+#include <string>
+#include <cstdlib>
+
+Options getDefaultOptions() {
+    Options options;
+    options.dataFile = DATAFILE;
+    options.queryFile = QUERYFILE;
+    options.vaFile = VAFILE;
+    options.objectFile = OBJECTFILE;
+    options.dimensions = DIMENSIONS;
+    options.bits = BITS;
+    options.bitBudget = BIT_BUDGET;
+    options.quantizer = QUANTIZER;
+    options.allocation = ALLOCATION;
+    options.layout = LAYOUT;
+    options.layoutBlock = LAYOUT_BLOCK;
+    options.objectOrder = OBJECT_ORDER;
+    options.precision = PRECISION;
+    options.refine = REFINE;
+    options.memory = MEMORYSIZE;
+    options.knnCandidates = KNN_CANDIDATES;
+    options.knnTime = KNN_TIME;
+    options.compact = false;
+    options.threads = THREADS;
+    options.serve = false;
+    options.workers = WORKERS;
+#ifdef BATCH
+    options.batch = BATCH;
+#else
+    options.batch = 0;
+#endif
+#ifdef VA
+    options.va = true;
+#else
+    options.va = false;
+#endif
+#ifdef OUTPUT
+    options.output = true;
+#else
+    options.output = false;
+#endif
+#ifdef TIME
+    options.time = true;
+#else
+    options.time = false;
+#endif
+#ifdef DIMENSION_ORDER
+    options.dimensionOrder = true;
+#else
+    options.dimensionOrder = false;
+#endif
+#ifdef POINT_INDEX
+    options.pointIndex = true;
+#else
+    options.pointIndex = false;
+#endif
+#ifdef KNN_APPROXIMATE
+    options.knnApproximate = true;
+#else
+    options.knnApproximate = false;
+#endif
+#ifdef DIRECT_READS
+    options.directReads = true;
+#else
+    options.directReads = false;
+#endif
+    options.stats = false;
+    return options;
+}
+
+bool parseOptions(int argc, char **argv, Options& options) {
+    bool budgetSet = false;
+    bool layoutSet = false;
+    for (int i = 1; i < argc; ++i) {
+        std::string argument = argv[i];
+
+        // Flags
+        if (argument == "--va") {
+            options.va = true;
+        } else if (argument == "--linear") {
+            options.va = false;
+        } else if (argument == "--output") {
+            options.output = true;
+        } else if (argument == "--no-output") {
+            options.output = false;
+        } else if (argument == "--time") {
+            options.time = true;
+        } else if (argument == "--no-time") {
+            options.time = false;
+        } else if (argument == "--stats") {
+            options.stats = true;
+        } else if (argument == "--dimension-order") {
+            options.dimensionOrder = true;
+        } else if (argument == "--no-dimension-order") {
+            options.dimensionOrder = false;
+        } else if (argument == "--point-index") {
+            options.pointIndex = true;
+        } else if (argument == "--no-point-index") {
+            options.pointIndex = false;
+        } else if (argument == "--knn-approximate") {
+            options.knnApproximate = true;
+        } else if (argument == "--no-knn-approximate") {
+            options.knnApproximate = false;
+        } else if (argument == "--direct") {
+            options.directReads = true;
+        } else if (argument == "--no-direct") {
+            options.directReads = false;
+        } else if (argument == "--compact") {
+            options.compact = true;
+        } else if (argument == "--serve") {
+            options.serve = true;
+        } else if (i + 1 >= argc) {
+            return false;
+        } else {
+            // Options with a value
+            std::string value = argv[++i];
+            if (argument == "--data") {
+                options.dataFile = value;
+            } else if (argument == "--queries") {
+                options.queryFile = value;
+            } else if (argument == "--vafile") {
+                options.vaFile = value;
+            } else if (argument == "--objects") {
+                options.objectFile = value;
+            } else if (argument == "--insert") {
+                options.insertFile = value;
+            } else if (argument == "--delete") {
+                options.deleteFile = value;
+            } else if (argument == "--export") {
+                options.exportFile = value;
+            } else if (argument == "--dimensions") {
+                options.dimensions = atoi(value.c_str());
+                layoutSet = true;
+            } else if (argument == "--bits") {
+                options.bits = atoi(value.c_str());
+                layoutSet = true;
+            } else if (argument == "--budget") {
+                options.bitBudget = atoi(value.c_str());
+                budgetSet = true;
+            } else if (argument == "--quantizer") {
+                if (value == "uniform") {
+                    options.quantizer = QUANTIZER_UNIFORM;
+                } else if (value == "quantile") {
+                    options.quantizer = QUANTIZER_QUANTILE;
+                } else if (value == "lloyd") {
+                    options.quantizer = QUANTIZER_LLOYD;
+                } else {
+                    return false;
+                }
+            } else if (argument == "--layout") {
+                if (value == "rows") {
+                    options.layout = LAYOUT_ROWS;
+                } else if (value == "blocked") {
+                    options.layout = LAYOUT_BLOCKED;
+                } else {
+                    return false;
+                }
+            } else if (argument == "--object-order") {
+                if (value == "none") {
+                    options.objectOrder = OBJECT_ORDER_NONE;
+                } else if (value == "zorder") {
+                    options.objectOrder = OBJECT_ORDER_ZORDER;
+                } else {
+                    return false;
+                }
+            } else if (argument == "--precision") {
+                if (value == "double") {
+                    options.precision = PRECISION_DOUBLE;
+                } else if (value == "float") {
+                    options.precision = PRECISION_FLOAT;
+                } else {
+                    return false;
+                }
+            } else if (argument == "--refine") {
+                if (value == "mmap") {
+                    options.refine = REFINE_MMAP;
+                } else if (value == "async") {
+                    options.refine = REFINE_ASYNC;
+                } else {
+                    return false;
+                }
+            } else if (argument == "--memory") {
+                options.memory = atoll(value.c_str());
+            } else if (argument == "--knn-candidates") {
+                options.knnCandidates = atoll(value.c_str());
+            } else if (argument == "--knn-time") {
+                options.knnTime = atoll(value.c_str());
+            } else if (argument == "--layout-block") {
+                options.layoutBlock = atoi(value.c_str());
+            } else if (argument == "--allocation") {
+                if (value == "uniform") {
+                    options.allocation = ALLOCATION_UNIFORM;
+                } else if (value == "variance") {
+                    options.allocation = ALLOCATION_VARIANCE;
+                } else {
+                    return false;
+                }
+            } else if (argument == "--threads") {
+                options.threads = atoi(value.c_str());
+            } else if (argument == "--batch") {
+                options.batch = atoi(value.c_str());
+            } else if (argument == "--socket") {
+                options.socketPath = value;
+                options.serve = true;
+            } else if (argument == "--workers") {
+                options.workers = atoi(value.c_str());
+            } else {
+                return false;
+            }
+        }
+    }
+
+    // The budget follows the bits and dimensions unless it was given
+    if (layoutSet && !budgetSet) {
+        options.bitBudget = options.bits * options.dimensions;
+    }
+
+    return options.dimensions > 0 && options.bits >= 1 && options.bits <= VAFile::MAX_BITS && options.bitBudget >= 1 && options.layoutBlock > 0 && options.threads > 0 && options.batch >= 0 && options.workers > 0 && options.memory >= 0
+        && options.knnCandidates >= 0 && options.knnTime >= 0;
+}
+
+void printUsage(const char *program) {
+    std::cerr << "Usage: " << program << " [options]" << std::endl
+        << "  --va | --linear             structure to query" << std::endl
+        << "  --output | --no-output      print the results" << std::endl
+        << "  --time | --no-time          print the time of every query" << std::endl
+        << "  --stats                     print the work of every VAFile query" << std::endl
+        << "  --data FILE                 data file" << std::endl
+        << "  --queries FILE              query file" << std::endl
+        << "  --vafile FILE               VAFile" << std::endl
+        << "  --objects FILE              object store" << std::endl
+        << "  --insert FILE               insert the objects of FILE into the VAFile" << std::endl
+        << "  --delete FILE               delete the objects of FILE from the VAFile" << std::endl
+        << "  --compact                   drop deleted objects from the VAFile" << std::endl
+        << "  --export FILE               write the approximations to FILE as text" << std::endl
+        << "  --dimensions N              dimensions of the data" << std::endl
+        << "  --bits N                    bits per dimension" << std::endl
+        << "  --budget N                  bits per approximation, variance allocation" << std::endl
+        << "  --quantizer uniform|quantile|lloyd" << std::endl
+        << "  --allocation uniform|variance" << std::endl
+        << "  --layout rows|blocked       approximation layout" << std::endl
+        << "  --layout-block N            objects per block of the blocked layout" << std::endl
+        << "  --object-order none|zorder  order of the objects in a new VAFile, results keep the ids of the data file" << std::endl
+        << "  --precision double|float    precision of the coordinates the scans read" << std::endl
+        << "  --refine mmap|async         how the VAFile reads the objects it refines" << std::endl
+        << "  --memory BYTES              VAFiles larger than this are streamed by the scans" << std::endl
+        << "  --[no-]direct               stream past the page cache with O_DIRECT" << std::endl
+        << "  --threads N                 threads per query" << std::endl
+        << "  --batch N                   queries per VAFile scan, 0 for none" << std::endl
+        << "  --[no-]dimension-order      visit the dimensions of exact distances by deviation" << std::endl
+        << "  --[no-]point-index          look point queries up by the hash of the coordinates" << std::endl
+        << "  --knn-candidates C          kNN queries refine at most C candidates in all threads, 0 for all" << std::endl
+        << "  --knn-time MICROSECONDS     kNN queries stop refining after this long, 0 for no limit" << std::endl
+        << "  --[no-]knn-approximate      rank kNN queries by the approximations without refining" << std::endl
+        << "  --serve                     answer requests on stdin instead of the query file" << std::endl
+        << "  --socket PATH               answer requests on a Unix socket" << std::endl
+        << "  --workers N                 threads answering requests" << std::endl;
+}
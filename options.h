@@ -0,0 +1,112 @@
+/*
+ * Copyright (c) 2015 Srijan R Shetty
+ * Author: Srijan R Shetty <srijan.shetty+code@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+#ifndef OPTIONS_H
+#define OPTIONS_H
+
+// STL
+#include <string>
+
+/**
+ * Runtime parameters of the index and the driver. The defaults come from
+ * config.h, so a build still behaves as configured, but every parameter can
+ * be overridden on the command line without recompiling.
+ */
+struct Options {
+    // Files
+    std::string dataFile;
+    std::string queryFile;
+    std::string vaFile;
+    std::string objectFile;
+
+    // Index parameters, a VAFile records them in its header
+    int dimensions;
+    int bits;
+    int bitBudget;
+    int quantizer;
+    int allocation;
+    int layout;
+    int layoutBlock;
+    int objectOrder;
+    int precision;
+    int refine;
+
+    // Memory the VAFile may keep resident, and whether streamed scans bypass
+    // the page cache
+    long long memory;
+    bool directReads;
+
+    // Updates applied to the VAFile before the queries
+    std::string insertFile;
+    std::string deleteFile;
+    bool compact;
+
+    // Text dump of the approximations, written after the updates
+    std::string exportFile;
+
+    // Execution
+    int threads;
+    int batch;
+    bool dimensionOrder;
+    bool pointIndex;
+
+    // Approximate kNN queries of the VAFile: candidates refined and
+    // microseconds of refinement, 0 for no limit, or no refinement at all
+    long long knnCandidates;
+    long long knnTime;
+    bool knnApproximate;
+
+    // Server mode, on stdin unless socketPath is set
+    bool serve;
+    std::string socketPath;
+    int workers;
+
+    // Mode of operation
+    bool va;
+    bool output;
+    bool time;
+    bool stats;
+};
+
+/**
+ * Get the options configured in config.h
+ * @return The default options
+ */
+Options getDefaultOptions();
+
+/**
+ * Override options from command line arguments, see printUsage
+ * @param argc Argument count
+ * @param argv Arguments
+ * @param options The options to update
+ * @return false if an argument is not understood
+ */
+bool parseOptions(int argc, char **argv, Options& options);
+
+/**
+ * Print the command line arguments understood by parseOptions
+ * @param program Name of the program
+ */
+void printUsage(const char *program);
+
+#endif
@@ -0,0 +1,121 @@
+/*
+ * Copyright (c) 2015 Srijan R Shetty
+ * Author: Srijan R Shetty <srijan.shetty+code@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+// The header file
+#include "pointindex.h"
+
+// Memory mapping
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+// Stream Processing
+#include <fstream>
+
+// STL
+#include <cstring>
+
+namespace PointIndex {
+    // Magic bytes identifying a point index
+    const char MAGIC[8] = { 'V', 'A', 'P', 'O', 'I', 'N', 'T', 0 };
+
+    uint64_t hashPoint(const double *point, int dimensions) {
+        uint64_t hash = 0x9E3779B97F4A7C15ULL * (dimensions + 1);
+        for (int i = 0; i < dimensions; ++i) {
+            // -0.0 equals 0.0 and has to hash the same
+            double coordinate = point[i] == 0 ? 0.0 : point[i];
+            uint64_t bits;
+            std::memcpy(&bits, &coordinate, sizeof(bits));
+            hash = (hash ^ bits) * 0xFF51AFD7ED558CCDULL;
+            hash ^= hash >> 32;
+        }
+        return hash;
+    }
+
+    void build(const double *points, long long count, int dimensions, std::vector<Slot>& slots) {
+        uint64_t capacity = 2;
+        while (capacity < 2 * (uint64_t) count) {
+            capacity *= 2;
+        }
+        Slot empty = { 0, 0 };
+        slots.assign(capacity, empty);
+        for (long long index = 0; index < count; ++index) {
+            uint64_t hash = hashPoint(points + index * dimensions, dimensions);
+            uint64_t slot = hash & (capacity - 1);
+            while (slots[slot].object != 0) {
+                slot = (slot + 1) & (capacity - 1);
+            }
+            slots[slot].hash = hash;
+            slots[slot].object = index + 1;
+        }
+    }
+
+    bool write(const std::string& filename, Header header, const std::vector<Slot>& slots) {
+        std::memcpy(header.magic, MAGIC, sizeof(MAGIC));
+        header.version = VERSION;
+        header.capacity = slots.size();
+        std::ofstream ofile(filename, std::ios::binary | std::ios::trunc);
+        ofile.write((const char *) &header, sizeof(header));
+        ofile.write((const char *) slots.data(), slots.size() * sizeof(Slot));
+        ofile.close();
+        return !ofile.fail();
+    }
+
+    const Header *map(const std::string& filename, long long& size) {
+        int fd = open(filename.c_str(), O_RDONLY);
+        if (fd < 0) {
+            return NULL;
+        }
+        struct stat st;
+        if (fstat(fd, &st) != 0 || st.st_size < (long long) sizeof(Header)) {
+            close(fd);
+            return NULL;
+        }
+        void *address = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (address == MAP_FAILED) {
+            return NULL;
+        }
+
+        // The capacity has to be a power of two and the slots all there
+        const Header *header = (const Header *) address;
+        if (std::memcmp(header->magic, MAGIC, sizeof(MAGIC)) != 0
+                || header->version != VERSION
+                || header->capacity == 0
+                || (header->capacity & (header->capacity - 1)) != 0
+                || (long long) (sizeof(Header) + header->capacity * sizeof(Slot)) > st.st_size) {
+            munmap(address, st.st_size);
+            return NULL;
+        }
+
+        // Lookups land anywhere in the table
+        madvise(address, st.st_size, MADV_RANDOM);
+        size = st.st_size;
+        return header;
+    }
+
+    void unmap(const Header *header, long long size) {
+        munmap((void *) header, size);
+    }
+}
@@ -0,0 +1,122 @@
+/*
+ * Copyright (c) 2015 Srijan R Shetty
+ * Author: Srijan R Shetty <srijan.shetty+code@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+#ifndef POINTINDEX_H
+#define POINTINDEX_H
+
+// STL
+#include <vector>
+#include <string>
+#include <cstdint>
+
+namespace PointIndex {
+    // Point index format version, bump on any layout change
+    const uint32_t VERSION = 1;
+
+    /**
+     * A slot of an open addressing table of the objects by the hash of their
+     * coordinates. object is the index of the object plus one, 0 marks an
+     * empty slot; collisions probe the following slots.
+     */
+    struct Slot {
+        uint64_t hash;
+        uint64_t object;
+    };
+
+    /**
+     * On-disk header of a point index, followed by capacity slots.
+     * objectCount, dataSize and dataModified tell the index it belongs to.
+     */
+    struct Header {
+        char magic[8];
+        uint32_t version;
+        uint32_t dimensions;
+        uint64_t objectCount;
+        uint64_t capacity;
+        uint64_t dataSize;
+        uint64_t dataModified;
+    };
+
+    /**
+     * Hash the coordinates of a point, points that compare equal hash the same
+     * @param point The coordinates
+     * @param dimensions Number of coordinates
+     * @return The hash
+     */
+    uint64_t hashPoint(const double *point, int dimensions);
+
+    /**
+     * Build the table of a set of objects, at most half full
+     * @param points count points of dimensions doubles, back to back
+     * @param count Number of objects
+     * @param dimensions Number of coordinates of a point
+     * @param slots Output, a power of two slots
+     */
+    void build(const double *points, long long count, int dimensions, std::vector<Slot>& slots);
+
+    /**
+     * Visit the objects whose hash is that of a point; their coordinates
+     * still have to be compared
+     * @param slots The table
+     * @param capacity Number of slots, a power of two
+     * @param point The coordinates
+     * @param dimensions Number of coordinates
+     * @param visit Called with the index of every object, in no order
+     */
+    template <typename Visit>
+    void find(const Slot *slots, uint64_t capacity, const double *point, int dimensions, Visit visit) {
+        uint64_t hash = hashPoint(point, dimensions);
+        for (uint64_t slot = hash & (capacity - 1); slots[slot].object != 0; slot = (slot + 1) & (capacity - 1)) {
+            if (slots[slot].hash == hash) {
+                visit((long long) slots[slot].object - 1);
+            }
+        }
+    }
+
+    /**
+     * Write a point index
+     * @param filename The file to write
+     * @param header The index it belongs to, the rest is filled in
+     * @param slots The table from build
+     * @return false if the file could not be written
+     */
+    bool write(const std::string& filename, Header header, const std::vector<Slot>& slots);
+
+    /**
+     * Memory map a point index
+     * @param filename The file
+     * @param size Output, the mapped size
+     * @return The header, its slots follow it; NULL if the file is missing
+     * or not a point index
+     */
+    const Header *map(const std::string& filename, long long& size);
+
+    /**
+     * Unmap a point index
+     * @param header The header from map
+     * @param size The mapped size
+     */
+    void unmap(const Header *header, long long size);
+}
+
+#endif
@@ -0,0 +1,230 @@
+/*
+ * Copyright (c) 2015 Srijan R Shetty
+ * Author: Srijan R Shetty <srijan.shetty+code@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+// The configuration file
+#include "config.h"
+
+// The header file
+#include "reader.h"
+
+// io_uring through raw system calls
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+// To read the environment
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+namespace Reader {
+    ReadQueue::ReadQueue()
+        : ringFd(-1), sqRing(NULL), cqRing(NULL), sqes(NULL), sqRingSize(0), cqRingSize(0), sqesSize(0),
+          sqHead(NULL), sqTail(NULL), sqMask(NULL), sqArray(NULL), cqHead(NULL), cqTail(NULL), cqMask(NULL),
+          cqes(NULL), unsubmitted(0), requests(READ_DEPTH), order(READ_DEPTH), orderHead(0), pending(0), failures(0) {
+        for (int slot = READ_DEPTH - 1; slot >= 0; --slot) {
+            freeSlots.push_back(slot);
+        }
+
+        const char *uring = getenv("VAFILE_URING");
+        if (uring != NULL && std::string(uring) == "off") {
+            return;
+        }
+
+        io_uring_params params;
+        std::memset(&params, 0, sizeof(params));
+        int fd = syscall(__NR_io_uring_setup, READ_DEPTH, &params);
+        if (fd < 0) {
+            return;
+        }
+
+        // The submission and completion rings and the submission entries
+        // are shared with the kernel through three mappings
+        sqRingSize = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+        cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+        void *sq = mmap(NULL, sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+        void *cq = mmap(NULL, cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+        void *entries = mmap(NULL, sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+        if (sq == MAP_FAILED || cq == MAP_FAILED || entries == MAP_FAILED) {
+            if (sq != MAP_FAILED) {
+                munmap(sq, sqRingSize);
+            }
+            if (cq != MAP_FAILED) {
+                munmap(cq, cqRingSize);
+            }
+            if (entries != MAP_FAILED) {
+                munmap(entries, sqesSize);
+            }
+            close(fd);
+            return;
+        }
+
+        ringFd = fd;
+        sqRing = (unsigned char *) sq;
+        cqRing = (unsigned char *) cq;
+        sqes = (unsigned char *) entries;
+        sqHead = (uint32_t *) (sqRing + params.sq_off.head);
+        sqTail = (uint32_t *) (sqRing + params.sq_off.tail);
+        sqMask = (uint32_t *) (sqRing + params.sq_off.ring_mask);
+        sqArray = (uint32_t *) (sqRing + params.sq_off.array);
+        cqHead = (uint32_t *) (cqRing + params.cq_off.head);
+        cqTail = (uint32_t *) (cqRing + params.cq_off.tail);
+        cqMask = (uint32_t *) (cqRing + params.cq_off.ring_mask);
+        cqes = cqRing + params.cq_off.cqes;
+    }
+
+    ReadQueue::~ReadQueue() {
+        // Reads still in flight write into buffers that may be gone
+        bool failed;
+        while (pending > 0) {
+            wait(failed);
+        }
+        if (ringFd >= 0) {
+            munmap(sqRing, sqRingSize);
+            munmap(cqRing, cqRingSize);
+            munmap(sqes, sqesSize);
+            close(ringFd);
+        }
+    }
+
+    void ReadQueue::enter(unsigned int wantCompletions) {
+        unsigned int flags = wantCompletions > 0 ? IORING_ENTER_GETEVENTS : 0;
+        int submitted = syscall(__NR_io_uring_enter, ringFd, unsubmitted, wantCompletions, flags, NULL, 0);
+        if (submitted > 0) {
+            unsubmitted -= submitted;
+        }
+    }
+
+    bool ReadQueue::finishRead(Request& request, uint32_t done) {
+        // Reads past the end of the file come back short, which is fine once
+        // the required bytes are in
+        while (done < request.required) {
+            ssize_t bytes = pread(request.fd, request.buffer + done, request.length - done, request.offset + done);
+            if (bytes <= 0) {
+                ++failures;
+                return false;
+            }
+            done += bytes;
+        }
+        std::memset(request.buffer + done, 0, request.length - done);
+        return true;
+    }
+
+    bool ReadQueue::reap(uint64_t& tag, bool& failed) {
+        uint32_t head = *cqHead;
+        if (head == __atomic_load_n(cqTail, __ATOMIC_ACQUIRE)) {
+            return false;
+        }
+        const io_uring_cqe *cqe = (const io_uring_cqe *) cqes + (head & *cqMask);
+        Request& request = requests[cqe->user_data];
+        int result = cqe->res;
+        __atomic_store_n(cqHead, head + 1, __ATOMIC_RELEASE);
+
+        // Finish short or failed reads synchronously
+        failed = !finishRead(request, result > 0 ? result : 0);
+        tag = request.tag;
+        freeSlots.push_back(cqe->user_data);
+        return true;
+    }
+
+    void ReadQueue::submit(int fd, uint64_t offset, uint32_t length, unsigned char *buffer, uint64_t tag, uint32_t required) {
+        int slot = freeSlots.back();
+        freeSlots.pop_back();
+        Request request = { fd, offset, length, required == 0 ? length : required, buffer, tag };
+        requests[slot] = request;
+        ++pending;
+
+        if (ringFd < 0) {
+            // The kernel starts reading the pages ahead, pread picks them up
+            posix_fadvise(fd, offset, length, POSIX_FADV_WILLNEED);
+            order[(orderHead + READ_DEPTH - 1 - (int) freeSlots.size()) % READ_DEPTH] = slot;
+            return;
+        }
+
+        uint32_t tail = *sqTail;
+        uint32_t index = tail & *sqMask;
+        io_uring_sqe *sqe = (io_uring_sqe *) sqes + index;
+        std::memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = IORING_OP_READ;
+        sqe->fd = fd;
+        sqe->off = offset;
+        sqe->addr = (uint64_t) buffer;
+        sqe->len = length;
+        sqe->user_data = slot;
+        sqArray[index] = index;
+        __atomic_store_n(sqTail, tail + 1, __ATOMIC_RELEASE);
+        ++unsubmitted;
+
+        // Batch the submissions, but keep the ring moving
+        if (unsubmitted >= READ_DEPTH / 4) {
+            enter(0);
+        }
+    }
+
+    uint64_t ReadQueue::wait(bool& failed) {
+        uint64_t tag = complete(failed);
+        --pending;
+        return tag;
+    }
+
+    uint64_t ReadQueue::complete(bool& failed) {
+        if (ringFd < 0) {
+            // Reads complete in submission order
+            int slot = order[orderHead];
+            orderHead = (orderHead + 1) % READ_DEPTH;
+            failed = !finishRead(requests[slot], 0);
+            freeSlots.push_back(slot);
+            return requests[slot].tag;
+        }
+
+        uint64_t tag;
+        while (!reap(tag, failed)) {
+            enter(1);
+        }
+        return tag;
+    }
+
+    long long ReadQueue::getFailures() const {
+        return failures;
+    }
+
+    int ReadQueue::getPending() const {
+        return pending;
+    }
+
+    bool ReadQueue::isFull() const {
+        return freeSlots.empty();
+    }
+
+    bool ReadQueue::isAsync() const {
+        return ringFd >= 0;
+    }
+
+    ReadQueue& getThreadQueue() {
+        static thread_local ReadQueue queue;
+        return queue;
+    }
+}
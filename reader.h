@@ -0,0 +1,154 @@
+/*
+ * Copyright (c) 2015 Srijan R Shetty
+ * Author: Srijan R Shetty <srijan.shetty+code@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+#ifndef READER_H
+#define READER_H
+
+// STL
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+namespace Reader {
+    /**
+     * A queue of file reads that complete in the background, one per thread.
+     * Reads go to io_uring when the kernel allows it; otherwise every read
+     * is announced to the kernel with a readahead hint and done with pread
+     * when its completion is asked for. Set VAFILE_URING=off to force the
+     * fallback. At most READ_DEPTH reads are in flight; a full queue takes
+     * no more until wait has returned one, so it never grows. Short reads
+     * are finished with pread, and a read that still comes up short is
+     * reported as failed rather than filled in.
+     */
+    class ReadQueue {
+    public:
+        ReadQueue();
+        ~ReadQueue();
+
+        /**
+         * Queue a read, the queue must not be full
+         * @param fd The file to read
+         * @param offset Offset of the read in the file
+         * @param length Bytes to read
+         * @param buffer Where the bytes go, untouched until the read completes
+         * @param tag Returned by wait when the read is complete
+         * @param required Bytes at the start of the read that must be in the
+         * file, the rest may run past its end and reads as zeros; 0 for all
+         */
+        void submit(int fd, uint64_t offset, uint32_t length, unsigned char *buffer, uint64_t tag, uint32_t required = 0);
+
+        /**
+         * Wait for a queued read to complete, there must be one pending
+         * @param failed Output, true if the read could not be done, its
+         * buffer then holds no valid data
+         * @return The tag of a completed read, reads complete in any order
+         */
+        uint64_t wait(bool& failed);
+
+        /**
+         * Get the number of reads that failed since the queue was made
+         * @return The count
+         */
+        long long getFailures() const;
+
+        /**
+         * Get the number of reads submitted but not returned by wait
+         * @return The count
+         */
+        int getPending() const;
+
+        /**
+         * Check if READ_DEPTH reads are pending, wait must return one before
+         * the next submit
+         * @return true if the queue is full
+         */
+        bool isFull() const;
+
+        /**
+         * Check if the reads go to io_uring
+         * @return false for the readahead fallback
+         */
+        bool isAsync() const;
+
+    private:
+        struct Request {
+            int fd;
+            uint64_t offset;
+            uint32_t length;
+            uint32_t required;
+            unsigned char *buffer;
+            uint64_t tag;
+        };
+
+        // Submit the queued entries and optionally wait for a completion
+        void enter(unsigned int wantCompletions);
+
+        // Read what a request still needs with pread, false if it cannot
+        bool finishRead(Request& request, uint32_t done);
+
+        // Take a completion off the ring, false if there is none
+        bool reap(uint64_t& tag, bool& failed);
+
+        // Complete a read in flight and free its slot
+        uint64_t complete(bool& failed);
+
+        // The ring, ringFd is -1 without io_uring
+        int ringFd;
+        unsigned char *sqRing;
+        unsigned char *cqRing;
+        unsigned char *sqes;
+        size_t sqRingSize;
+        size_t cqRingSize;
+        size_t sqesSize;
+        uint32_t *sqHead;
+        uint32_t *sqTail;
+        uint32_t *sqMask;
+        uint32_t *sqArray;
+        uint32_t *cqHead;
+        uint32_t *cqTail;
+        uint32_t *cqMask;
+        unsigned char *cqes;
+        unsigned int unsubmitted;
+
+        // Every request in flight by its slot, which io_uring reports back,
+        // and the free slots
+        std::vector<Request> requests;
+        std::vector<int> freeSlots;
+
+        // Fallback: slots of the requests in flight in submission order, a
+        // circular buffer
+        std::vector<int> order;
+        int orderHead;
+
+        int pending;
+        long long failures;
+    };
+
+    /**
+     * Get the read queue of the calling thread
+     * @return The queue
+     */
+    ReadQueue& getThreadQueue();
+}
+
+#endif
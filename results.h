@@ -0,0 +1,81 @@
+/*
+ * Copyright (c) 2015 Srijan R Shetty
+ * Author: Srijan R Shetty <srijan.shetty+code@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+#ifndef RESULTS_H
+#define RESULTS_H
+
+// STL
+#include <vector>
+#include <string>
+
+namespace Results {
+    /**
+     * A query result. The index is the id of the object, its line in the
+     * data file unless it was inserted later. The payload points into the
+     * structure that was queried and stays valid until it is rebuilt,
+     * updated or closed.
+     */
+    struct Result {
+        long long index;
+        double distance;
+        const char *payload;
+        long long payloadLength;
+
+        std::string getDataString() const {
+            return std::string(payload, payloadLength);
+        }
+    };
+
+    /**
+     * Receives the results of a query, point and range results in index
+     * order and kNN results nearest first
+     */
+    class Visitor {
+    public:
+        virtual ~Visitor() {}
+        virtual void visit(const Result& result) = 0;
+    };
+
+    /**
+     * Collects the results of a query. Clear it to reuse it, queries then
+     * allocate only to grow past the largest result seen.
+     */
+    class Buffer : public Visitor {
+    public:
+        std::vector<Result> results;
+
+        void clear() {
+            results.clear();
+        }
+
+        long long size() const {
+            return results.size();
+        }
+
+        void visit(const Result& result) {
+            results.push_back(result);
+        }
+    };
+}
+
+#endif
@@ -0,0 +1,318 @@
+/*
+ * Copyright (c) 2015 Srijan R Shetty
+ * Author: Srijan R Shetty <srijan.shetty+code@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+// The header file
+#include "server.h"
+
+// The structures to query
+#include "vafile.h"
+#include "linear.h"
+#include "results.h"
+
+// Sockets
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <signal.h>
+
+// Threads
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+// Stream Processing
+#include <iostream>
+#include <sstream>
+
+// STL
+#include <string>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <algorithm>
+#include <cstring>
+#include <cstdlib>
+
+// Time
+#include <chrono>
+
+namespace Server {
+    /**
+     * A client of the server, its answers are written in the order of its
+     * requests. Socket connections are closed once the last request is done.
+     */
+    struct Connection {
+        int input;
+        int output;
+        bool owned;
+        std::mutex mutex;
+        std::condition_variable turn;
+        long long nextAnswer;
+
+        Connection(int input, int output, bool owned) : input(input), output(output), owned(owned), nextAnswer(0) {}
+
+        ~Connection() {
+            if (owned) {
+                ::close(input);
+            }
+        }
+    };
+
+    /**
+     * A request waiting for a worker
+     */
+    struct Request {
+        std::shared_ptr<Connection> connection;
+        long long sequence;
+        std::string line;
+        std::chrono::steady_clock::time_point received;
+    };
+
+    // What is being served
+    const Options *serverOptions = NULL;
+    int dimensionCount = 0;
+
+    // Requests waiting for a worker
+    std::mutex queueMutex;
+    std::condition_variable queueReady;
+    std::deque<Request> requests;
+    bool draining = false;
+
+    // Latency of every request answered, in microseconds
+    std::mutex latencyMutex;
+    std::vector<long long> latencies;
+
+    // Write all of data to a descriptor
+    bool writeAll(int fd, const std::string& data) {
+        size_t written = 0;
+        while (written < data.size()) {
+            ssize_t count = ::write(fd, data.data() + written, data.size() - written);
+            if (count <= 0) {
+                return false;
+            }
+            written += count;
+        }
+        return true;
+    }
+
+    // Summarize the latencies answered so far
+    std::string getStats() {
+        std::vector<long long> sorted;
+        {
+            std::lock_guard<std::mutex> lock(latencyMutex);
+            sorted = latencies;
+        }
+        std::sort(sorted.begin(), sorted.end());
+
+        long long count = sorted.size();
+        long long total = 0;
+        for (auto latency : sorted) {
+            total += latency;
+        }
+        auto percentile = [&](int percent) {
+            return count == 0 ? 0 : sorted[std::min(count - 1, count * percent / 100)];
+        };
+
+        std::ostringstream outputStream;
+        outputStream << "stats " << count << " " << (count == 0 ? 0 : total / count) << " " << percentile(50)
+            << " " << percentile(90) << " " << percentile(99) << " " << (count == 0 ? 0 : sorted.back()) << "\n";
+        return outputStream.str();
+    }
+
+    // Answer a request line
+    std::string answer(const Request& request) {
+        std::istringstream inputStream(request.line);
+        std::string command;
+        inputStream >> command;
+        if (command == "stats") {
+            return getStats();
+        }
+
+        // A query in the query file format
+        int type = std::atoi(command.c_str());
+        std::vector<double> point(dimensionCount);
+        for (int i = 0; i < dimensionCount; ++i) {
+            inputStream >> point[i];
+        }
+        double radius = 0;
+        long long k = 0;
+        if (type == VAFile::RANGE) {
+            inputStream >> radius;
+        } else if (type == VAFile::KNN) {
+            inputStream >> k;
+        }
+        if (!inputStream || (type != VAFile::POINT && type != VAFile::RANGE && type != VAFile::KNN)) {
+            return "error malformed request\n";
+        }
+
+        // Every worker reuses its result buffer
+        static thread_local Results::Buffer buffer;
+        buffer.clear();
+        bool va = serverOptions->va;
+        VAFile::QueryStats stats;
+        if (va && type == VAFile::POINT) {
+            stats = VAFile::pointQuery(point, buffer);
+        } else if (va && type == VAFile::RANGE) {
+            stats = VAFile::rangeQuery(point, radius, buffer);
+        } else if (va) {
+            stats = VAFile::kNNQuery(point, k, buffer);
+        } else if (type == VAFile::POINT) {
+            LinearArray::pointQuery(point, buffer);
+        } else if (type == VAFile::RANGE) {
+            LinearArray::rangeQuery(point, radius, buffer);
+        } else {
+            LinearArray::kNNQuery(point, k, buffer);
+        }
+        if (stats.failedReads > 0) {
+            return "error read failed\n";
+        }
+
+        std::string body;
+        for (auto& result : buffer.results) {
+            body.append(result.payload, result.payloadLength);
+            body += "\n";
+        }
+
+        auto elapsed = std::chrono::steady_clock::now() - request.received;
+        long long microseconds = std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count();
+        {
+            std::lock_guard<std::mutex> lock(latencyMutex);
+            latencies.push_back(microseconds);
+        }
+
+        std::ostringstream outputStream;
+        outputStream << "ok " << type << " " << buffer.size() << " " << microseconds << "\n";
+        return outputStream.str() + body;
+    }
+
+    // Answer requests until the queue is drained
+    void work() {
+        while (true) {
+            Request request;
+            {
+                std::unique_lock<std::mutex> lock(queueMutex);
+                queueReady.wait(lock, [] { return draining || !requests.empty(); });
+                if (requests.empty()) {
+                    return;
+                }
+                request = requests.front();
+                requests.pop_front();
+            }
+
+            std::string response = answer(request);
+
+            // The queue hands out the requests of a connection in order, so the
+            // earlier ones are already being answered
+            Connection& connection = *request.connection;
+            std::unique_lock<std::mutex> lock(connection.mutex);
+            connection.turn.wait(lock, [&] { return connection.nextAnswer == request.sequence; });
+            writeAll(connection.output, response);
+            ++connection.nextAnswer;
+            connection.turn.notify_all();
+        }
+    }
+
+    // Queue every line of a connection till its input ends
+    void readRequests(std::shared_ptr<Connection> connection) {
+        std::string buffer;
+        long long sequence = 0;
+        char chunk[65536];
+        for (ssize_t count; (count = ::read(connection->input, chunk, sizeof(chunk))) > 0; ) {
+            buffer.append(chunk, count);
+
+            size_t begin = 0;
+            for (size_t end; (end = buffer.find('\n', begin)) != std::string::npos; begin = end + 1) {
+                std::string line = buffer.substr(begin, end - begin);
+                if (line.find_first_not_of(" \t\r") == std::string::npos) {
+                    continue;
+                }
+
+                Request request = { connection, sequence++, line, std::chrono::steady_clock::now() };
+                std::lock_guard<std::mutex> lock(queueMutex);
+                requests.push_back(request);
+                queueReady.notify_one();
+            }
+            buffer.erase(0, begin);
+        }
+    }
+
+    bool run(const Options& options, int dimensions) {
+        serverOptions = &options;
+        dimensionCount = dimensions;
+
+        // A client going away must not take the server down
+        signal(SIGPIPE, SIG_IGN);
+        std::cout << std::flush;
+
+        std::vector<std::thread> workers;
+        for (int i = 0; i < options.workers; ++i) {
+            workers.push_back(std::thread(work));
+        }
+
+        bool listening = true;
+        if (options.socketPath.empty()) {
+            readRequests(std::make_shared<Connection>(0, 1, false));
+        } else {
+            int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+            struct sockaddr_un address;
+            std::memset(&address, 0, sizeof(address));
+            address.sun_family = AF_UNIX;
+            std::strncpy(address.sun_path, options.socketPath.c_str(), sizeof(address.sun_path) - 1);
+
+            // Only a socket left by an earlier server is replaced, any
+            // other file at the path makes the bind fail
+            bool fits = options.socketPath.size() < sizeof(address.sun_path);
+            struct stat st;
+            if (fits && lstat(options.socketPath.c_str(), &st) == 0 && S_ISSOCK(st.st_mode)) {
+                unlink(options.socketPath.c_str());
+            }
+
+            if (listener < 0 || !fits
+                    || bind(listener, (struct sockaddr *) &address, sizeof(address)) != 0
+                    || listen(listener, SOMAXCONN) != 0) {
+                std::cerr << "Could not listen on " << options.socketPath << std::endl;
+                listening = false;
+            } else {
+                // Every client gets a reader, the workers are shared
+                for (int client; (client = accept(listener, NULL, NULL)) >= 0; ) {
+                    std::thread(readRequests, std::make_shared<Connection>(client, client, true)).detach();
+                }
+            }
+            if (listener >= 0) {
+                ::close(listener);
+            }
+        }
+
+        // Answer what is queued, then stop the workers
+        {
+            std::lock_guard<std::mutex> lock(queueMutex);
+            draining = true;
+        }
+        queueReady.notify_all();
+        for (auto& worker : workers) {
+            worker.join();
+        }
+        return listening;
+    }
+}
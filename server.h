@@ -0,0 +1,60 @@
+/*
+ * Copyright (c) 2015 Srijan R Shetty
+ * Author: Srijan R Shetty <srijan.shetty+code@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+#ifndef SERVER_H
+#define SERVER_H
+
+// Runtime parameters
+#include "options.h"
+
+/**
+ * A long running query server over an index that is already loaded.
+ *
+ * Requests are lines in the query file format, one query per line:
+ *
+ *      1 x1 ... xd         point query
+ *      2 x1 ... xd radius  range query
+ *      3 x1 ... xd k       kNN query
+ *      stats               latency summary of the requests answered so far
+ *
+ * Every query is answered with a line "ok <type> <results> <microseconds>"
+ * followed by the data string of every result on a line of its own, kNN
+ * results nearest first. A request that cannot be parsed is answered with
+ * "error <reason>" and stats with "stats <requests> <mean> <p50> <p90>
+ * <p99> <max>" in microseconds. The latency of a request runs from when it is
+ * read until its answer is ready, so it includes the time spent queued.
+ */
+namespace Server {
+    /**
+     * Serve requests from stdin until it ends, or from clients of the Unix
+     * socket at options.socketPath if it is set until the process is
+     * stopped. Requests are answered by options.workers threads; the answers
+     * on a connection are written in the order of its requests.
+     * @param options The structure to query and the server parameters
+     * @param dimensions Number of coordinates of a query point
+     * @return false if the socket cannot be set up
+     */
+    bool run(const Options& options, int dimensions);
+}
+
+#endif
@@ -0,0 +1,147 @@
+/*
+ * Copyright (c) 2015 Srijan R Shetty
+ * Author: Srijan R Shetty <srijan.shetty+code@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+// The configuration file
+#include "config.h"
+
+// The header file
+#include "threadpool.h"
+
+// Threads
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+// STL
+#include <vector>
+
+namespace ThreadPool {
+    // Workers of the pool, the calling thread runs slice 0 itself
+    std::vector<std::thread> workers;
+    int threadCount = THREADS;
+
+    // The job being run
+    std::mutex jobMutex;
+    std::mutex stateMutex;
+    std::condition_variable wakeUp;
+    std::condition_variable finished;
+    const std::function<void(int, long long, long long)> *job = NULL;
+    long long jobCount = 0;
+    long long generation = 0;
+    int pending = 0;
+    bool stopping = false;
+
+    // Bounds of a slice
+    long long sliceBegin(long long count, int slice) {
+        return count * slice / threadCount;
+    }
+
+    void work(int slice) {
+        long long seen = 0;
+        while (true) {
+            const std::function<void(int, long long, long long)> *body;
+            long long count;
+            {
+                std::unique_lock<std::mutex> lock(stateMutex);
+                wakeUp.wait(lock, [&] { return stopping || generation != seen; });
+                if (stopping) {
+                    return;
+                }
+                seen = generation;
+                body = job;
+                count = jobCount;
+            }
+
+            (*body)(slice, sliceBegin(count, slice), sliceBegin(count, slice + 1));
+
+            std::lock_guard<std::mutex> lock(stateMutex);
+            if (--pending == 0) {
+                finished.notify_one();
+            }
+        }
+    }
+
+    void stop() {
+        {
+            std::lock_guard<std::mutex> lock(stateMutex);
+            stopping = true;
+        }
+        wakeUp.notify_all();
+        for (auto& worker : workers) {
+            worker.join();
+        }
+        workers.clear();
+        stopping = false;
+    }
+
+    // Stop the workers before the process exits
+    struct Guard {
+        ~Guard() {
+            stop();
+        }
+    } guard;
+
+    void setThreadCount(int threads) {
+        std::lock_guard<std::mutex> lock(jobMutex);
+        stop();
+        threadCount = threads < 1 ? 1 : threads;
+    }
+
+    int getThreadCount() {
+        return threadCount;
+    }
+
+    void parallelFor(long long count, const std::function<void(int, long long, long long)>& body) {
+        std::unique_lock<std::mutex> jobLock(jobMutex, std::try_to_lock);
+
+        // Single threaded, or someone else owns the pool
+        if (!jobLock.owns_lock() || threadCount == 1) {
+            int slices = jobLock.owns_lock() ? 1 : threadCount;
+            for (int slice = 0; slice < slices; ++slice) {
+                body(slice, count * slice / slices, count * (slice + 1) / slices);
+            }
+            return;
+        }
+
+        // Start the workers lazily
+        if (workers.empty()) {
+            for (int slice = 1; slice < threadCount; ++slice) {
+                workers.push_back(std::thread(work, slice));
+            }
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(stateMutex);
+            job = &body;
+            jobCount = count;
+            pending = threadCount - 1;
+            ++generation;
+        }
+        wakeUp.notify_all();
+
+        body(0, sliceBegin(count, 0), sliceBegin(count, 1));
+
+        std::unique_lock<std::mutex> lock(stateMutex);
+        finished.wait(lock, [] { return pending == 0; });
+    }
+}
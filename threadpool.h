@@ -0,0 +1,76 @@
+/*
+ * Copyright (c) 2015 Srijan R Shetty
+ * Author: Srijan R Shetty <srijan.shetty+code@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+// STL
+#include <functional>
+#include <atomic>
+
+namespace ThreadPool {
+    /**
+     * Set the number of threads the scans are partitioned across
+     * @param threads Number of threads, at least 1
+     */
+    void setThreadCount(int threads);
+
+    /**
+     * Get the number of threads the scans are partitioned across
+     * @return the thread count
+     */
+    int getThreadCount();
+
+    /**
+     * Split [0, count) into getThreadCount() contiguous slices in order and run
+     * body(slice, begin, end) for every slice on the pool, returning once all
+     * are done. If the pool is busy with another call the slices run one after
+     * the other on the calling thread instead.
+     * @param count Size of the range
+     * @param body The work for one slice
+     */
+    void parallelFor(long long count, const std::function<void(int, long long, long long)>& body);
+
+    /**
+     * parallelFor for any callable, which is wrapped by reference so that
+     * lambdas with many captures do not allocate
+     * @param count Size of the range
+     * @param body The work for one slice
+     */
+    template <typename Body>
+    void parallelFor(long long count, const Body& body) {
+        parallelFor(count, std::function<void(int, long long, long long)>(std::cref(body)));
+    }
+
+    /**
+     * Lower a shared value to value if it is smaller
+     * @param target The shared value
+     * @param value The candidate value
+     */
+    inline void atomicMin(std::atomic<double>& target, double value) {
+        double current = target.load();
+        while (value < current && !target.compare_exchange_weak(current, value));
+    }
+}
+
+#endif
@@ -26,9 +26,41 @@
 // The header file
 #include "vafile.h"
 
+// Runtime parameters
+#include "options.h"
+
+// The objects are kept in the object store
+#include "objectstore.h"
+
+// Bulk parsing of the data file
+#include "loader.h"
+
+// Vectorized distance and bound kernels
+#include "kernels.h"
+
+// Parallel scans
+#include "threadpool.h"
+
+// Query results
+#include "results.h"
+
+// Reusable query scratch
+#include "context.h"
+
+// Reads of the refinement
+#include "reader.h"
+
+// Hash lookups of point queries
+#include "pointindex.h"
+
 // To get the fileSize
 #include <sys/stat.h>
 
+// Memory mapping
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+
 // Stream Processing
 #include <fstream>
 #include <iostream>
@@ -40,15 +72,168 @@
 #include <vector>
 #include <queue>
 #include <iterator>
+#include <algorithm>
+#include <functional>
+#include <atomic>
+#include <mutex>
+#include <cstring>
+#include <cstdio>
 
 // Math
 #include <cmath>
 #include <limits>
 
+// Time
+#include <chrono>
+
+// Query statistics are compiled away unless STATS is defined
+#ifdef STATS
+#define COUNT_STATS(...) __VA_ARGS__
+#else
+#define COUNT_STATS(...)
+#endif
+
 namespace VAFile {
     // To keep a track of the number of objects
     long long objectCount = 0;
 
+    // Coordinates of every object, set by the allocation
+    int dimensionCount = 0;
+
+    // Bits of every dimension, and where its cells start in an
+    // approximation, in the lookup tables and in the boundaries
+    std::vector<int> bitsPerDimension;
+    std::vector<int> bitOffsets;
+    std::vector<int> tableOffsets;
+    int stride = 0;
+
+    // Unrolled bound kernel when every dimension has the same bits
+    Kernels::FixedBoundKernel fixedKernel = NULL;
+
+    // Cell boundaries of the quantizer, 2^bits + 1 per dimension
+    std::vector<double> boundaries;
+
+    // Mean of every dimension of the objects, orders the exact distances
+    std::vector<double> dimensionMeans;
+    bool dimensionOrder = false;
+
+    // Refinement reads the candidates through the read queue instead of the map
+    bool asyncReads = false;
+
+    // Approximate kNN queries: candidates refined and microseconds of
+    // refinement, 0 for no limit, or a ranking by the approximations alone
+    long long knnCandidates = 0;
+    long long knnTime = 0;
+    bool knnApproximate = false;
+
+    // Longest run of objects read at once
+    const uint64_t MAX_RUN = 1 << 16;
+
+    // Objects per chunk of a streaming scan, 0 while the approximations are
+    // resident, and the descriptor the chunks are read from
+    long long chunkRows = 0;
+    int scanDescriptor = -1;
+
+    // The VAFile is streamed when it is larger than memoryBudget, in chunks
+    // of at most chunkBytes, past the page cache with directReads
+    long long memoryBudget = MEMORYSIZE;
+    long long chunkBytes = STREAM_PAGES * PAGESIZE;
+    bool directReads = false;
+
+    // Chunks start and end on these boundaries, which direct reads need
+    const long long READ_ALIGNMENT = PAGESIZE > 4096 ? PAGESIZE : 4096;
+
+    // The memory mapped VAFile
+    const unsigned char *mappedFile = NULL;
+    long long mappedSize = 0;
+
+    // The dimension blocked cells of the mapped VAFile, NULL without them
+    const unsigned char *blockedCells = NULL;
+
+    // Smallest and largest cell of every dimension of every block of
+    // summaryBlock objects of the mapped VAFile
+    const uint16_t *summaries = NULL;
+    long long summaryBlock = 0;
+    long long blockSize = 0;
+    int cellBytes = 1;
+
+    // Approximations whose bounds are computed in one kernel call
+    const int SCAN_BLOCK = 1024;
+
+    // The bounds and the exact distances sum their terms in different orders,
+    // pruning compares against thresholds widened by this factor so that
+    // rounding never drops an object the exact test would accept
+    const double SLACK = 1 + 1e-9;
+
+    // Objects refined by the last query, queries may run concurrently
+    std::atomic<long long> candidateCount(0);
+
+    // Clock of the phase times of a query
+    typedef std::chrono::steady_clock StatsClock;
+
+    // The files of the mapped index, updates are written to them
+    std::string vaFileName;
+    std::string objectFileName;
+
+    // Table of the objects by the hash of their coordinates, mapped from a
+    // sidecar of the VAFile or kept in pointTable when it cannot be written;
+    // pointSlots is NULL without one
+    bool usePointIndex = false;
+    const PointIndex::Header *pointIndex = NULL;
+    long long pointIndexSize = 0;
+    std::vector<PointIndex::Slot> pointTable;
+    const PointIndex::Slot *pointSlots = NULL;
+    uint64_t pointCapacity = 0;
+
+    // Deleted objects, one bit per object, kept in a sidecar of the VAFile
+    std::vector<unsigned char> tombstones;
+    long long deletedCount = 0;
+
+    // Deletes compact the index once this share of the objects is deleted
+    const double COMPACT_FRACTION = 0.25;
+
+    // Magic bytes identifying a binary VAFile
+    const char MAGIC[8] = { 'V', 'A', 'F', 'I', 'L', 'E', 0, 0 };
+
+    // Seconds since a lap started, and start the next lap
+    inline double getLap(StatsClock::time_point& lap) {
+        StatsClock::time_point now = StatsClock::now();
+        double seconds = std::chrono::duration<double>(now - lap).count();
+        lap = now;
+        return seconds;
+    }
+
+    QueryStats::QueryStats()
+        : bytesScanned(0), approximations(0), candidates(0), refined(0), objectBytes(0),
+          filterSeconds(0), refineSeconds(0), failedReads(0) {}
+
+    QueryStats& QueryStats::operator+=(const QueryStats& other) {
+        bytesScanned += other.bytesScanned;
+        approximations += other.approximations;
+        candidates += other.candidates;
+        refined += other.refined;
+        objectBytes += other.objectBytes;
+        filterSeconds += other.filterSeconds;
+        refineSeconds += other.refineSeconds;
+        failedReads += other.failedReads;
+        return *this;
+    }
+
+    // The tombstones of a VAFile
+    std::string getTombstoneFile(const std::string& vaFile) {
+        return vaFile + ".tombstones";
+    }
+
+    // The point index of a VAFile
+    std::string getPointIndexFile(const std::string& vaFile) {
+        return vaFile + ".points";
+    }
+
+    // Check the tombstone of an object, free while nothing is deleted
+    inline bool isDeleted(long long index) {
+        return deletedCount != 0 && ((tombstones[index >> 3] >> (index & 7)) & 1);
+    }
+
     long long getFileSize(const std::string& filename) {
         struct stat st;
         if(stat(filename.c_str(), &st) != 0) {
@@ -57,106 +242,230 @@ namespace VAFile {
         return (long long) st.st_size;
     }
 
-    int quantize(double coordinate) {
-        int first = 1;
-        int last = ((int) pow(2, BITS)) - 1;
-        double base = pow(2, -1 * BITS);
+    std::vector<int> allocateBits(const double *points, long long count, int dimensions, int allocation, int uniformBits, int budget) {
+        std::vector<int> bits(dimensions, uniformBits);
+        if (allocation == ALLOCATION_UNIFORM) {
+            return bits;
+        }
 
-        // Coordinates towards the start
-        if (coordinate <= base) {
-            return 0;
+        // The variance of every dimension
+        std::vector<double> variances(dimensions, 0);
+        for (int i = 0; i < dimensions; ++i) {
+            double sum = 0, squares = 0;
+            for (long long index = 0; index < count; ++index) {
+                double coordinate = points[index * dimensions + i];
+                sum += coordinate;
+                squares += coordinate * coordinate;
+            }
+            variances[i] = count > 0 ? squares / count - (sum / count) * (sum / count) : 0;
         }
 
-        // Coordinates towards the end
-        if (coordinate >= base * last) {
-            return last;
+        // Greedily give each bit to the dimension with the most variance left,
+        // ties go to the lower dimension
+        bits.assign(dimensions, 0);
+        budget = std::min(budget, dimensions * MAX_BITS);
+        for (int bit = 0; bit < budget; ++bit) {
+            int best = -1;
+            for (int i = 0; i < dimensions; ++i) {
+                if (bits[i] < MAX_BITS && (best < 0 || variances[i] > variances[best])) {
+                    best = i;
+                }
+            }
+            ++bits[best];
+            variances[best] /= 4;
         }
 
-        // Computation of quantization using binary search
-        while (last >= first) {
-            int mid = (first + last) / 2;
+        return bits;
+    }
 
-            // We check if the point is in the vicinity
-            if (coordinate >= ((mid - 1) * base) && coordinate < (mid * base)) {
-                return mid - 1;
-            } else if  (coordinate >= (mid * base) && coordinate < ((mid + 1) * base)) {
-                return mid;
-            }
+    void setAllocation(const std::vector<int>& bits) {
+        dimensionCount = bits.size();
+        bitsPerDimension = bits;
+        bitOffsets.assign(dimensionCount + 1, 0);
+        tableOffsets.assign(dimensionCount + 1, 0);
+        for (int i = 0; i < dimensionCount; ++i) {
+            bitOffsets[i + 1] = bitOffsets[i] + bits[i];
+            tableOffsets[i + 1] = tableOffsets[i] + (1 << bits[i]);
+        }
+        stride = (bitOffsets[dimensionCount] + 7) / 8;
 
-            // Update the bounds according to the value of the coordinate
-            if (coordinate < mid * base) {
-                last = mid - 1;
-            } else {
-                first = mid + 1;
-            }
+        // The unrolled kernels need every cell to have the same width
+        fixedKernel = NULL;
+        if (dimensionCount > 0 && std::count(bits.begin(), bits.end(), bits[0]) == dimensionCount) {
+            fixedKernel = Kernels::getFixedBoundKernel(dimensionCount, bits[0]);
         }
+    }
+
+    int getDimensions() {
+        return dimensionCount;
+    }
 
-        return 0;
+    int getBits(int dimension) {
+        return bitsPerDimension[dimension];
     }
 
-    std::vector< std::bitset<BITS> > getGrid(std::vector<double> point) {
-        std::vector< std::bitset<BITS> > quantizedPoint;
+    int getTableOffset(int dimension) {
+        return tableOffsets[dimension];
+    }
 
-        for (int i = 0; i < DIMENSIONS; ++i) {
-            quantizedPoint.push_back(std::bitset<BITS>(quantize(point[i])));
-        }
+    void computeBoundaries(const double *points, long long count, int quantizer) {
+        boundaries.assign(tableOffsets[dimensionCount] + dimensionCount, 0);
 
-        return quantizedPoint;
+        std::vector<double> column(count);
+        for (int i = 0; i < dimensionCount; ++i) {
+            const int CELLS = 1 << bitsPerDimension[i];
+            double *boundary = boundaries.data() + tableOffsets[i] + i;
+
+            // The sorted values of this dimension
+            for (long long index = 0; index < count; ++index) {
+                column[index] = points[index * dimensionCount + i];
+            }
+            std::sort(column.begin(), column.end());
+
+            // The outer boundaries always cover [0, 1] as the uniform cells did
+            boundary[0] = count > 0 ? std::min(0.0, column.front()) : 0.0;
+            boundary[CELLS] = count > 0 ? std::max(1.0, column.back()) : 1.0;
+
+            if (quantizer == QUANTIZER_UNIFORM || count == 0) {
+                // Equal width cells
+                for (int cell = 1; cell < CELLS; ++cell) {
+                    boundary[cell] = boundary[0] + (boundary[CELLS] - boundary[0]) * cell / CELLS;
+                }
+                continue;
+            }
+
+            // Equi-depth cells, every cell gets the same share of the objects
+            for (int cell = 1; cell < CELLS; ++cell) {
+                boundary[cell] = column[cell * count / CELLS];
+            }
+
+            if (quantizer != QUANTIZER_LLOYD) {
+                continue;
+            }
+
+            // Lloyd-Max: move every inner boundary to the midpoint of the means of
+            // its two cells, the means come from prefix sums over the sorted values
+            std::vector<double> prefix(count + 1, 0);
+            for (long long index = 0; index < count; ++index) {
+                prefix[index + 1] = prefix[index] + column[index];
+            }
+            std::vector<double> means(CELLS);
+            for (int iteration = 0; iteration < LLOYD_ITERATIONS; ++iteration) {
+                for (int cell = 0; cell < CELLS; ++cell) {
+                    long long first = cell == 0 ? 0 : std::lower_bound(column.begin(), column.end(), boundary[cell]) - column.begin();
+                    long long last = cell == CELLS - 1 ? count : std::lower_bound(column.begin(), column.end(), boundary[cell + 1]) - column.begin();
+                    means[cell] = last > first ? (prefix[last] - prefix[first]) / (last - first)
+                        : (boundary[cell] + boundary[cell + 1]) / 2;
+                }
+                for (int cell = 1; cell < CELLS; ++cell) {
+                    boundary[cell] = (means[cell - 1] + means[cell]) / 2;
+                }
+            }
+        }
     }
 
-    double getMinDistance(std::vector<double> point, std::vector< std::bitset<BITS> > grid) {
-        double base = pow(2, -1 * BITS);
+    const double *getBoundaries(int dimension) {
+        return boundaries.data() + tableOffsets[dimension] + dimension;
+    }
 
-        double minDistance = 0;
-        for (int i = 0; i < DIMENSIONS; ++i) {
-            double component = std::abs((double)grid[i].to_ulong() * base - point[i]);
-            minDistance += component * component;
+    int quantize(int dimension, double coordinate) {
+        const double *boundary = getBoundaries(dimension);
+        int first = 0;
+        int last = (1 << bitsPerDimension[dimension]) - 1;
+
+        // Binary search for the last cell whose lower boundary is not above
+        // the coordinate, values outside the boundaries go to the outer cells
+        while (first < last) {
+            int mid = (first + last + 1) / 2;
+            if (boundary[mid] <= coordinate) {
+                first = mid;
+            } else {
+                last = mid - 1;
+            }
         }
 
-        return std::sqrt(minDistance);
+        return first;
     }
 
-    double getDistance(std::vector<double> point1, std::vector<double> point2) {
-        double minDistance = 0;
+    std::vector< std::bitset<MAX_BITS> > getGrid(const std::vector<double>& point) {
+        std::vector< std::bitset<MAX_BITS> > quantizedPoint;
 
-        for (int i = 0; i < DIMENSIONS; ++i) {
-            double component = (point1[i] - point2[i]);
-            minDistance += component * component;
+        for (int i = 0; i < dimensionCount; ++i) {
+            quantizedPoint.push_back(std::bitset<MAX_BITS>(quantize(i, point[i])));
         }
 
-        return std::sqrt(minDistance);
+        return quantizedPoint;
     }
 
-    bool equal(std::vector<double> object1, std::vector<double> object2) {
-        // Check if every dimension is the same
-        for (int i = 0; i < DIMENSIONS; ++i) {
-            if (object1[i] != object2[i]) {
-                return false;
+    void getBoundTables(const std::vector<double>& point, std::vector<double>& lowerTable, std::vector<double>& upperTable) {
+        lowerTable.resize(tableOffsets[dimensionCount]);
+        upperTable.resize(tableOffsets[dimensionCount]);
+        for (int i = 0; i < dimensionCount; ++i) {
+            const double *boundary = getBoundaries(i);
+            int CELLS = 1 << bitsPerDimension[i];
+            for (int cell = 0; cell < CELLS; ++cell) {
+                // Distances to the nearest and the farthest face of the cell,
+                // the nearest is zero inside it
+                double low = boundary[cell];
+                double high = boundary[cell + 1];
+                double component = 0;
+                if (point[i] < low) {
+                    component = low - point[i];
+                } else if (point[i] > high) {
+                    component = point[i] - high;
+                }
+                lowerTable[tableOffsets[i] + cell] = component * component;
+
+                component = std::max(std::abs(point[i] - low), std::abs(point[i] - high));
+                upperTable[tableOffsets[i] + cell] = component * component;
             }
         }
+    }
 
-        return true;
+    double getSquaredDistance(const double *point1, const double *point2) {
+        return Kernels::squaredDistance(point1, point2, dimensionCount);
     }
 
-    bool equal(std::vector< std::bitset<BITS> > object1, std::vector< std::bitset<BITS> > object2) {
-        // Check if every dimension is the same
-        for (int i = 0; i < DIMENSIONS; ++i) {
-            if (object1[i] != object2[i]) {
-                return false;
+    // Set up the exact distances of a query: the point to pass to
+    // squaredDistanceBounded and the order of its dimensions, NULL unless
+    // dimensionOrder is set
+    const int *getQueryOrder(const std::vector<double>& point, Context::QueryContext& context, const double *&query) {
+        query = point.data();
+        if (!dimensionOrder) {
+            return NULL;
+        }
+        context.order.resize(dimensionCount);
+        context.orderedPoint.resize(dimensionCount);
+        Kernels::orderDimensions(point.data(), dimensionMeans.data(), dimensionCount, context.order.data(), context.orderedPoint.data());
+        query = context.orderedPoint.data();
+        return context.order.data();
+    }
+
+    // Mean of every dimension of count points
+    void computeMeans(const double *points, long long count) {
+        dimensionMeans.assign(dimensionCount, 0);
+        for (long long index = 0; index < count; ++index) {
+            for (int i = 0; i < dimensionCount; ++i) {
+                dimensionMeans[i] += points[index * dimensionCount + i];
             }
         }
+        for (int i = 0; i < dimensionCount && count > 0; ++i) {
+            dimensionMeans[i] /= count;
+        }
+    }
 
-        return true;
+    double getDistance(const std::vector<double>& point1, const std::vector<double>& point2) {
+        return std::sqrt(getSquaredDistance(point1.data(), point2.data()));
     }
 
-    std::pair< std::vector<double>, std::string > parseNormalLine(std::string line) {
+    std::pair< std::vector<double>, std::string > parseNormalLine(const std::string& line, int dimensions) {
         // Create a stringstream from the input line
         std::istringstream inputStream(line);
 
         // Read each coordinate from the stream and create a vector
         double coordinate;
         std::vector<double> coordinates;
-        for (int i = 0; i < DIMENSIONS; ++i) {
+        for (int i = 0; i < dimensions; ++i) {
             inputStream >> coordinate;
             coordinates.push_back(coordinate);
         }
@@ -169,270 +478,1922 @@ namespace VAFile {
         return make_pair(coordinates, dataString);
     }
 
-    std::pair< std::vector< std::bitset<BITS> >, long long> parseVALine(std::string line) {
-        // Create a stringstream from the input line
-        std::istringstream inputStream(line);
+    int getStride() {
+        return stride;
+    }
 
-        // Read each coordinate from the stream and create a vector
-        std::bitset<BITS> coordinate;
-        std::vector< std::bitset<BITS> > coordinates;
-        for (int i = 0; i < DIMENSIONS; ++i) {
-            inputStream >> coordinate;
-            coordinates.push_back(coordinate);
+    void packGrid(const std::vector< std::bitset<MAX_BITS> >& grid, unsigned char *row) {
+        std::memset(row, 0, getStride());
+
+        // Lay the cells out back to back starting from the least significant bit
+        for (int i = 0; i < dimensionCount; ++i) {
+            for (int bit = 0; bit < bitsPerDimension[i]; ++bit) {
+                if (grid[i][bit]) {
+                    int position = bitOffsets[i] + bit;
+                    row[position >> 3] |= (unsigned char) (1 << (position & 7));
+                }
+            }
+        }
+    }
+
+    void packPoint(const double *point, unsigned char *row) {
+        std::memset(row, 0, getStride());
+        for (int i = 0; i < dimensionCount; ++i) {
+            unsigned long cell = quantize(i, point[i]);
+            for (int bit = 0; bit < bitsPerDimension[i]; ++bit) {
+                if ((cell >> bit) & 1) {
+                    int position = bitOffsets[i] + bit;
+                    row[position >> 3] |= (unsigned char) (1 << (position & 7));
+                }
+            }
         }
+    }
+
+    unsigned long getCell(const unsigned char *row, int dimension) {
+        int bitOffset = bitOffsets[dimension];
+        const unsigned char *bytes = row + (bitOffset >> 3);
+        unsigned long word = bytes[0] | (bytes[1] << 8) | (bytes[2] << 16);
+        return (word >> (bitOffset & 7)) & ((1UL << bitsPerDimension[dimension]) - 1);
+    }
 
-        // Get the fileIndex from the line
-        long long fileIndex;
-        inputStream >> fileIndex;
+    /**
+      * Evaluate a bound on a block of approximations, through the unrolled
+      * kernel when there is one for the layout
+      * @param rows count approximations of stride bytes each
+      * @param count Number of approximations
+      * @param table A table from getBoundTables
+      * @param bounds Output, the bound of every approximation
+      */
+    void sumBounds(const unsigned char *rows, long long count, const double *table, double *bounds) {
+        if (fixedKernel != NULL) {
+            fixedKernel(rows, count, stride, table, bounds);
+        } else {
+            Kernels::sumBounds(rows, count, stride, dimensionCount,
+                    bitOffsets.data(), bitsPerDimension.data(), tableOffsets.data(), table, bounds);
+        }
+    }
 
-        // Return a pair of coordinates and fileIndex
-        return make_pair(coordinates, fileIndex);
+    // The first aligned byte of a buffer with READ_ALIGNMENT bytes to spare
+    unsigned char *alignBuffer(std::vector<unsigned char>& buffer) {
+        uintptr_t address = (uintptr_t) buffer.data();
+        return buffer.data() + (READ_ALIGNMENT - address % READ_ALIGNMENT) % READ_ALIGNMENT;
     }
 
-    void writeNormalFile(std::vector<double> point, std::string dataString, long long fileIndex) {
-        // Encode the line and print it out to the file
-        // Create an outputStream which will be written to the VAfile
-        std::ostringstream outputStream;
+    // Streaming scans read ahead on their own queue, so that the refinement
+    // reads of the thread do not see their completions
+    Reader::ReadQueue& getScanQueue() {
+        static thread_local Reader::ReadQueue queue;
+        return queue;
+    }
 
-        // Now add the quantized point to the outputStream
-        for (auto coordinate : point) {
-            outputStream << coordinate << " ";
+    // Queue the read of the approximations of objects [begin, end) into a
+    // chunk. The read is aligned for O_DIRECT and may run past the end of
+    // the file, only the approximations must be in it
+    void readChunk(Context::Chunk& chunk, int tag, long long begin, long long end, Reader::ReadQueue& queue) {
+        const Header *header = (const Header *) mappedFile;
+        uint64_t first = header->dataOffset + begin * stride;
+        uint64_t last = header->dataOffset + end * stride;
+        uint64_t alignedFirst = first / READ_ALIGNMENT * READ_ALIGNMENT;
+        uint64_t alignedLast = (last + READ_ALIGNMENT - 1) / READ_ALIGNMENT * READ_ALIGNMENT;
+        if (chunk.buffer.size() < alignedLast - alignedFirst + READ_ALIGNMENT) {
+            chunk.buffer.resize(alignedLast - alignedFirst + READ_ALIGNMENT);
         }
+        unsigned char *data = alignBuffer(chunk.buffer);
+        chunk.begin = begin;
+        chunk.end = end;
+        chunk.rows = data + (first - alignedFirst);
+        chunk.pending = true;
+        chunk.failed = false;
+        queue.submit(scanDescriptor, alignedFirst, alignedLast - alignedFirst, data, tag, last - alignedFirst);
+    }
 
-        // Now add the dataString
-        outputStream << dataString;
+    // Wait until the read of a chunk is complete
+    void waitChunk(Context::Chunk *chunks, int chunk, Reader::ReadQueue& queue) {
+        bool failed;
+        while (chunks[chunk].pending) {
+            uint64_t tag = queue.wait(failed);
+            chunks[tag].pending = false;
+            chunks[tag].failed = failed;
+        }
+    }
 
-        // Push this line to the file
-        std::ofstream ofile(OBJECTBASE + std::to_string(fileIndex));
-        ofile << outputStream.str() << std::endl << std::flush;
-        ofile.close();
+    /**
+      * Get the approximations of a block of a slice. Resident ones are read
+      * through the map; a streaming scan waits for the chunk that holds the
+      * block and, on entering a chunk, reads the next one into the other.
+      * Slices must ask for their blocks in order, a multiple of SCAN_BLOCK
+      * objects apart.
+      * @param chunks The two chunks of the slice
+      * @param start The first object of the block
+      * @param end One past the last object of the slice
+      * @return The approximation of start, NULL if the chunk could not be
+      * read
+      */
+    const unsigned char *getRows(Context::Chunk *chunks, long long start, long long end) {
+        if (chunkRows == 0) {
+            return mappedFile + ((const Header *) mappedFile)->dataOffset + start * stride;
+        }
+
+        Reader::ReadQueue& queue = getScanQueue();
+        int current = start >= chunks[1].begin && start < chunks[1].end ? 1 : 0;
+        if (start < chunks[current].begin || start >= chunks[current].end) {
+            // The first block of the slice, or a block past the chunk read
+            // ahead when blocks were skipped
+            waitChunk(chunks, 0, queue);
+            waitChunk(chunks, 1, queue);
+            readChunk(chunks[0], 0, start, std::min(start + chunkRows, end), queue);
+            current = 0;
+        }
+        long long next = chunks[current].end;
+        if (next < end && chunks[current ^ 1].begin != next) {
+            waitChunk(chunks, current ^ 1, queue);
+            readChunk(chunks[current ^ 1], current ^ 1, next, std::min(next + chunkRows, end), queue);
+        }
+        waitChunk(chunks, current, queue);
+        if (chunks[current].failed) {
+            return NULL;
+        }
+        return chunks[current].rows + (start - chunks[current].begin) * stride;
+    }
+
+    // Wait for the chunks a slice read ahead but skipped, before the next
+    // scan takes their completions for its own
+    void finishRows(Context::Chunk *chunks) {
+        if (chunkRows > 0) {
+            waitChunk(chunks, 0, getScanQueue());
+            waitChunk(chunks, 1, getScanQueue());
+        }
+    }
+
+    /**
+      * Evaluate the lower bounds of a run of approximations for a filter. With
+      * the blocked layout they are summed dimension by dimension, and a
+      * block is abandoned once every bound in it exceeds the threshold; the
+      * partial sums it leaves exceed the threshold as well.
+      * @param rows The approximations of the run, from getRows
+      * @param start The first object
+      * @param count Number of objects
+      * @param table The lower bound table from getBoundTables
+      * @param threshold Bounds above it are pruned
+      * @param bounds Output, a bound of every object, exact unless pruned
+      * @param stats Counts the approximation bytes read
+      */
+    void filterBounds(const unsigned char *rows, long long start, long long count, const double *table, double threshold, double *bounds, QueryStats& stats) {
+        COUNT_STATS(stats.approximations += count);
+        if (blockedCells == NULL) {
+            COUNT_STATS(stats.bytesScanned += count * stride);
+            sumBounds(rows, count, table, bounds);
+            return;
+        }
+
+        std::fill(bounds, bounds + count, 0.0);
+        for (long long done = 0; done < count; ) {
+            // The part of the run in one block
+            long long index = start + done;
+            const unsigned char *block = blockedCells + index / blockSize * blockSize * dimensionCount * cellBytes;
+            long long offset = index % blockSize;
+            long long part = std::min(blockSize - offset, count - done);
+
+            for (int i = 0; i < dimensionCount; ++i) {
+                const unsigned char *cells = block + (i * blockSize + offset) * cellBytes;
+                COUNT_STATS(stats.bytesScanned += part * cellBytes);
+                if (Kernels::addCellBounds(cells, cellBytes, part, table + tableOffsets[i], bounds + done) > threshold) {
+                    break;
+                }
+            }
+            done += part;
+        }
+    }
+
+    double getBound(const unsigned char *row, const double *table) {
+        double bound = 0;
+        for (int i = 0; i < dimensionCount; ++i) {
+            bound += table[tableOffsets[i] + getCell(row, i)];
+        }
+        return bound;
     }
 
-    void writeVALine(std::vector<double> point, long long fileIndex, std::ofstream& ofile) {
-        // Encode the line and print it out to the file
-        // Create an outputStream which will be written to the VAfile
-        std::ostringstream outputStream;
+    // Sum the upper bounds of a run of approximations in one kernel call when
+    // more than a quarter of them pass the filter, the kNN filters bound the
+    // few that pass one at a time otherwise
+    bool sumPassing(const unsigned char *rows, long long count, const double *minDistances, double threshold,
+            const double *table, double *bounds) {
+        long long passing = 0;
+        for (long long i = 0; i < count; ++i) {
+            passing += minDistances[i] <= threshold;
+        }
+        if (passing * 4 <= count) {
+            return false;
+        }
+        sumBounds(rows, count, table, bounds);
+        return true;
+    }
 
-        // Now add the quantized point to the outputStream
-        for (auto coordinate : point) {
-            outputStream << std::bitset<BITS>(quantize(coordinate)) << " ";
+    // Extend the summaries of blocks of blockObjects objects by the
+    // approximations of objects [first, first + count)
+    void addToSummaries(const unsigned char *rows, long long first, long long count, long long blockObjects, std::vector<uint16_t>& blockSummaries) {
+        long long blocks = (first + count + blockObjects - 1) / blockObjects;
+        for (long long block = blockSummaries.size() / (2 * dimensionCount); block < blocks; ++block) {
+            blockSummaries.insert(blockSummaries.end(), dimensionCount, std::numeric_limits<uint16_t>::max());
+            blockSummaries.insert(blockSummaries.end(), dimensionCount, 0);
+        }
+        for (long long index = 0; index < count; ++index) {
+            uint16_t *summary = blockSummaries.data() + (first + index) / blockObjects * 2 * dimensionCount;
+            for (int i = 0; i < dimensionCount; ++i) {
+                uint16_t cell = getCell(rows + index * stride, i);
+                summary[i] = std::min(summary[i], cell);
+                summary[dimensionCount + i] = std::max(summary[dimensionCount + i], cell);
+            }
         }
+    }
 
-        // Now add the fileIndex
-        outputStream << fileIndex;
+    // Cell of a point in every dimension
+    void getCells(const std::vector<double>& point, std::vector<int>& cells) {
+        cells.resize(dimensionCount);
+        for (int i = 0; i < dimensionCount; ++i) {
+            cells[i] = quantize(i, point[i]);
+        }
+    }
 
-        // Push this line to the file
-        ofile << outputStream.str() << std::endl << std::flush;
+    /**
+      * Check a run of objects against the summaries of the blocks it overlaps.
+      * The lower bound of a block adds, for every dimension, the bound of its
+      * cell nearest to the query, which no object of the block beats.
+      * @param start The first object
+      * @param count Number of objects
+      * @param cells The cell of the query in every dimension, from getCells
+      * @param table The lower bound table from getBoundTables, or NULL for a
+      *        point query that only matches objects in its own cells
+      * @param threshold Objects with a lower bound above it are pruned
+      * @return true if no object of the run can qualify
+      */
+    bool skipRun(long long start, long long count, const int *cells, const double *table, double threshold) {
+        for (long long block = start / summaryBlock; block <= (start + count - 1) / summaryBlock; ++block) {
+            const uint16_t *low = summaries + block * 2 * dimensionCount;
+            const uint16_t *high = low + dimensionCount;
+            double bound = 0;
+            for (int i = 0; i < dimensionCount && bound <= threshold; ++i) {
+                if (cells[i] < low[i]) {
+                    bound += table != NULL ? table[tableOffsets[i] + low[i]] : std::numeric_limits<double>::infinity();
+                } else if (cells[i] > high[i]) {
+                    bound += table != NULL ? table[tableOffsets[i] + high[i]] : std::numeric_limits<double>::infinity();
+                }
+            }
+            if (bound <= threshold) {
+                return false;
+            }
+        }
+        return true;
     }
 
-    void buildVAFile() {
-        std::ifstream ifile(DATAFILE);
-        std::ofstream ofile(VAFILE);
+    // Order of the objects by the Z-order of their cells: the bits of all
+    // dimensions interleaved from the most significant down, a dimension
+    // with fewer bits drops out at the bottom; ties keep the object order
+    std::vector<long long> getZOrder(const unsigned char *rows, long long count) {
+        int maxBits = *std::max_element(bitsPerDimension.begin(), bitsPerDimension.end());
+        std::vector<unsigned char> keys(count * stride, 0);
+        ThreadPool::parallelFor(count, [&](int, long long begin, long long end) {
+            std::vector<unsigned long> cells(dimensionCount);
+            for (long long index = begin; index < end; ++index) {
+                for (int i = 0; i < dimensionCount; ++i) {
+                    cells[i] = getCell(rows + index * stride, i);
+                }
+                unsigned char *key = keys.data() + index * stride;
+                int bit = 0;
+                for (int level = 0; level < maxBits; ++level) {
+                    for (int i = 0; i < dimensionCount; ++i) {
+                        if (level >= bitsPerDimension[i]) {
+                            continue;
+                        }
+                        if ((cells[i] >> (bitsPerDimension[i] - 1 - level)) & 1) {
+                            key[bit >> 3] |= 0x80 >> (bit & 7);
+                        }
+                        ++bit;
+                    }
+                }
+            }
+        });
 
-        // Read the file line by line
-        for (std::string line; std::getline(ifile, line); ++objectCount) {
-            // Parse the input line into coordinates and string
-            auto input = parseNormalLine(line);
+        std::vector<long long> order(count);
+        for (long long index = 0; index < count; ++index) {
+            order[index] = index;
+        }
+        std::sort(order.begin(), order.end(), [&](long long first, long long second) {
+            int comparison = std::memcmp(keys.data() + first * stride, keys.data() + second * stride, stride);
+            return comparison < 0 || (comparison == 0 && first < second);
+        });
+        return order;
+    }
 
-            // We create a new file for the object and store is there
-            writeNormalFile(input.first, input.second, objectCount);
+    // Bytes per cell in the blocked layout of the current allocation
+    int getCellBytes() {
+        return *std::max_element(bitsPerDimension.begin(), bitsPerDimension.end()) <= 8 ? 1 : 2;
+    }
 
-            // Write the VALine to the file
-            writeVALine(input.first, objectCount, ofile);
+    /**
+      * Write a VAFile with the current allocation and boundaries
+      * @param filename The file to write
+      * @param rows count packed approximations
+      * @param count Number of objects
+      * @param source The quantizer, allocation and data file recorded in the header
+      * @return false if the file cannot be written
+      */
+    bool writeVAFile(const std::string& filename, const unsigned char *rows, long long count, const Header& source) {
+        // The allocation and the boundaries follow the header, then the
+        // approximations; every section starts 8 byte aligned
+        std::vector<uint32_t> bits(bitsPerDimension.begin(), bitsPerDimension.end());
+        bits.resize((bits.size() + 1) / 2 * 2);
+
+        Header header;
+        std::memset(&header, 0, sizeof(header));
+        std::memcpy(header.magic, MAGIC, sizeof(MAGIC));
+        header.version = VERSION;
+        header.bits = bitOffsets[dimensionCount];
+        header.dimensions = dimensionCount;
+        header.stride = getStride();
+        header.objectCount = count;
+        header.quantizer = source.quantizer;
+        header.allocation = source.allocation;
+        header.dataSize = source.dataSize;
+        header.dataModified = source.dataModified;
+        header.layout = source.layout;
+        header.blockSize = source.layout == LAYOUT_BLOCKED ? source.blockSize : 0;
+        header.objectOrder = source.objectOrder;
+        header.summaryBlock = source.summaryBlock;
+        header.bitsOffset = sizeof(Header);
+        header.boundaryOffset = header.bitsOffset + bits.size() * sizeof(uint32_t);
+        header.meanOffset = header.boundaryOffset + boundaries.size() * sizeof(double);
+        header.dataOffset = header.meanOffset + dimensionCount * sizeof(double);
+        std::vector<uint16_t> blockSummaries;
+        addToSummaries(rows, 0, count, header.summaryBlock, blockSummaries);
+        header.summaryOffset = (header.dataOffset + count * getStride() + PADDING + 7) / 8 * 8;
+        if (header.layout == LAYOUT_BLOCKED) {
+            header.blockOffset = (header.summaryOffset + blockSummaries.size() * sizeof(uint16_t) + 7) / 8 * 8;
         }
 
-        // Close open files
-        ifile.close();
+        std::ofstream ofile(filename, std::ios::binary | std::ios::trunc);
+        ofile.write((const char *) &header, sizeof(header));
+        ofile.write((const char *) bits.data(), bits.size() * sizeof(uint32_t));
+        ofile.write((const char *) boundaries.data(), boundaries.size() * sizeof(double));
+        ofile.write((const char *) dimensionMeans.data(), dimensionCount * sizeof(double));
+        ofile.write((const char *) rows, count * getStride());
+
+        // Zero padding for the cell extraction at the end of the rows
+        const char padding[PADDING] = { 0 };
+        ofile.write(padding, PADDING);
+        ofile.write(padding, header.summaryOffset - (header.dataOffset + count * getStride() + PADDING));
+        ofile.write((const char *) blockSummaries.data(), blockSummaries.size() * sizeof(uint16_t));
+
+        // Transpose every block of approximations into the blocked layout
+        if (header.layout == LAYOUT_BLOCKED) {
+            ofile.write(padding, header.blockOffset - (header.summaryOffset + blockSummaries.size() * sizeof(uint16_t)));
+            int bytes = getCellBytes();
+            std::vector<unsigned char> block(header.blockSize * dimensionCount * bytes);
+            for (long long start = 0; start < count; start += header.blockSize) {
+                std::fill(block.begin(), block.end(), 0);
+                long long blockCount = std::min((long long) header.blockSize, count - start);
+                for (int i = 0; i < dimensionCount; ++i) {
+                    unsigned char *cells = block.data() + (long long) i * header.blockSize * bytes;
+                    for (long long index = 0; index < blockCount; ++index) {
+                        unsigned long cell = getCell(rows + (start + index) * stride, i);
+                        if (bytes == 1) {
+                            cells[index] = (unsigned char) cell;
+                        } else {
+                            ((uint16_t *) cells)[index] = (uint16_t) cell;
+                        }
+                    }
+                }
+                ofile.write((const char *) block.data(), block.size());
+            }
+        }
         ofile.close();
+        return !ofile.fail();
     }
 
-    void pointQuery(std::vector<double> point) {
-        // TODO: Memory map the file incase it is smaller than memory size
-        std::ifstream ifile(VAFILE);
+    bool buildVAFile(const Options& options) {
+        closeVAFile();
+        objectCount = 0;
 
-        // Quantize the query point to get the grid
-        std::vector< std::bitset<BITS> > grid = getGrid(point);
+        // A new index has no deleted objects, and its point index is built
+        // when it is opened
+        std::remove(getTombstoneFile(options.vaFile).c_str());
+        std::remove(getPointIndexFile(options.vaFile).c_str());
 
-        // Filter and search paradigm, so we need a queue
-        std::queue<long long> fileIndices;
+        // First pass: parse the data file
+        Loader::Objects objects;
+        if (!Loader::load(options.dataFile, options.dimensions, objects)) {
+            return false;
+        }
+        objectCount = objects.getCount();
+
+        // The bits and the quantizer are fit to all the objects
+        const double *points = objects.coordinates.data();
+        setAllocation(allocateBits(points, objectCount, options.dimensions, options.allocation, options.bits, options.bitBudget));
+        computeBoundaries(points, objectCount, options.quantizer);
+        computeMeans(points, objectCount);
+
+        // Second pass: pack the approximations of all objects in parallel
+        std::vector<unsigned char> rows(objectCount * getStride());
+        ThreadPool::parallelFor(objectCount, [&](int, long long begin, long long end) {
+            for (long long index = begin; index < end; ++index) {
+                packPoint(points + index * dimensionCount, rows.data() + index * stride);
+            }
+        });
+
+        // Sort the objects, their index is their position in the sorted files
+        // and the store maps it back to their line in the data file
+        std::vector<uint64_t> ids;
+        if (options.objectOrder == OBJECT_ORDER_ZORDER) {
+            std::vector<long long> order = getZOrder(rows.data(), objectCount);
+            ids.assign(order.begin(), order.end());
+            std::vector<unsigned char> sortedRows(rows.size());
+            std::vector<double> sortedPoints(objects.coordinates.size());
+            std::vector<uint64_t> sortedIndex(1, 0);
+            std::string sortedPayloads;
+            sortedIndex.reserve(objectCount + 1);
+            sortedPayloads.reserve(objects.payloads.size());
+            for (long long position = 0; position < objectCount; ++position) {
+                long long index = order[position];
+                std::memcpy(sortedRows.data() + position * stride, rows.data() + index * stride, stride);
+                std::copy(points + index * dimensionCount, points + (index + 1) * dimensionCount, sortedPoints.begin() + position * dimensionCount);
+                sortedPayloads.append(objects.payloads, objects.payloadIndex[index], objects.payloadIndex[index + 1] - objects.payloadIndex[index]);
+                sortedIndex.push_back(sortedPayloads.size());
+            }
+            rows.swap(sortedRows);
+            objects.coordinates.swap(sortedPoints);
+            objects.payloadIndex.swap(sortedIndex);
+            objects.payloads.swap(sortedPayloads);
+            points = objects.coordinates.data();
+        }
 
-        // Loop over the entire VAFile and prune the matches
-        for(std::string line; std::getline(ifile, line);) {
-            auto VAPair = parseVALine(line);
+        // Put every object in the object store, a store or VAFile that cannot
+        // be written whole is removed so that it is not opened
+        bool written = ObjectStore::create(options.objectFile, options.dimensions, options.precision);
+        if (written) {
+            ObjectStore::append(points, objectCount, objects.payloadIndex.data(), objects.payloads.data());
+            ObjectStore::appendIds(ids.data(), ids.size());
+            written = ObjectStore::finish();
+        }
+        if (!written) {
+            std::remove(options.objectFile.c_str());
+            std::remove(options.vaFile.c_str());
+            return false;
+        }
+        std::vector<uint64_t>().swap(objects.payloadIndex);
+        std::string().swap(objects.payloads);
+
+        // The data file is recorded to tell when the index is stale
+        Header source;
+        std::memset(&source, 0, sizeof(source));
+        source.quantizer = options.quantizer;
+        source.allocation = options.allocation;
+        source.layout = options.layout;
+        source.blockSize = options.layoutBlock;
+        source.objectOrder = options.objectOrder;
+        source.summaryBlock = SUMMARY_BLOCK;
+        struct stat st;
+        if (stat(options.dataFile.c_str(), &st) == 0) {
+            source.dataSize = st.st_size;
+            source.dataModified = st.st_mtime;
+        }
+        if (!writeVAFile(options.vaFile, rows.data(), objectCount, source)) {
+            std::remove(options.objectFile.c_str());
+            std::remove(options.vaFile.c_str());
+            return false;
+        }
+        return true;
+    }
+
+    // Open the VAFile for the chunks of streaming scans, with O_DIRECT when
+    // it is asked for and the file system takes it
+    int openScanDescriptor(const std::string& vaFile) {
+        if (directReads) {
+            int fd = open(vaFile.c_str(), O_RDONLY | O_DIRECT);
+            std::vector<unsigned char> page(2 * READ_ALIGNMENT);
+            if (fd >= 0 && pread(fd, alignBuffer(page), READ_ALIGNMENT, 0) > 0) {
+                return fd;
+            }
+            if (fd >= 0) {
+                close(fd);
+            }
+        }
+
+        int fd = open(vaFile.c_str(), O_RDONLY);
+        if (fd >= 0) {
+            posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+        }
+        return fd;
+    }
+
+    // Map the point index of the VAFile being opened, it is built from the
+    // object store when it is missing or belongs to another index
+    void openPointIndex(const std::string& vaFile, const Header *header) {
+        std::string filename = getPointIndexFile(vaFile);
+        const PointIndex::Header *index = PointIndex::map(filename, pointIndexSize);
+        if (index != NULL && (index->objectCount != header->objectCount
+                    || index->dimensions != header->dimensions
+                    || index->dataSize != header->dataSize
+                    || index->dataModified != header->dataModified)) {
+            PointIndex::unmap(index, pointIndexSize);
+            index = NULL;
+        }
 
-            // If we cannot prune the grid, we add it to the queue
-            if (equal(VAPair.first, grid)) {
-                fileIndices.push(VAPair.second);
+        if (index == NULL) {
+            PointIndex::build(ObjectStore::getPoint(0), header->objectCount, header->dimensions, pointTable);
+            PointIndex::Header source;
+            std::memset(&source, 0, sizeof(source));
+            source.dimensions = header->dimensions;
+            source.objectCount = header->objectCount;
+            source.dataSize = header->dataSize;
+            source.dataModified = header->dataModified;
+            if (PointIndex::write(filename, source, pointTable)) {
+                index = PointIndex::map(filename, pointIndexSize);
             }
         }
 
-        // The work of this file is over
-        ifile.close();
+        if (index != NULL) {
+            std::vector<PointIndex::Slot>().swap(pointTable);
+            pointIndex = index;
+            pointSlots = (const PointIndex::Slot *) (index + 1);
+            pointCapacity = index->capacity;
+        } else {
+            pointSlots = pointTable.data();
+            pointCapacity = pointTable.size();
+        }
+    }
+
+    /**
+      * Memory map a VAFile, its object store and its tombstones
+      * @param vaFile The VAFile
+      * @param objectFile The object store
+      * @return false if the files are missing or not a valid index
+      */
+    bool openFiles(const std::string& vaFile, const std::string& objectFile) {
+        if (mappedFile != NULL) {
+            return true;
+        }
 
-        // Now we loop over the entire non pruned nodes and perform full computation
-        while (!fileIndices.empty()) {
-            // Get the current file index
-            auto fileIndex = fileIndices.front();
-            fileIndices.pop();
+        // The objects are needed for the refinement
+        if (!ObjectStore::open(objectFile)) {
+            return false;
+        }
 
-            // Open the file
-            std::ifstream ifile(OBJECTBASE + std::to_string(fileIndex));
+        int fd = open(vaFile.c_str(), O_RDONLY);
+        if (fd < 0) {
+            ObjectStore::close();
+            return false;
+        }
 
-            // get the point
-            std::string line;
-            std::getline(ifile, line);
-            auto dataPair = parseNormalLine(line);
+        long long size = getFileSize(vaFile);
+        if (size < (long long) sizeof(Header)) {
+            close(fd);
+            ObjectStore::close();
+            return false;
+        }
 
-            // compute the acutal distance
-            if (equal(dataPair.first, point)) {
-#ifdef OUTPUT
-                std::cout << dataPair.second << std::endl;
-#endif
+        void *address = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (address == MAP_FAILED) {
+            ObjectStore::close();
+            return false;
+        }
+
+        // Reject old text files and files that do not match the object store,
+        // the parameters of the index come from its header
+        const Header *header = (const Header *) address;
+        if (std::memcmp(header->magic, MAGIC, sizeof(MAGIC)) != 0
+                || header->version != VERSION
+                || (long long) header->objectCount != ObjectStore::getObjectCount()
+                || (int) header->dimensions != ObjectStore::getDimensions()
+                || header->dimensions == 0
+                || (long long) header->dataOffset > size) {
+            munmap(address, size);
+            ObjectStore::close();
+            return false;
+        }
+
+        // Load the allocation and the quantizer and check them against the layout
+        const unsigned char *bytes = (const unsigned char *) address;
+        const uint32_t *mappedBits = (const uint32_t *) (bytes + header->bitsOffset);
+        int dimensions = header->dimensions;
+        bool valid = header->bitsOffset + dimensions * sizeof(uint32_t) <= header->boundaryOffset;
+        std::vector<int> bits;
+        if (valid) {
+            bits.assign(mappedBits, mappedBits + dimensions);
+        }
+        for (int i = 0; valid && i < dimensions; ++i) {
+            valid = bits[i] <= MAX_BITS && (header->allocation != ALLOCATION_UNIFORM || bits[i] == bits[0]);
+        }
+        if (valid) {
+            setAllocation(bits);
+            valid = header->bits == (uint32_t) bitOffsets[dimensionCount]
+                && header->stride == (uint32_t) getStride()
+                && header->meanOffset == header->boundaryOffset + (tableOffsets[dimensionCount] + dimensionCount) * sizeof(double)
+                && header->dataOffset == header->meanOffset + dimensionCount * sizeof(double)
+                && (long long) (header->dataOffset + header->objectCount * header->stride + PADDING) <= size;
+        }
+        if (valid) {
+            long long blocks = (header->objectCount + header->summaryBlock - 1) / std::max(header->summaryBlock, 1U);
+            valid = header->summaryBlock > 0
+                && header->summaryOffset >= header->dataOffset + header->objectCount * header->stride + PADDING
+                && (long long) (header->summaryOffset + blocks * 2 * dimensions * sizeof(uint16_t)) <= size;
+        }
+        if (valid && header->layout == LAYOUT_BLOCKED) {
+            long long blocks = (header->objectCount + header->blockSize - 1) / std::max(header->blockSize, 1U);
+            valid = header->blockSize > 0
+                && (long long) (header->blockOffset + blocks * header->blockSize * dimensions * getCellBytes()) <= size;
+        } else if (valid) {
+            valid = header->layout == LAYOUT_ROWS;
+        }
+        if (!valid) {
+            munmap(address, size);
+            ObjectStore::close();
+            return false;
+        }
+
+        const double *mappedBoundaries = (const double *) (bytes + header->boundaryOffset);
+        boundaries.assign(mappedBoundaries, mappedBoundaries + tableOffsets[dimensionCount] + dimensionCount);
+        const double *mappedMeans = (const double *) (bytes + header->meanOffset);
+        dimensionMeans.assign(mappedMeans, mappedMeans + dimensionCount);
+
+        // A VAFile that fits in memory is loaded and scanned through the map,
+        // a larger one streams the packed rows and leaves the blocked cells
+        if (size > memoryBudget) {
+            scanDescriptor = openScanDescriptor(vaFile);
+            if (scanDescriptor < 0) {
+                munmap(address, size);
+                ObjectStore::close();
+                return false;
+            }
+            chunkRows = std::max(chunkBytes / (SCAN_BLOCK * stride), 1LL) * SCAN_BLOCK;
+        } else {
+            madvise(address, size, MADV_SEQUENTIAL);
+            madvise(address, size, MADV_WILLNEED);
+            chunkRows = 0;
+        }
+
+        mappedFile = bytes;
+        mappedSize = size;
+        objectCount = header->objectCount;
+        blockedCells = header->layout == LAYOUT_BLOCKED && chunkRows == 0 ? bytes + header->blockOffset : NULL;
+        blockSize = header->blockSize;
+        cellBytes = getCellBytes();
+        summaries = (const uint16_t *) (bytes + header->summaryOffset);
+        summaryBlock = header->summaryBlock;
+        vaFileName = vaFile;
+        objectFileName = objectFile;
+
+        // Objects past the end of the tombstones are live
+        tombstones.assign((objectCount + 7) / 8, 0);
+        std::ifstream ifile(getTombstoneFile(vaFile), std::ios::binary);
+        ifile.read((char *) tombstones.data(), tombstones.size());
+        deletedCount = 0;
+        for (unsigned char byte : tombstones) {
+            deletedCount += __builtin_popcount(byte);
+        }
+
+        if (usePointIndex) {
+            openPointIndex(vaFile, header);
+        }
+        return true;
+    }
+
+    bool openVAFile(const Options& options) {
+        dimensionOrder = options.dimensionOrder;
+        asyncReads = options.refine == REFINE_ASYNC;
+        usePointIndex = options.pointIndex;
+        knnCandidates = options.knnCandidates;
+        knnTime = options.knnTime;
+        knnApproximate = options.knnApproximate;
+        memoryBudget = options.memory;
+        directReads = options.directReads;
+
+        // Two chunks in flight per thread stay within the budget
+        chunkBytes = std::min((long long) STREAM_PAGES * PAGESIZE, options.memory / (2 * options.threads));
+        return openFiles(options.vaFile, options.objectFile);
+    }
+
+    bool matchesOptions(const Options& options) {
+        if (mappedFile == NULL) {
+            return false;
+        }
+
+        // A uniform allocation is asked for by its bits, a variance one by its budget
+        const Header *header = (const Header *) mappedFile;
+        bool bitsMatch = options.allocation == ALLOCATION_UNIFORM
+            ? header->bits == (uint32_t) (options.bits * options.dimensions)
+            : header->bits == (uint32_t) std::min(options.bitBudget, options.dimensions * MAX_BITS);
+        // A data file that is not there does not make the index stale
+        struct stat st;
+        bool dataMatch = stat(options.dataFile.c_str(), &st) != 0
+            || (header->dataSize == (uint64_t) st.st_size && header->dataModified == (uint64_t) st.st_mtime);
+        return (int) header->dimensions == options.dimensions
+            && (int) header->quantizer == options.quantizer
+            && (int) header->allocation == options.allocation
+            && (int) header->objectOrder == options.objectOrder
+            && (int) header->layout == options.layout
+            && (options.layout == LAYOUT_ROWS || (int) header->blockSize == options.layoutBlock)
+            && ObjectStore::getPrecision() == options.precision
+            && bitsMatch
+            && dataMatch;
+    }
+
+    long long getCandidateCount() {
+        return candidateCount;
+    }
+
+    void closeVAFile() {
+        if (mappedFile != NULL) {
+            munmap((void *) mappedFile, mappedSize);
+            mappedFile = NULL;
+            mappedSize = 0;
+            blockedCells = NULL;
+            summaries = NULL;
+        }
+        if (pointIndex != NULL) {
+            PointIndex::unmap(pointIndex, pointIndexSize);
+            pointIndex = NULL;
+            pointIndexSize = 0;
+        }
+        std::vector<PointIndex::Slot>().swap(pointTable);
+        pointSlots = NULL;
+        pointCapacity = 0;
+        if (scanDescriptor >= 0) {
+            close(scanDescriptor);
+            scanDescriptor = -1;
+            chunkRows = 0;
+        }
+        ObjectStore::close();
+        std::vector<unsigned char>().swap(tombstones);
+        deletedCount = 0;
+    }
+
+    bool exportVAFile(const std::string& filename) {
+        if (mappedFile == NULL) {
+            return false;
+        }
+
+        const Header *header = (const Header *) mappedFile;
+        std::ofstream ofile(filename);
+
+        // Write every approximation as a line of bitsets followed by the index
+        for (long long index = 0; index < (long long) header->objectCount; ++index) {
+            const unsigned char *row = mappedFile + header->dataOffset + index * stride;
+            for (int i = 0; i < dimensionCount; ++i) {
+                ofile << std::bitset<MAX_BITS>(getCell(row, i)).to_string().substr(MAX_BITS - bitsPerDimension[i]) << " ";
             }
+            ofile << ObjectStore::getId(index) << std::endl;
+        }
+
+        ofile.close();
+        return !ofile.fail();
+    }
 
-            ifile.close();
+    // Hand the results of a query to the visitor with views of their data
+    // strings. Objects whose indices are not their ids, as with the Z-order
+    // or after a compaction, are reported by their original ids and put back
+    // in the order of those ids: by distance and then id for kNN queries. A
+    // query whose reads failed has none
+    void visitResults(Results::Visitor& visitor, std::vector<Results::Result>& results, bool nearestFirst, QueryStats& stats) {
+        if (stats.failedReads > 0) {
+            return;
         }
+        for (auto& result : results) {
+            result.payload = ObjectStore::getPayload(result.index, result.payloadLength);
+            result.index = ObjectStore::getId(result.index);
+            COUNT_STATS(stats.objectBytes += result.payloadLength);
+        }
+        if (ObjectStore::hasIds()) {
+            std::sort(results.begin(), results.end(), [nearestFirst](const Results::Result& first, const Results::Result& second) {
+                if (nearestFirst && first.distance != second.distance) {
+                    return first.distance < second.distance;
+                }
+                return first.index < second.index;
+            });
+        }
+        for (auto& result : results) {
+            visitor.visit(result);
+        }
+    }
+
+    // With float precision the refinement reads the rounded copy of an
+    // object, the exact one stays on disk for the rechecks
+    inline bool readsFloats() {
+        return ObjectStore::getPrecision() == PRECISION_FLOAT;
     }
 
-    void rangeQuery(std::vector<double> point, double radius) {
-        // TODO: Memory map the file incase it is smaller than memory size
-        std::ifstream ifile(VAFILE);
+    inline uint64_t getObjectSize() {
+        return dimensionCount * (readsFloats() ? sizeof(float) : sizeof(double));
+    }
+
+    inline uint64_t getObjectOffset(long long index) {
+        return readsFloats() ? ObjectStore::getFloatPointOffset(index) : ObjectStore::getPointOffset(index);
+    }
 
-        // Filter and search paradigm, so we need a queue
-        std::queue<long long> fileIndices;
+    // The copy of an object the refinement reads; counts the bytes read
+    inline const unsigned char *readObject(long long index, QueryStats& stats) {
+        COUNT_STATS(stats.objectBytes += getObjectSize());
+        if (readsFloats()) {
+            return (const unsigned char *) ObjectStore::getFloatPoint(index);
+        }
+        return (const unsigned char *) ObjectStore::getPoint(index);
+    }
 
-        // Loop over the entire VAFile and prune the matches
-        for(std::string line; std::getline(ifile, line);) {
-            auto VAPair = parseVALine(line);
-            double minDistance = getMinDistance(point, VAPair.first);
+    // Get the coordinates of a candidate from the copy that was read of it.
+    // A rounded object is at most the rounding error farther away, so it is
+    // only read again in double when it may be within a squared distance;
+    // NULL if it surely is not
+    inline const double *getExact(const double *point, long long index, const unsigned char *object, double squaredDistance,
+            QueryStats& stats) {
+        if (!readsFloats()) {
+            return (const double *) object;
+        }
+        double lower = std::sqrt(Kernels::squaredDistanceFloat(point, (const float *) object, dimensionCount)) - ObjectStore::getFloatError();
+        if (lower > 0 && lower * lower > squaredDistance * SLACK) {
+            return NULL;
+        }
+        COUNT_STATS(stats.objectBytes += dimensionCount * sizeof(double));
+        return ObjectStore::getPoint(index);
+    }
 
-            // If we cannot prune the grid, we add it to the queue
-            if (minDistance <= radius) {
-                fileIndices.push(VAPair.second);
+    // Score the candidates of the next run of either batch to complete, a
+    // run that could not be read is counted instead
+    template <typename Score>
+    void completeRun(Context::ReadBatch *batches, Reader::ReadQueue& queue, QueryStats& stats, Score score) {
+        bool failed;
+        uint64_t tag = queue.wait(failed);
+        Context::ReadBatch& batch = batches[tag >> 32];
+        long long run = tag & 0xffffffff;
+        if (failed) {
+            ++stats.failedReads;
+        } else {
+            for (long long i = batch.runs[run]; i < batch.runs[run + 1]; ++i) {
+                score(batch.candidates[i], batch.buffer.data() + batch.positions[i]);
             }
         }
+        --batch.pending;
+    }
+
+    // Queue the reads of a batch of candidates in index order, candidates at
+    // most READ_GAP bytes apart are read in one run; counts the bytes read.
+    // While the queue is full the runs that complete are scored, so that the
+    // queue never holds more than READ_DEPTH reads
+    template <typename Score>
+    void submitBatch(Context::ReadBatch *batches, int slot, Reader::ReadQueue& queue, QueryStats& stats, Score score) {
+        Context::ReadBatch& batch = batches[slot];
+        const std::vector<Context::Entry>& candidates = batch.candidates;
+        uint64_t objectSize = getObjectSize();
+
+        // A batch holds at most SCAN_BLOCK candidates, each of which adds at
+        // most READ_GAP bytes and its object to a run. The sizes of kNN
+        // batches depend on the timing of the other slices, so the scratch
+        // is sized for the largest batch at once rather than grown
+        if (batch.candidates.capacity() < (size_t) SCAN_BLOCK) {
+            batch.candidates.reserve(SCAN_BLOCK);
+            batch.positions.reserve(SCAN_BLOCK);
+            batch.runs.reserve(SCAN_BLOCK + 1);
+            batch.buffer.resize(SCAN_BLOCK * (objectSize + READ_GAP));
+        }
 
-        // The work of this file is over
-        ifile.close();
+        // Lay the runs out back to back in the buffer
+        batch.positions.resize(candidates.size());
+        batch.runs.clear();
+        uint64_t runStart = 0, runEnd = 0;
+        long long runPosition = 0;
+        for (long long i = 0; i < (long long) candidates.size(); ++i) {
+            uint64_t offset = getObjectOffset(candidates[i].second);
+            if (i == 0 || offset > runEnd + READ_GAP || offset + objectSize - runStart > MAX_RUN) {
+                runPosition += runEnd - runStart;
+                runStart = offset;
+                batch.runs.push_back(i);
+            }
+            runEnd = offset + objectSize;
+            batch.positions[i] = runPosition + (offset - runStart);
+        }
+        long long bytes = runPosition + (runEnd - runStart);
+        batch.runs.push_back(candidates.size());
+        if ((long long) batch.buffer.size() < bytes) {
+            batch.buffer.resize(bytes);
+        }
+        COUNT_STATS(stats.objectBytes += bytes);
+
+        // The tag names the batch and the run
+        batch.pending = batch.runs.size() - 1;
+        long long runCount = batch.pending;
+        for (long long run = 0; run < runCount; ++run) {
+            while (queue.isFull()) {
+                completeRun(batches, queue, stats, score);
+            }
+            long long first = batch.runs[run], last = batch.runs[run + 1] - 1;
+            queue.submit(ObjectStore::getDescriptor(), getObjectOffset(candidates[first].second),
+                    batch.positions[last] + objectSize - batch.positions[first],
+                    batch.buffer.data() + batch.positions[first], ((uint64_t) slot << 32) | run);
+        }
+    }
 
-        // Now we loop over the entire non pruned nodes and perform full computation
-        while (!fileIndices.empty()) {
-            // Get the current file index
-            auto fileIndex = fileIndices.front();
-            fileIndices.pop();
+    // Score the candidates of the runs that complete until a batch is read,
+    // runs of the other batch are scored as they come in as well
+    template <typename Score>
+    void completeBatch(Context::ReadBatch *batches, int slot, Reader::ReadQueue& queue, QueryStats& stats, Score score) {
+        while (batches[slot].pending > 0) {
+            completeRun(batches, queue, stats, score);
+        }
+    }
 
-            // Open the file
-            std::ifstream ifile(OBJECTBASE + std::to_string(fileIndex));
+    // Results are scored as their reads complete, put them back in index order
+    void sortResults(std::vector<Results::Result>& results) {
+        std::sort(results.begin(), results.end(), [](const Results::Result& first, const Results::Result& second) {
+            return first.index < second.index;
+        });
+    }
 
-            // get the point
-            std::string line;
-            std::getline(ifile, line);
-            auto dataPair = parseNormalLine(line);
+    // Collect the indices of the results of a query
+    std::vector<long long> getIndices(const Results::Buffer& buffer) {
+        std::vector<long long> indices;
+        for (auto& result : buffer.results) {
+            indices.push_back(result.index);
+        }
+        return indices;
+    }
 
-            // compute the acutal distance
-            if (getDistance(dataPair.first, point) <= radius) {
-#ifdef OUTPUT
-                std::cout << dataPair.second << std::endl;
-#endif
+    // A point query through the point index, the matches in index order
+    QueryStats pointLookup(const std::vector<double>& point, Results::Visitor& visitor, Context::QueryContext& context) {
+        QueryStats total;
+        COUNT_STATS(StatsClock::time_point lap = StatsClock::now());
+        std::vector<Results::Result>& results = context.getSlices(1)[0].results;
+        PointIndex::find(pointSlots, pointCapacity, point.data(), dimensionCount, [&](long long index) {
+            if (isDeleted(index)) {
+                return;
+            }
+            ++total.candidates;
+            const double *object = getExact(point.data(), index, readObject(index, total), 0, total);
+            if (object != NULL && std::equal(object, object + dimensionCount, point.begin())) {
+                results.push_back(Results::Result{ index, 0, NULL, 0 });
+            }
+        });
+        total.refined = total.candidates;
+        COUNT_STATS(total.refineSeconds = getLap(lap));
+        candidateCount = total.candidates;
+
+        sortResults(results);
+        visitResults(visitor, results, false, total);
+        return total;
+    }
+
+    QueryStats pointQuery(const std::vector<double>& point, Results::Visitor& visitor, Context::QueryContext& context) {
+        if (mappedFile == NULL) {
+            return QueryStats();
+        }
+
+        // The point index hands out the objects with the hash of the point
+        if (pointSlots != NULL) {
+            return pointLookup(point, visitor, context);
+        }
+
+        // Quantize and pack the query point to get the grid
+        context.grid.resize(stride);
+        packPoint(point.data(), context.grid.data());
+        const unsigned char *grid = context.grid.data();
+        getCells(point, context.cells);
+        const int *cells = context.cells.data();
+
+        // Every slice filters and refines its part of the VAFile
+        std::vector<Context::Slice>& slices = context.getSlices(ThreadPool::getThreadCount());
+        QueryStats total;
+        std::mutex statsMutex;
+        ThreadPool::parallelFor(objectCount, [&](int slice, long long begin, long long end) {
+            QueryStats counters;
+            COUNT_STATS(StatsClock::time_point lap = StatsClock::now());
+            long long candidates[SCAN_BLOCK];
+
+            // Candidates of a block are read while the next block is filtered
+            Context::ReadBatch *reads = slices[slice].reads;
+            Reader::ReadQueue& queue = Reader::getThreadQueue();
+            int slot = 0;
+            auto score = [&](const Context::Entry& candidate, const unsigned char *read) {
+                const double *object = getExact(point.data(), candidate.second, read, 0, counters);
+                if (object != NULL && std::equal(object, object + dimensionCount, point.begin())) {
+                    slices[slice].results.push_back(Results::Result{ candidate.second, 0, NULL, 0 });
+                }
+            };
+
+            for (long long start = begin; start < end; start += SCAN_BLOCK) {
+                long long count = std::min((long long) SCAN_BLOCK, end - start);
+                if (skipRun(start, count, cells, NULL, 0)) {
+                    continue;
+                }
+                COUNT_STATS(counters.approximations += count; counters.bytesScanned += count * stride);
+                const unsigned char *rows = getRows(slices[slice].chunks, start, end);
+                if (rows == NULL) {
+                    ++counters.failedReads;
+                    break;
+                }
+
+                // Only the objects with the grid of the point can match
+                long long candidateTotal = 0;
+                for (long long index = start; index < start + count; ++index) {
+                    if (std::memcmp(rows + (index - start) * stride, grid, stride) == 0 && !isDeleted(index)) {
+                        candidates[candidateTotal++] = index;
+                    }
+                }
+                counters.candidates += candidateTotal;
+                COUNT_STATS(counters.filterSeconds += getLap(lap));
+
+                // Compare the actual objects
+                counters.refined += candidateTotal;
+                if (asyncReads) {
+                    reads[slot].candidates.clear();
+                    for (long long i = 0; i < candidateTotal; ++i) {
+                        reads[slot].candidates.push_back(std::make_pair(0.0, candidates[i]));
+                    }
+                    submitBatch(reads, slot, queue, counters, score);
+                    slot ^= 1;
+                    completeBatch(reads, slot, queue, counters, score);
+                } else {
+                    for (long long i = 0; i < candidateTotal; ++i) {
+                        score(std::make_pair(0.0, candidates[i]), readObject(candidates[i], counters));
+                    }
+                }
+                COUNT_STATS(if (candidateTotal > 0) counters.refineSeconds += getLap(lap));
+            }
+            finishRows(slices[slice].chunks);
+            if (asyncReads) {
+                completeBatch(reads, 0, queue, counters, score);
+                completeBatch(reads, 1, queue, counters, score);
+                sortResults(slices[slice].results);
+                COUNT_STATS(counters.refineSeconds += getLap(lap));
             }
 
-            ifile.close();
+            std::lock_guard<std::mutex> lock(statsMutex);
+            total += counters;
+        });
+        candidateCount = total.candidates;
+
+        // The slices are in index order
+        std::vector<Results::Result>& results = context.results;
+        results.clear();
+        for (int slice = 0; slice < ThreadPool::getThreadCount(); ++slice) {
+            results.insert(results.end(), slices[slice].results.begin(), slices[slice].results.end());
         }
+        visitResults(visitor, results, false, total);
+        return total;
     }
 
-    void kNNQuery(std::vector<double> point, long long k) {
-        // TODO: Memory map the file incase it is smaller than memory size
-        std::ifstream ifile(VAFILE);
+    QueryStats rangeQuery(const std::vector<double>& point, double radius, Results::Visitor& visitor, Context::QueryContext& context) {
+        if (mappedFile == NULL) {
+            return QueryStats();
+        }
 
-        // Comparator for the priority queue
-        class comparator {
-            public:
-                bool operator() (std::pair< long long, double> &p1, std::pair<long long, double> &p2) {
-                    return p1.second < p2.second;
+        // Squared bound contributions of every cell for this query
+        getBoundTables(point, context.lowerTable, context.upperTable);
+        const double *lowerTable = context.lowerTable.data();
+
+        getCells(point, context.cells);
+        const int *cells = context.cells.data();
+
+        // Compare in squared space
+        double pruneDistance = radius * radius * SLACK;
+
+        // Exact distances stop once they are clearly outside the radius
+        const double *query;
+        const int *order = getQueryOrder(point, context, query);
+
+        // Every slice filters and refines its part of the VAFile
+        std::vector<Context::Slice>& slices = context.getSlices(ThreadPool::getThreadCount());
+        QueryStats total;
+        std::mutex statsMutex;
+        ThreadPool::parallelFor(objectCount, [&](int slice, long long begin, long long end) {
+            QueryStats counters;
+            COUNT_STATS(StatsClock::time_point lap = StatsClock::now());
+            double minDistances[SCAN_BLOCK];
+            long long candidates[SCAN_BLOCK];
+
+            // Candidates of a block are read while the next block is filtered
+            Context::ReadBatch *reads = slices[slice].reads;
+            Reader::ReadQueue& queue = Reader::getThreadQueue();
+            int slot = 0;
+            auto score = [&](const Context::Entry& candidate, const unsigned char *read) {
+                // A rounded object surely within the radius is taken with
+                // the distance to its rounding, which is off by at most the
+                // rounding error; only those near the radius are read again
+                if (readsFloats()) {
+                    double distance = std::sqrt(Kernels::squaredDistanceFloat(point.data(), (const float *) read, dimensionCount));
+                    if (distance + ObjectStore::getFloatError() <= radius) {
+                        slices[slice].results.push_back(Results::Result{ candidate.second, distance, NULL, 0 });
+                        return;
+                    }
                 }
-        };
+                const double *object = getExact(point.data(), candidate.second, read, radius * radius, counters);
+                if (object == NULL) {
+                    return;
+                }
+                double distance = std::sqrt(Kernels::squaredDistanceBounded(query, object, dimensionCount, order, pruneDistance));
+                if (distance <= radius) {
+                    slices[slice].results.push_back(Results::Result{ candidate.second, distance, NULL, 0 });
+                }
+            };
 
-        class comparator2 {
-            public:
-                bool operator() (std::pair< std::string, double> &p1, std::pair< std::string, double> &p2) {
-                    return p1.second < p2.second;
+            for (long long start = begin; start < end; start += SCAN_BLOCK) {
+                long long count = std::min((long long) SCAN_BLOCK, end - start);
+                if (skipRun(start, count, cells, lowerTable, pruneDistance)) {
+                    continue;
                 }
-        };
+                const unsigned char *rows = getRows(slices[slice].chunks, start, end);
+                if (rows == NULL) {
+                    ++counters.failedReads;
+                    break;
+                }
+                filterBounds(rows, start, count, lowerTable, pruneDistance, minDistances, counters);
+
+                // Keep the grids we cannot prune
+                long long candidateTotal = 0;
+                for (long long i = 0; i < count; ++i) {
+                    if (minDistances[i] <= pruneDistance && !isDeleted(start + i)) {
+                        candidates[candidateTotal++] = start + i;
+                    }
+                }
+                counters.candidates += candidateTotal;
+                COUNT_STATS(counters.filterSeconds += getLap(lap));
+
+                // Compute the actual distance of the candidates
+                counters.refined += candidateTotal;
+                if (asyncReads) {
+                    reads[slot].candidates.clear();
+                    for (long long i = 0; i < candidateTotal; ++i) {
+                        reads[slot].candidates.push_back(std::make_pair(minDistances[candidates[i] - start], candidates[i]));
+                    }
+                    submitBatch(reads, slot, queue, counters, score);
+                    slot ^= 1;
+                    completeBatch(reads, slot, queue, counters, score);
+                } else {
+                    for (long long i = 0; i < candidateTotal; ++i) {
+                        score(std::make_pair(minDistances[candidates[i] - start], candidates[i]), readObject(candidates[i], counters));
+                    }
+                }
+                COUNT_STATS(if (candidateTotal > 0) counters.refineSeconds += getLap(lap));
+            }
+            finishRows(slices[slice].chunks);
+            if (asyncReads) {
+                completeBatch(reads, 0, queue, counters, score);
+                completeBatch(reads, 1, queue, counters, score);
+                sortResults(slices[slice].results);
+                COUNT_STATS(counters.refineSeconds += getLap(lap));
+            }
+
+            std::lock_guard<std::mutex> lock(statsMutex);
+            total += counters;
+        });
+        candidateCount = total.candidates;
+
+        // The slices are in index order
+        std::vector<Results::Result>& results = context.results;
+        results.clear();
+        for (int slice = 0; slice < ThreadPool::getThreadCount(); ++slice) {
+            results.insert(results.end(), slices[slice].results.begin(), slices[slice].results.end());
+        }
+        visitResults(visitor, results, false, total);
+        return total;
+    }
+
+    QueryStats kNNQuery(const std::vector<double>& point, long long k, Results::Visitor& visitor, Context::QueryContext& context) {
+        if (mappedFile == NULL || k <= 0) {
+            return QueryStats();
+        }
+
+        // Pairs of (distance, index) are ordered by distance and then by index,
+        // which breaks ties the same way a sequential scan does
+        typedef Context::Entry Entry;
+
+        // Squared bound contributions of every cell for this query, all
+        // distances below are squared
+        getBoundTables(point, context.lowerTable, context.upperTable);
+        const double *lowerTable = context.lowerTable.data();
+        const double *upperTable = context.upperTable.data();
+        getCells(point, context.cells);
+        const int *cells = context.cells.data();
+        const double *query;
+        const int *order = getQueryOrder(point, context, query);
+
+        // Refinement stops at the deadline once it has k candidates. With
+        // knnCandidates the slices refine at most max(k, knnCandidates)
+        // candidates together: every slice its share, and once all of them
+        // are done what they did not use of their shares goes to the
+        // candidates they left
+        StatsClock::time_point deadline = StatsClock::now() + std::chrono::microseconds(knnTime);
+        long long candidateBudget = std::max(k, knnCandidates);
+        std::atomic<long long> spareCandidates(0);
+
+        // The k-th smallest upper bound and k-th exact distance found by any
+        // slice bound the k-th neighbour, so slices share them to prune
+        std::atomic<double> sharedThreshold(std::numeric_limits<double>::infinity());
+        std::atomic<double> sharedDistance(std::numeric_limits<double>::infinity());
+
+        std::vector<Context::Slice>& slices = context.getSlices(ThreadPool::getThreadCount());
+        QueryStats total;
+        std::mutex statsMutex;
+        ThreadPool::parallelFor(objectCount, [&](int slice, long long begin, long long end) {
+            QueryStats counters;
+            COUNT_STATS(StatsClock::time_point lap = StatsClock::now());
+
+            // The k smallest upper bounds seen by this slice, a heap with the
+            // largest on top
+            std::vector<Entry>& upperBounds = slices[slice].upperBounds;
+
+            // Phase one: every approximation whose lower bound does not exceed
+            // the k-th smallest upper bound is a candidate
+            std::vector<Entry>& candidates = slices[slice].candidates;
+            double minDistances[SCAN_BLOCK], maxDistances[SCAN_BLOCK];
+            for (long long start = begin; start < end; start += SCAN_BLOCK) {
+                long long count = std::min((long long) SCAN_BLOCK, end - start);
+                double threshold = sharedThreshold.load(std::memory_order_relaxed);
+                if (skipRun(start, count, cells, lowerTable, threshold * SLACK)) {
+                    continue;
+                }
+                // A slice that cannot read its approximations refines nothing
+                const unsigned char *rows = getRows(slices[slice].chunks, start, end);
+                if (rows == NULL) {
+                    ++counters.failedReads;
+                    candidates.clear();
+                    break;
+                }
+                filterBounds(rows, start, count, lowerTable, threshold * SLACK, minDistances, counters);
+                bool summed = sumPassing(rows, count, minDistances, threshold * SLACK, upperTable, maxDistances);
+
+                for (long long i = 0; i < count; ++i) {
+                    if (minDistances[i] > threshold * SLACK || isDeleted(start + i)) {
+                        continue;
+                    }
+                    // Without refinement a candidate is ranked by the middle of
+                    // its bounds, an estimate of its distance
+                    long long index = start + i;
+                    double maxDistance = summed ? maxDistances[i] : getBound(rows + i * stride, upperTable);
+                    candidates.push_back(std::make_pair(knnApproximate ? (minDistances[i] + maxDistance) / 2 : minDistances[i], index));
+
+                    // Tighten the threshold with the upper bound of this cell
+                    if ((long long) upperBounds.size() < k) {
+                        upperBounds.push_back(std::make_pair(maxDistance, index));
+                        std::push_heap(upperBounds.begin(), upperBounds.end());
+                    } else if (maxDistance < upperBounds.front().first) {
+                        std::pop_heap(upperBounds.begin(), upperBounds.end());
+                        upperBounds.back() = std::make_pair(maxDistance, index);
+                        std::push_heap(upperBounds.begin(), upperBounds.end());
+                    }
+                    if ((long long) upperBounds.size() == k && upperBounds.front().first < threshold) {
+                        threshold = upperBounds.front().first;
+                        ThreadPool::atomicMin(sharedThreshold, threshold);
+                    }
+                }
+            }
+
+            finishRows(slices[slice].chunks);
+            counters.candidates = candidates.size();
+            COUNT_STATS(counters.filterSeconds = getLap(lap));
+
+            // A heap of the k nearest neighbours of the slice
+            std::vector<Entry>& nearestNeighbours = slices[slice].neighbours;
 
-        // Maintain a priority queue for the k nearest neighbours
-        std::priority_queue< std::pair<long long, double>, std::vector< std::pair<long long, double> >, comparator > fileIndices;
+            // Ranked by the approximations, the k candidates with the smallest
+            // estimates are the neighbours of the slice
+            if (knnApproximate) {
+                long long count = std::min(k, (long long) candidates.size());
+                std::partial_sort(candidates.begin(), candidates.begin() + count, candidates.end());
+                nearestNeighbours.assign(candidates.begin(), candidates.begin() + count);
+                COUNT_STATS(counters.refineSeconds = getLap(lap));
 
-        // Loop over the entire VAFile and prune the matches
-        for(std::string line; std::getline(ifile, line);) {
-            auto VAPair = parseVALine(line);
-            double minDistance = getMinDistance(point, VAPair.first);
+                std::lock_guard<std::mutex> lock(statsMutex);
+                total += counters;
+                return;
+            }
+
+            // Phase two: visit the candidates in increasing order of lower
+            // bound, with knnCandidates at most the slice's share of the
+            // budget. They are taken off a heap rather than sorted, since
+            // refinement usually stops long before the last of them
+            long long share = candidateBudget * end / objectCount - candidateBudget * begin / objectCount;
+            std::make_heap(candidates.begin(), candidates.end(), std::greater<Entry>());
+            long long visited = 0;
+            auto nextCandidate = [&](double kthDistance, Entry& candidate) {
+                // No remaining candidate can be closer than the k-th neighbour
+                if (candidates.empty() || candidates.front().first > kthDistance * SLACK) {
+                    return false;
+                }
+                if (knnCandidates > 0 && visited >= share) {
+                    return false;
+                }
+                std::pop_heap(candidates.begin(), candidates.end(), std::greater<Entry>());
+                candidate = candidates.back();
+                candidates.pop_back();
+                ++visited;
+                return true;
+            };
+
+            long long refined = 0;
+            auto score = [&](const Entry& candidate, const unsigned char *read, double kthDistance) {
+                // Get the actual distance from the point, an object beyond
+                // the k-th distance of any slice is not a neighbour
+                const double *object = getExact(point.data(), candidate.second, read, kthDistance, counters);
+                if (object == NULL) {
+                    return;
+                }
+                Entry neighbour(Kernels::squaredDistanceBounded(query, object, dimensionCount, order, kthDistance), candidate.second);
+                if (neighbour.first > kthDistance) {
+                    return;
+                }
 
-            // If the queue is empty, we push elements into it
-            if ((long long)fileIndices.size() < k) {
-                fileIndices.push(std::make_pair(VAPair.second, minDistance));
+                if ((long long) nearestNeighbours.size() < k) {
+                    nearestNeighbours.push_back(neighbour);
+                    std::push_heap(nearestNeighbours.begin(), nearestNeighbours.end());
+                } else if (neighbour < nearestNeighbours.front()) {
+                    std::pop_heap(nearestNeighbours.begin(), nearestNeighbours.end());
+                    nearestNeighbours.back() = neighbour;
+                    std::push_heap(nearestNeighbours.begin(), nearestNeighbours.end());
+                }
+                if ((long long) nearestNeighbours.size() == k) {
+                    ThreadPool::atomicMin(sharedDistance, nearestNeighbours.front().first);
+                }
+            };
+
+            if (asyncReads) {
+                // Windows of candidates are read in index order while the
+                // previous window is scored; a window grows from k candidates
+                // so that the first reads come back soon
+                Context::ReadBatch *reads = slices[slice].reads;
+                Reader::ReadQueue& queue = Reader::getThreadQueue();
+                auto scoreRead = [&](const Entry& candidate, const unsigned char *object) {
+                    double kthDistance = sharedDistance.load(std::memory_order_relaxed);
+                    if (candidate.first <= kthDistance * SLACK) {
+                        ++refined;
+                        score(candidate, object, kthDistance);
+                    }
+                };
+                long long window = std::min(k, (long long) SCAN_BLOCK);
+                int slot = 0;
+                bool exhausted = false;
+                while (!exhausted || reads[0].pending > 0 || reads[1].pending > 0) {
+                    double kthDistance = sharedDistance.load(std::memory_order_relaxed);
+                    std::vector<Entry>& windowCandidates = reads[slot].candidates;
+                    windowCandidates.clear();
+                    bool expired = knnTime > 0 && visited >= k && StatsClock::now() > deadline;
+                    Entry candidate;
+                    while (!exhausted && !expired && (long long) windowCandidates.size() < window && nextCandidate(kthDistance, candidate)) {
+                        windowCandidates.push_back(candidate);
+                    }
+
+                    // Nothing is left to refine, or the time is up
+                    exhausted = exhausted || windowCandidates.empty();
+                    std::sort(windowCandidates.begin(), windowCandidates.end(), [](const Entry& first, const Entry& second) {
+                        return first.second < second.second;
+                    });
+                    submitBatch(reads, slot, queue, counters, scoreRead);
+                    slot ^= 1;
+                    completeBatch(reads, slot, queue, counters, scoreRead);
+                    window = std::min(window * 2, (long long) SCAN_BLOCK);
+                }
             } else {
-                // The pruning distance is the maximum distance of any point in the queue
-                // Any element which is closer than the elements in the queue is pushed
-                // onto the queue
+                Entry candidate;
+                for (;;) {
+                    // Past the deadline the neighbours found so far are the answer
+                    double kthDistance = sharedDistance.load(std::memory_order_relaxed);
+                    if (knnTime > 0 && refined >= k && StatsClock::now() > deadline) {
+                        break;
+                    }
+                    if (!nextCandidate(kthDistance, candidate)) {
+                        break;
+                    }
+                    ++refined;
+                    score(candidate, readObject(candidate.second, counters), kthDistance);
+                }
+            }
+            if (knnCandidates > 0 && visited < share && counters.failedReads == 0) {
+                spareCandidates += share - visited;
+            }
+            counters.refined = refined;
+            COUNT_STATS(counters.refineSeconds = getLap(lap));
+
+            std::lock_guard<std::mutex> lock(statsMutex);
+            total += counters;
+        });
+
+        // Merge the neighbours of the slices and keep the k nearest
+        std::vector<Entry>& nearestNeighbours = context.neighbours;
+        nearestNeighbours.clear();
+        for (int slice = 0; slice < ThreadPool::getThreadCount(); ++slice) {
+            nearestNeighbours.insert(nearestNeighbours.end(), slices[slice].neighbours.begin(), slices[slice].neighbours.end());
+        }
+        std::sort(nearestNeighbours.begin(), nearestNeighbours.end());
+        if ((long long) nearestNeighbours.size() > k) {
+            nearestNeighbours.resize(k);
+        }
+
+        // Phase three: what the slices left of their shares refines the
+        // candidates they did not get to, over all slices in increasing
+        // order of lower bound, so that the budget is used whatever the
+        // timing of the slices
+        long long spare = spareCandidates.load();
+        if (spare > 0 && !knnApproximate && total.failedReads == 0) {
+            double kthDistance = (long long) nearestNeighbours.size() == k ? nearestNeighbours.back().first
+                : std::numeric_limits<double>::infinity();
+            std::vector<Entry>& leftCandidates = context.candidates;
+            leftCandidates.clear();
+            for (int slice = 0; slice < ThreadPool::getThreadCount(); ++slice) {
+                for (auto& candidate : slices[slice].candidates) {
+                    if (candidate.first <= kthDistance * SLACK) {
+                        leftCandidates.push_back(candidate);
+                    }
+                }
+            }
+            long long count = std::min(spare, (long long) leftCandidates.size());
+            std::partial_sort(leftCandidates.begin(), leftCandidates.begin() + count, leftCandidates.end());
+            for (long long i = 0; i < count && leftCandidates[i].first <= kthDistance * SLACK; ++i) {
+                if (knnTime > 0 && total.refined >= k && StatsClock::now() > deadline) {
+                    break;
+                }
+                ++total.refined;
+                long long index = leftCandidates[i].second;
+                const double *object = getExact(point.data(), index, readObject(index, total), kthDistance, total);
+                if (object == NULL) {
+                    continue;
+                }
+                Entry neighbour(Kernels::squaredDistanceBounded(query, object, dimensionCount, order, kthDistance), index);
+                if (neighbour.first > kthDistance) {
+                    continue;
+                }
 
-                // Otherwise check the pruning distance criterion
-                if (minDistance < fileIndices.top().second) {
-                    // Push the new element
-                    fileIndices.push(std::make_pair(VAPair.second, minDistance));
+                // Keep the neighbours sorted, the k-th last
+                nearestNeighbours.insert(std::upper_bound(nearestNeighbours.begin(), nearestNeighbours.end(), neighbour), neighbour);
+                if ((long long) nearestNeighbours.size() > k) {
+                    nearestNeighbours.pop_back();
+                }
+                if ((long long) nearestNeighbours.size() == k) {
+                    kthDistance = nearestNeighbours.back().first;
                 }
             }
         }
+        candidateCount = total.refined;
 
-        // The work of this file is over
-        ifile.close();
+        std::vector<Results::Result>& results = context.results;
+        results.clear();
+        for (auto& neighbour : nearestNeighbours) {
+            results.push_back(Results::Result{ neighbour.second, std::sqrt(neighbour.first), NULL, 0 });
+        }
+        visitResults(visitor, results, true, total);
+        return total;
+    }
 
-        // Maintain a priority queue for the k nearest neighbours
-        std::priority_queue< std::pair<std::string, double>,
-            std::vector< std::pair<std::string, double> >, comparator2 > nearestNeighbours;
+    std::vector<long long> pointSearch(const std::vector<double>& point) {
+        Results::Buffer buffer;
+        pointQuery(point, buffer);
+        return getIndices(buffer);
+    }
 
-        // Now we loop over the entire non pruned nodes and perform full computation
-        while (!fileIndices.empty()) {
-            // Get the current file index
-            auto fileIndex = fileIndices.top().first;
-            fileIndices.pop();
+    std::vector<long long> rangeSearch(const std::vector<double>& point, double radius) {
+        Results::Buffer buffer;
+        rangeQuery(point, radius, buffer);
+        return getIndices(buffer);
+    }
 
-            // get the point from the file
-            std::ifstream ifile(OBJECTBASE + std::to_string(fileIndex));
-            std::string line;
-            std::getline(ifile, line);
-            auto dataPair = parseNormalLine(line);
+    std::vector<long long> kNNSearch(const std::vector<double>& point, long long k) {
+        Results::Buffer buffer;
+        kNNQuery(point, k, buffer);
+        return getIndices(buffer);
+    }
 
-            // Get the actual distance from the point
-            double minDistance = getDistance(point, dataPair.first);
+    std::vector< std::vector<long long> > batchSearch(const std::vector<Query>& queries) {
+        long long queryCount = queries.size();
+        std::vector< std::vector<long long> > results(queryCount);
+        if (mappedFile == NULL) {
+            return results;
+        }
 
-            // If the queue is empty, we push elements into it
-            if ((long long) nearestNeighbours.size() < k) {
-                nearestNeighbours.push(std::make_pair(dataPair.second, minDistance));
+        // Pairs of (distance, index) are ordered by distance and then by index
+        typedef std::pair<double, long long> Entry;
+
+        // Per query state: the packed grid of point queries, the tables and
+        // squared radius of range and kNN queries, and the shared thresholds
+        std::vector< std::vector<unsigned char> > grids(queryCount);
+        std::vector< std::vector<double> > lowerTables(queryCount), upperTables(queryCount);
+        std::vector< std::vector<int> > cells(queryCount);
+        std::vector<double> pruneDistances(queryCount);
+        std::vector< std::atomic<double> > sharedThresholds(queryCount);
+        std::vector< std::atomic<double> > sharedDistances(queryCount);
+        for (long long query = 0; query < queryCount; ++query) {
+            if (queries[query].type == POINT) {
+                grids[query].resize(stride);
+                packGrid(getGrid(queries[query].point), grids[query].data());
             } else {
-                // The pruning distance is the maximum distance of any point in the queue
-                // Any element which is closer than the elements in the queue is pushed
-                // onto the queue
+                getBoundTables(queries[query].point, lowerTables[query], upperTables[query]);
+            }
+            getCells(queries[query].point, cells[query]);
+            pruneDistances[query] = queries[query].radius * queries[query].radius * SLACK;
+            sharedThresholds[query] = std::numeric_limits<double>::infinity();
+            sharedDistances[query] = std::numeric_limits<double>::infinity();
+        }
+
+        // Filter: one pass over the VAFile, every block of approximations is
+        // checked against all the queries while it is in cache
+        int slices = ThreadPool::getThreadCount();
+        std::vector< std::vector< std::vector<Entry> > > sliceCandidates(slices, std::vector< std::vector<Entry> >(queryCount));
+        std::vector<Context::Chunk> chunks(2 * slices);
+        for (auto& chunk : chunks) {
+            chunk.clear();
+        }
+        std::atomic<bool> failedReads(false);
+        ThreadPool::parallelFor(objectCount, [&](int slice, long long begin, long long end) {
+            std::vector< std::vector<Entry> >& candidates = sliceCandidates[slice];
+            std::vector< std::priority_queue<Entry> > upperBounds(queryCount);
+
+            double minDistances[SCAN_BLOCK], maxDistances[SCAN_BLOCK];
+            for (long long start = begin; start < end; start += SCAN_BLOCK) {
+                long long count = std::min((long long) SCAN_BLOCK, end - start);
+                const unsigned char *block = getRows(chunks.data() + 2 * slice, start, end);
+                if (block == NULL) {
+                    failedReads = true;
+                    break;
+                }
+
+                for (long long query = 0; query < queryCount; ++query) {
+                    const Query& current = queries[query];
+
+                    // Blocks whose summaries rule the query out are skipped
+                    double limit = current.type == POINT ? 0 : current.type == RANGE ? pruneDistances[query]
+                        : sharedThresholds[query].load(std::memory_order_relaxed) * SLACK;
+                    if (skipRun(start, count, cells[query].data(), current.type == POINT ? NULL : lowerTables[query].data(), limit)) {
+                        continue;
+                    }
+
+                    if (current.type == POINT) {
+                        for (long long i = 0; i < count; ++i) {
+                            if (std::memcmp(block + i * stride, grids[query].data(), stride) == 0 && !isDeleted(start + i)) {
+                                candidates[query].push_back(std::make_pair(0.0, start + i));
+                            }
+                        }
+                        continue;
+                    }
+
+                    sumBounds(block, count, lowerTables[query].data(), minDistances);
+                    if (current.type == RANGE) {
+                        for (long long i = 0; i < count; ++i) {
+                            if (minDistances[i] <= pruneDistances[query] && !isDeleted(start + i)) {
+                                candidates[query].push_back(std::make_pair(minDistances[i], start + i));
+                            }
+                        }
+                    } else if (current.type == KNN && current.k > 0) {
+                        // Same filter as kNNSearch
+                        double threshold = sharedThresholds[query].load(std::memory_order_relaxed);
+                        bool summed = sumPassing(block, count, minDistances, threshold * SLACK, upperTables[query].data(), maxDistances);
+                        for (long long i = 0; i < count; ++i) {
+                            if (minDistances[i] > threshold * SLACK || isDeleted(start + i)) {
+                                continue;
+                            }
+                            double maxDistance = summed ? maxDistances[i] : getBound(block + i * stride, upperTables[query].data());
+                            candidates[query].push_back(std::make_pair(knnApproximate ? (minDistances[i] + maxDistance) / 2 : minDistances[i],
+                                        start + i));
+
+                            if ((long long) upperBounds[query].size() < current.k) {
+                                upperBounds[query].push(std::make_pair(maxDistance, start + i));
+                            } else if (maxDistance < upperBounds[query].top().first) {
+                                upperBounds[query].pop();
+                                upperBounds[query].push(std::make_pair(maxDistance, start + i));
+                            }
+                            if ((long long) upperBounds[query].size() == current.k && upperBounds[query].top().first < threshold) {
+                                threshold = upperBounds[query].top().first;
+                                ThreadPool::atomicMin(sharedThresholds[query], threshold);
+                            }
+                        }
+                    }
+                }
+            }
+            finishRows(chunks.data() + 2 * slice);
+        });
+        if (failedReads) {
+            return std::vector< std::vector<long long> >();
+        }
+
+        // Merge the candidates of all queries into one list of (lower bound,
+        // index, query) sorted by index, so every object is read once
+        struct Candidate {
+            double minDistance;
+            long long index;
+            long long query;
+
+            bool operator<(const Candidate& other) const {
+                return index < other.index || (index == other.index && query < other.query);
+            }
+        };
+        std::vector<Candidate> candidates;
+        for (long long query = 0; query < queryCount; ++query) {
+            double threshold = sharedThresholds[query].load() * SLACK;
+            std::vector<Entry> queryCandidates;
+            for (auto& sliceCandidate : sliceCandidates) {
+                for (auto& candidate : sliceCandidate[query]) {
+                    if (candidate.first <= threshold) {
+                        queryCandidates.push_back(candidate);
+                    }
+                }
+                std::vector<Entry>().swap(sliceCandidate[query]);
+            }
+
+            // Ranked by the approximations, a kNN query is answered by its k
+            // candidates with the smallest estimates
+            long long k = queries[query].k;
+            if (queries[query].type == KNN && knnApproximate) {
+                long long count = std::min(std::max(0LL, k), (long long) queryCandidates.size());
+                std::partial_sort(queryCandidates.begin(), queryCandidates.begin() + count, queryCandidates.end());
+                for (long long i = 0; i < count; ++i) {
+                    results[query].push_back(queryCandidates[i].second);
+                }
+                continue;
+            }
 
-                // Otherwise check the pruning distance criterion
-                if (minDistance < nearestNeighbours.top().second) {
-                    // We don't need the top now
-                    nearestNeighbours.pop();
+            // Only the knnCandidates candidates with the smallest lower bounds
+            // are refined
+            long long limit = std::max(k, knnCandidates);
+            if (queries[query].type == KNN && knnCandidates > 0 && (long long) queryCandidates.size() > limit) {
+                std::nth_element(queryCandidates.begin(), queryCandidates.begin() + limit, queryCandidates.end());
+                queryCandidates.resize(limit);
+            }
 
-                    // Push the new element
-                    nearestNeighbours.push(std::make_pair(dataPair.second, minDistance));
+            // The refinement pass is in index order rather than by lower bound,
+            // so seed the k-th distance of a kNN query from its k candidates
+            // with the smallest lower bounds
+            if (queries[query].type == KNN && (long long) queryCandidates.size() > k) {
+                std::nth_element(queryCandidates.begin(), queryCandidates.begin() + k, queryCandidates.end());
+                double kthDistance = 0;
+                for (long long i = 0; i < k; ++i) {
+                    double distance = getSquaredDistance(queries[query].point.data(), ObjectStore::getPoint(queryCandidates[i].second));
+                    kthDistance = std::max(kthDistance, distance);
                 }
+                sharedDistances[query] = kthDistance;
             }
 
-            // Close the file
-            ifile.close();
+            for (auto& candidate : queryCandidates) {
+                if (queries[query].type != KNN || candidate.first <= sharedDistances[query].load() * SLACK) {
+                    Candidate merged = { candidate.first, candidate.second, query };
+                    candidates.push_back(merged);
+                }
+            }
         }
+        std::sort(candidates.begin(), candidates.end());
+
+        // Refine: a pass over the object store in index order
+        std::vector< std::vector< std::vector<Entry> > > sliceResults(slices, std::vector< std::vector<Entry> >(queryCount));
+        std::atomic<long long> refinedCount(0);
+        ThreadPool::parallelFor(candidates.size(), [&](int slice, long long begin, long long end) {
+            std::vector< std::vector<Entry> >& matches = sliceResults[slice];
+            std::vector< std::priority_queue<Entry> > nearestNeighbours(queryCount);
+
+            long long refined = 0;
+            QueryStats counters;
+            for (long long position = begin; position < end; ++position) {
+                const Candidate& candidate = candidates[position];
+                const Query& current = queries[candidate.query];
+
+                // kNN candidates beyond the k-th distance found so far are skipped
+                if (current.type == KNN && candidate.minDistance > sharedDistances[candidate.query].load(std::memory_order_relaxed) * SLACK) {
+                    continue;
+                }
+                ++refined;
+
+                // Read the rounded copy first with float precision
+                double bound = current.type == POINT ? 0
+                        : current.type == RANGE ? current.radius * current.radius
+                        : sharedDistances[candidate.query].load(std::memory_order_relaxed);
+                const double *object = getExact(current.point.data(), candidate.index, readObject(candidate.index, counters), bound, counters);
+                if (object == NULL) {
+                    continue;
+                }
+                if (current.type == POINT) {
+                    if (std::equal(object, object + dimensionCount, current.point.begin())) {
+                        matches[candidate.query].push_back(std::make_pair(0.0, candidate.index));
+                    }
+                } else if (current.type == RANGE) {
+                    if (std::sqrt(Kernels::squaredDistanceBounded(current.point.data(), object, dimensionCount, NULL,
+                                    pruneDistances[candidate.query])) <= current.radius) {
+                        matches[candidate.query].push_back(std::make_pair(0.0, candidate.index));
+                    }
+                } else {
+                    double kthDistance = sharedDistances[candidate.query].load(std::memory_order_relaxed);
+                    Entry neighbour(Kernels::squaredDistanceBounded(current.point.data(), object, dimensionCount, NULL, kthDistance),
+                            candidate.index);
+                    if (neighbour.first > kthDistance) {
+                        continue;
+                    }
+                    std::priority_queue<Entry>& heap = nearestNeighbours[candidate.query];
+                    if ((long long) heap.size() < current.k) {
+                        heap.push(neighbour);
+                    } else if (neighbour < heap.top()) {
+                        heap.pop();
+                        heap.push(neighbour);
+                    }
+                    if ((long long) heap.size() == current.k) {
+                        ThreadPool::atomicMin(sharedDistances[candidate.query], heap.top().first);
+                    }
+                }
+            }
+            refinedCount += refined;
 
-        // Now we loop over the neighbours and print them
-        while (!nearestNeighbours.empty()) {
-#ifdef OUTPUT
-            std::cout << nearestNeighbours.top().first << std::endl;
-#endif
-            nearestNeighbours.pop();
+            for (long long query = 0; query < queryCount; ++query) {
+                while (!nearestNeighbours[query].empty()) {
+                    matches[query].push_back(nearestNeighbours[query].top());
+                    nearestNeighbours[query].pop();
+                }
+            }
+        });
+        candidateCount = refinedCount.load();
+
+        // Gather the results of the slices for every query
+        for (long long query = 0; query < queryCount; ++query) {
+            std::vector<Entry> matches;
+            for (auto& sliceResult : sliceResults) {
+                matches.insert(matches.end(), sliceResult[query].begin(), sliceResult[query].end());
+            }
+
+            if (queries[query].type == KNN) {
+                std::sort(matches.begin(), matches.end());
+                if ((long long) matches.size() > queries[query].k) {
+                    matches.resize(std::max(0LL, queries[query].k));
+                }
+            }
+
+            // Report the original ids, in their order
+            if (ObjectStore::hasIds()) {
+                for (auto& match : matches) {
+                    match.second = ObjectStore::getId(match.second);
+                }
+                if (queries[query].type == KNN) {
+                    std::sort(matches.begin(), matches.end());
+                } else {
+                    std::sort(matches.begin(), matches.end(), [](const Entry& first, const Entry& second) {
+                        return first.second < second.second;
+                    });
+                }
+            }
+
+            for (auto& match : matches) {
+                results[query].push_back(match.second);
+            }
+        }
+        return results;
+    }
+
+    bool insertObjects(const Loader::Objects& objects) {
+        if (mappedFile == NULL || objects.dimensions != dimensionCount) {
+            return false;
+        }
+        long long count = objects.getCount();
+        if (count == 0) {
+            return true;
+        }
+        const double *points = objects.coordinates.data();
+
+        // Widen the outer cells to cover the new objects, the inner boundaries
+        // and so the cells of the existing objects stay the same
+        for (int i = 0; i < dimensionCount; ++i) {
+            double *boundary = boundaries.data() + tableOffsets[i] + i;
+            const int CELLS = 1 << bitsPerDimension[i];
+            for (long long index = 0; index < count; ++index) {
+                boundary[0] = std::min(boundary[0], points[index * dimensionCount + i]);
+                boundary[CELLS] = std::max(boundary[CELLS], points[index * dimensionCount + i]);
+            }
+        }
+
+        // Fold the new objects into the means
+        for (int i = 0; i < dimensionCount; ++i) {
+            double sum = dimensionMeans[i] * objectCount;
+            for (long long index = 0; index < count; ++index) {
+                sum += points[index * dimensionCount + i];
+            }
+            dimensionMeans[i] = sum / (objectCount + count);
+        }
+
+        std::vector<unsigned char> rows(count * getStride());
+        ThreadPool::parallelFor(count, [&](int, long long begin, long long end) {
+            for (long long index = begin; index < end; ++index) {
+                packPoint(points + index * dimensionCount, rows.data() + index * stride);
+            }
+        });
+
+        // The new approximations follow the old ones
+        Header header = *(const Header *) mappedFile;
+        const unsigned char *oldRows = mappedFile + header.dataOffset;
+        rows.insert(rows.begin(), oldRows, oldRows + header.objectCount * header.stride);
+
+        // The point index no longer covers the objects, the next open builds
+        // it again
+        std::string vaFile = vaFileName;
+        std::string objectFile = objectFileName;
+        closeVAFile();
+        std::remove(getPointIndexFile(vaFile).c_str());
+
+        // Both files are written next to the old ones and swapped in, so a
+        // crash leaves each of them whole. A store and a VAFile whose counts
+        // differ are not opened together, the index is built again instead
+        if (!ObjectStore::insert(objectFile, points, count, objects.payloadIndex.data(), objects.payloads.data())
+                || !writeVAFile(vaFile + ".insert", rows.data(), header.objectCount + count, header)
+                || std::rename((vaFile + ".insert").c_str(), vaFile.c_str()) != 0) {
+            return false;
+        }
+        return openFiles(vaFile, objectFile);
+    }
+
+    long long deleteObjects(const Loader::Objects& objects) {
+        if (mappedFile == NULL || objects.dimensions != dimensionCount) {
+            return 0;
         }
+
+        // Tombstone every live object with the coordinates, and the data string
+        // if one is given, of an object to delete
+        long long deleted = 0;
+        for (long long object = 0; object < objects.getCount(); ++object) {
+            const double *point = objects.coordinates.data() + object * dimensionCount;
+            std::string dataString = objects.payloads.substr(objects.payloadIndex[object],
+                    objects.payloadIndex[object + 1] - objects.payloadIndex[object]);
+            for (auto id : pointSearch(std::vector<double>(point, point + dimensionCount))) {
+                long long index = ObjectStore::getIndex(id);
+                if (dataString.empty() || ObjectStore::getDataString(index) == dataString) {
+                    tombstones[index >> 3] |= (unsigned char) (1 << (index & 7));
+                    ++deletedCount;
+                    ++deleted;
+                }
+            }
+        }
+
+        std::ofstream ofile(getTombstoneFile(vaFileName), std::ios::binary | std::ios::trunc);
+        ofile.write((const char *) tombstones.data(), tombstones.size());
+        ofile.close();
+
+        if (deletedCount > objectCount * COMPACT_FRACTION && !compactVAFile()) {
+            return -1;
+        }
+        return deleted;
+    }
+
+    bool compactVAFile() {
+        if (mappedFile == NULL) {
+            return false;
+        }
+        if (deletedCount == 0) {
+            return true;
+        }
+
+        // Gather the live objects and their approximations, the cells do not
+        // change so the approximations are copied as they are
+        const Header *header = (const Header *) mappedFile;
+        const unsigned char *rows = mappedFile + header->dataOffset;
+        std::vector<double> coordinates;
+        std::vector<uint64_t> payloadIndex(1, 0);
+        std::string payloads;
+        std::vector<unsigned char> liveRows;
+        // The live objects keep their ids, so the compacted store always
+        // has an id map
+        std::vector<uint64_t> ids;
+        for (long long index = 0; index < objectCount; ++index) {
+            if (isDeleted(index)) {
+                continue;
+            }
+            ids.push_back(ObjectStore::getId(index));
+            const double *point = ObjectStore::getPoint(index);
+            coordinates.insert(coordinates.end(), point, point + dimensionCount);
+            payloads += ObjectStore::getDataString(index);
+            payloadIndex.push_back(payloads.size());
+            liveRows.insert(liveRows.end(), rows + index * stride, rows + (index + 1) * stride);
+        }
+        long long count = payloadIndex.size() - 1;
+        int precision = ObjectStore::getPrecision();
+        Header source = *header;
+        std::string vaFile = vaFileName;
+        std::string objectFile = objectFileName;
+        closeVAFile();
+
+        // Write the compacted index next to the old one, which is opened
+        // again if either file cannot be written whole
+        bool written = ObjectStore::create(objectFile + ".compact", dimensionCount, precision);
+        if (written) {
+            ObjectStore::append(coordinates.data(), count, payloadIndex.data(), payloads.data());
+            ObjectStore::appendIds(ids.data(), ids.size());
+            written = ObjectStore::finish();
+        }
+        computeMeans(coordinates.data(), count);
+        if (!written || !writeVAFile(vaFile + ".compact", liveRows.data(), count, source)) {
+            std::remove((objectFile + ".compact").c_str());
+            std::remove((vaFile + ".compact").c_str());
+            openFiles(vaFile, objectFile);
+            return false;
+        }
+
+        // The objects are renumbered, so the point index goes before the
+        // compacted index is swapped in and the next open builds it again
+        std::remove(getPointIndexFile(vaFile).c_str());
+        if (std::rename((objectFile + ".compact").c_str(), objectFile.c_str()) != 0
+                || std::rename((vaFile + ".compact").c_str(), vaFile.c_str()) != 0) {
+            return false;
+        }
+        std::remove(getTombstoneFile(vaFile).c_str());
+
+        return openFiles(vaFile, objectFile);
+    }
+
+    long long getDeletedCount() {
+        return deletedCount;
     }
 }
@@ -23,12 +23,124 @@
 // config
 #include "config.h"
 
+// Runtime parameters
+#include "options.h"
+
+// Objects parsed from a data file
+#include "loader.h"
+
+// Query results
+#include "results.h"
+
+// Reusable query scratch
+#include "context.h"
+
 // STL
 #include <vector>
 #include <bitset>
 #include <string>
+#include <fstream>
+#include <cstdint>
 
 namespace VAFile {
+    // Binary VAFile format version, bump on any layout change
+    const uint32_t VERSION = 7;
+
+    // Most bits a single dimension can be allocated
+    const int MAX_BITS = 12;
+
+    // Bytes of zero padding after the last approximation, so that a cell can
+    // always be extracted with a fixed width read
+    const int PADDING = 8;
+
+    // Query types, as numbered in the query file
+    const int POINT = 1;
+    const int RANGE = 2;
+    const int KNN = 3;
+
+    /**
+     * A query of a batch, radius is used by range and k by kNN queries
+     */
+    struct Query {
+        int type;
+        std::vector<double> point;
+        double radius;
+        long long k;
+    };
+
+    /**
+     * Work done by a query, summed over the slices. Everything but the
+     * candidate, refined and failed read counts stays zero unless STATS is
+     * defined in config.h; the phase times are thread time.
+     */
+    struct QueryStats {
+        // Approximation bytes read and approximations bounded by the filter
+        long long bytesScanned;
+        long long approximations;
+
+        // Approximations left after the filter and objects actually compared
+        long long candidates;
+        long long refined;
+
+        // Object store bytes read for the refinement and the data strings
+        long long objectBytes;
+
+        // Seconds spent in the filter and in the refinement
+        double filterSeconds;
+        double refineSeconds;
+
+        // Reads of the files that could not be done, a query with any
+        // reports no results
+        long long failedReads;
+
+        QueryStats();
+        QueryStats& operator+=(const QueryStats& other);
+    };
+
+    /**
+     * On-disk header of the binary VAFile. It is followed at bitsOffset by
+     * the number of bits allocated to every dimension as uint32_t, at
+     * boundaryOffset by the 2^bits + 1 cell boundaries of every dimension as
+     * doubles, at meanOffset by the mean of every dimension of the objects as
+     * doubles, and at dataOffset by objectCount approximations of stride
+     * bytes each. Every approximation holds the dimensions cells bit-packed
+     * back to back in little endian order, bits is their total; the object
+     * index is the position of the approximation. dataSize and dataModified
+     * identify the data file the index was built from.
+     *
+     * With LAYOUT_BLOCKED the cells are stored again at blockOffset, in
+     * blocks of blockSize objects. A block holds the cells of its objects
+     * dimension after dimension, one byte each when no dimension has more
+     * than 8 bits and two bytes otherwise; the last block is zero filled.
+     *
+     * At summaryOffset every block of summaryBlock objects is summarized by
+     * the smallest cell of every dimension in it followed by the largest, as
+     * uint16_t. objectOrder records whether the objects were sorted by the
+     * Z-order of their cells at build time.
+     */
+    struct Header {
+        char magic[8];
+        uint32_t version;
+        uint32_t bits;
+        uint32_t dimensions;
+        uint32_t stride;
+        uint64_t objectCount;
+        uint32_t quantizer;
+        uint32_t allocation;
+        uint64_t bitsOffset;
+        uint64_t boundaryOffset;
+        uint64_t dataOffset;
+        uint64_t dataSize;
+        uint64_t dataModified;
+        uint32_t layout;
+        uint32_t blockSize;
+        uint64_t blockOffset;
+        uint64_t meanOffset;
+        uint32_t objectOrder;
+        uint32_t summaryBlock;
+        uint64_t summaryOffset;
+    };
+
     /**
      * Get the size of a file.
      * @param filename The name of the file to check size for
@@ -36,27 +148,100 @@ namespace VAFile {
      */
     long long getFileSize(const std::string& filename);
 
+    /**
+      * Split a budget of bits over the dimensions. ALLOCATION_UNIFORM gives
+      * every dimension uniformBits bits and ignores the budget;
+      * ALLOCATION_VARIANCE hands the bits out one at a time to the dimension
+      * with the largest variance left, each bit quartering its variance.
+      * @param points count points of dimensions doubles, back to back
+      * @param count Number of points
+      * @param dimensions Number of coordinates of a point
+      * @param allocation ALLOCATION_UNIFORM or ALLOCATION_VARIANCE
+      * @param uniformBits Bits of every dimension of a uniform allocation
+      * @param budget Total bits of an approximation
+      * @return The bits of every dimension
+      */
+    std::vector<int> allocateBits(const double *points, long long count, int dimensions, int allocation, int uniformBits, int budget);
+
+    /**
+      * Set the bits of every dimension used to pack and unpack
+      * approximations, this also sets the number of dimensions
+      * @param bits The bits of every dimension
+      */
+    void setAllocation(const std::vector<int>& bits);
+
+    /**
+      * Get the number of dimensions of the index
+      * @return The number of dimensions
+      */
+    int getDimensions();
+
+    /**
+      * Get the bits allocated to a dimension
+      * @param dimension The dimension
+      * @return Number of bits
+      */
+    int getBits(int dimension);
+
+    /**
+      * Get the offset of the cells of a dimension in the lookup tables
+      * @param dimension The dimension, getDimensions() gives the table size
+      * @return The offset
+      */
+    int getTableOffset(int dimension);
+
+    /**
+      * Fit the cell boundaries of the quantizer to a set of points. Cell c of
+      * a dimension spans [boundary[c], boundary[c + 1]]; the outer boundaries
+      * cover the data and [0, 1]. Uses the bits set by setAllocation.
+      * @param points count points of getDimensions() doubles, back to back
+      * @param count Number of points
+      * @param quantizer QUANTIZER_UNIFORM for equal width cells,
+      * QUANTIZER_QUANTILE for equi-depth cells, QUANTIZER_LLOYD for
+      * equi-depth cells refined by LLOYD_ITERATIONS rounds of Lloyd-Max
+      */
+    void computeBoundaries(const double *points, long long count, int quantizer);
+
+    /**
+      * Get the cell boundaries of a dimension
+      * @param dimension The dimension
+      * @return Pointer to the 2^bits + 1 boundaries
+      */
+    const double *getBoundaries(int dimension);
+
     /**
       * Compute the quantization of a given coordinate using binary search
+      * @param dimension The dimension of the coordinate
       * @param coordinate The coordinate
       * @return an integer quantization value
       */
-    int quantize(double coordinate);
+    int quantize(int dimension, double coordinate);
 
     /**
       * Get the quantized grid for a point
       * @param point The point as a vector<double>
       * @return grid The grid to which the point belongs as vector<bitset>
       */
-    std::vector< std::bitset<BITS> > getGrid(std::vector<double> point);
+    std::vector< std::bitset<MAX_BITS> > getGrid(const std::vector<double>& point);
 
     /**
-      * Get the minimum distance between a point and grid
-      * @param point The point as a vector<double>
-      * @param grid The grid as a vector<bitset>
-      * @return Minimum distance
+      * Build the per query lookup tables of squared bounds. Entry
+      * [getTableOffset(dimension) + cell] holds the squared contribution of that cell
+      * to the smallest (lowerTable) and the largest (upperTable) distance between
+      * the point and any object in the cell.
+      * @param point The query point
+      * @param lowerTable Output table of lower bound contributions
+      * @param upperTable Output table of upper bound contributions
+      */
+    void getBoundTables(const std::vector<double>& point, std::vector<double>& lowerTable, std::vector<double>& upperTable);
+
+    /**
+      * Get the squared distance between two points
+      * @param point1 The first point
+      * @param point2 The second point
+      * @return Squared distance
       */
-    double getMinDistance(std::vector<double> point, std::vector< std::bitset<BITS> > grid);
+    double getSquaredDistance(const double *point1, const double *point2);
 
     /**
       * Get the minimum distance between a point and grid
@@ -64,71 +249,192 @@ namespace VAFile {
       * @param point2 The second point as vector<double>
       * @return distance
       */
-    double getDistance(std::vector<double> point1, std::vector<double> point2);
-
-    /**
-      * Check if two objects are equal
-      * @param object1 The first object
-      * @param object2 The second object
-      * @return bool
-      */
-    bool equal(std::vector<double> object1, std::vector<double> object2);
-    bool equal(std::vector< std::bitset<BITS> > object1, std::vector< std::bitset<BITS> > object2);
+    double getDistance(const std::vector<double>& point1, const std::vector<double>& point2);
 
     /**
       * Parse a line from a normal file and return the coordinates
       * @param line The line to parse
+      * @param dimensions Number of coordinates on the line
       * @return A pair of the point as vector<double> and the string
       */
-    std::pair< std::vector<double>, std::string > parseNormalLine(std::string line);
+    std::pair< std::vector<double>, std::string > parseNormalLine(const std::string& line, int dimensions);
 
     /**
-      * Parse a line from a VAFile and return the coordinates and lineCount
-      * @param line The line to parse
-      * @return A pair of the point as vector<bitset> and the lineCount
+      * Number of bytes taken by one packed approximation
+      * @return stride in bytes
       */
-    std::pair< std::vector< std::bitset<BITS> >, long long> parseVALine(std::string line);
+    int getStride();
 
     /**
-      * Create a new file and store the vector, dataString
-      * @param point The point as vector<double> to write
-      * @param dataString the data string
-      * @param fileCount index of file to write to
-      * @return A pair of the point as vector<bitset> and the lineCount
+      * Pack the quantized cells of a point into an approximation
+      * @param grid The grid as a vector<bitset>
+      * @param row Output buffer of getStride() bytes
       */
-    void writeNormalFile(std::vector<double> point, std::string dataString, long long fileCount);
+    void packGrid(const std::vector< std::bitset<MAX_BITS> >& grid, unsigned char *row);
 
     /**
-      * Write a vector and lineCount to the VAFile
-      * @param point The point as vector<double> to write
-      * @param lineCount the data
-      * @param file The file to write to
-      * @return A pair of the point as vector<bitset> and the lineCount
+      * Quantize a point and pack its cells into an approximation
+      * @param point getDimensions() coordinates
+      * @param row Output buffer of getStride() bytes
       */
-    void writeVALine(std::vector<double> point, long long lineCount, std::ofstream& ofile);
+    void packPoint(const double *point, unsigned char *row);
+
+    /**
+      * Extract a single cell from a packed approximation
+      * @param row The packed approximation
+      * @param dimension The dimension to extract
+      * @return The cell number
+      */
+    unsigned long getCell(const unsigned char *row, int dimension);
+
+    /**
+      * Sum the table entries of the cells of a packed approximation
+      * @param row The packed approximation
+      * @param table A table from getBoundTables
+      * @return The squared bound
+      */
+    double getBound(const unsigned char *row, const double *table);
+
+    /**
+     * Build a VAFile and its object store from a normal file
+     * @param options The files and the parameters of the index
+     * @return false if the data file cannot be read or the files cannot be
+     * written
+     */
+    bool buildVAFile(const Options& options);
+
+    /**
+     * Memory map a VAFile for querying, a no-op if one is already mapped.
+     * The dimensions, bits and quantizer are read from its header.
+     * @param options The files of the index
+     * @return false if the files are missing or not a valid index
+     */
+    bool openVAFile(const Options& options);
+
+    /**
+     * Check if the mapped VAFile was built from the data file with the
+     * parameters of the options
+     * @param options The parameters asked for
+     * @return false if they differ or no VAFile is mapped
+     */
+    bool matchesOptions(const Options& options);
+
+    /**
+     * Unmap the VAFile
+     */
+    void closeVAFile();
+
+    /**
+     * Get the number of objects refined by the last query
+     * @return the candidate count
+     */
+    long long getCandidateCount();
+
+    /**
+     * Dump the binary VAFile in the old text format, one line per object:
+     * the cell of every dimension in binary, then the id of the object
+     * @param filename The file to write to
+     * @return false if no VAFile is mapped or the file cannot be written
+     */
+    bool exportVAFile(const std::string& filename);
+
+    /**
+     * Find the objects equal to a point, see pointQuery
+     * @param point The query point
+     * @return The object ids, in id order
+     */
+    std::vector<long long> pointSearch(const std::vector<double>& point);
+
+    /**
+     * Find the objects within a radius of a point, see rangeQuery
+     * @param point The query point
+     * @param radius Query radius
+     * @return The object ids, in id order
+     */
+    std::vector<long long> rangeSearch(const std::vector<double>& point, double radius);
+
+    /**
+     * Find the k nearest objects to a point, see kNNQuery
+     * @param point The query point
+     * @param k no of nearest neighbours
+     * @return The object ids, nearest first
+     */
+    std::vector<long long> kNNSearch(const std::vector<double>& point, long long k);
+
+    /**
+     * Evaluate a batch of queries with a single scan of the VAFile and a
+     * single refinement pass over the object store
+     * @param queries The queries to evaluate
+     * @return The object ids matched by every query, in id order for
+     * point and range queries and nearest first for kNN queries; none at
+     * all if the VAFile could not be read
+     */
+    std::vector< std::vector<long long> > batchSearch(const std::vector<Query>& queries);
+
+    /**
+     * Append objects to the mapped VAFile and its object store without a
+     * rebuild. They are quantized with the stored boundaries, the outer cells
+     * are widened to cover them; the data file is left as it is.
+     * @param objects The objects to insert, from Loader::load
+     * @return false if no VAFile is mapped or the files cannot be updated
+     */
+    bool insertObjects(const Loader::Objects& objects);
+
+    /**
+     * Tombstone the objects with the coordinates of an object to delete, and
+     * its data string if it is not empty. Queries skip tombstoned objects;
+     * the index is compacted once a quarter of its objects are deleted.
+     * @param objects The objects to delete, from Loader::load
+     * @return The number of objects deleted, -1 if the index could not be
+     * compacted
+     */
+    long long deleteObjects(const Loader::Objects& objects);
+
+    /**
+     * Rewrite the VAFile and the object store without the deleted objects.
+     * Objects keep their order and their ids but not their indices. If a
+     * file cannot be written the old VAFile is mapped again.
+     * @return false if no VAFile is mapped or the files cannot be rewritten
+     */
+    bool compactVAFile();
 
     /**
-     * Build a VAFile from a normal file
+     * Get the number of tombstoned objects of the mapped VAFile
+     * @return the deleted count
      */
-    void buildVAFile();
+    long long getDeletedCount();
 
     /**
-     * Perform pointQuery on the VAFile
-     * @param point A vector representation of the query point
+     * Find the objects equal to a point. Queries only read the mapped
+     * VAFile and may run concurrently with their own contexts; once the
+     * context and the visitor have grown they do not allocate.
+     * @param point The query point
+     * @param visitor Gets the results in index order, at distance 0
+     * @param context Scratch memory, that of the calling thread by default
+     * @return The work done by the query
      */
-    void pointQuery(std::vector<double> point);
+    QueryStats pointQuery(const std::vector<double>& point, Results::Visitor& visitor,
+            Context::QueryContext& context = Context::getThreadContext());
 
     /**
-     * Perform rangeQuery on the VAFile
-     * @param point A vector representation of the query point
+     * Find the objects within a radius of a point
+     * @param point The query point
      * @param radius Query radius
+     * @param visitor Gets the results in index order
+     * @param context Scratch memory, that of the calling thread by default
+     * @return The work done by the query
      */
-    void rangeQuery(std::vector<double> point, double radius);
+    QueryStats rangeQuery(const std::vector<double>& point, double radius, Results::Visitor& visitor,
+            Context::QueryContext& context = Context::getThreadContext());
 
     /**
-     * Perform kNNQuery on the VAFile
-     * @param point A vector representation of the query point
+     * Find the k nearest objects to a point, ties broken by index
+     * @param point The query point
      * @param k no of nearest neighbours
+     * @param visitor Gets the results nearest first
+     * @param context Scratch memory, that of the calling thread by default
+     * @return The work done by the query
      */
-    void kNNQuery(std::vector<double> point, long long k);
+    QueryStats kNNQuery(const std::vector<double>& point, long long k, Results::Visitor& visitor,
+            Context::QueryContext& context = Context::getThreadContext());
 }